@@ -1,14 +1,19 @@
 @echo off
 
 set CompilerFlags=-MTd -Gm- -GR- -EHa- -nologo -Oi -FC -Z7 -W4 -wd4201 -wd4100 -wd4189 -wd4505 -wd4127 -wd4101 -wd4366 -wd4701
-set LinkerFlags= -INCREMENTAL:NO -opt:ref User32.lib Opengl32.lib Gdi32.lib Winmm.lib
+set LinkerFlags= -INCREMENTAL:NO -opt:ref User32.lib Opengl32.lib Gdi32.lib Winmm.lib Advapi32.lib Ws2_32.lib
 
 IF NOT EXIST ".\build" mkdir ".\build"
 pushd ".\build"
 
 if "%1" == "debug" goto debug
+if "%1" == "profile" goto profile
 
 :release
+cl /Fe:"program.exe" %CompilerFlags% -Oi -O2 -DNO_ASSERTS -DNO_TIMED_BLOCKS ..\code\main.cpp /link %LinkerFlags% 
+goto end
+
+:profile
 cl /Fe:"program.exe" %CompilerFlags% -Oi -O2 -DNO_ASSERTS ..\code\main.cpp /link %LinkerFlags% 
 goto end
 
@@ -64,6 +64,9 @@ typedef  intptr_t smm; // (32-bit: 4 bytes; 64-bit: 8 bytes)
 inline void ZeroSize(void *ptr, umm size){
     memset(ptr, 0, size);
 }
+
+// Gets the type from the 'dest' pointer to calculate the size.
+#define CopyArray(dest, source, count) memcpy((void *)(dest), (void *)(source), (count)*sizeof((dest)[0]))
 #define SWAP(a, b) {auto temp = (a); (a) = (b); (b) = temp;}
 
 
@@ -3,19 +3,85 @@
  This is a simple multithreaded CPU raytracer.
 
 * Controls: WASD to move, Space to ascend, Shift to descend, left click to orient camera,
-  Escape to exit.
+  R to reset the camera, 1-8 to change the scene, arrows to move the first light (or the
+  first sphere while holding Control), C to toggle the shadow cache, G to switch the
+  particles between a grid and a BVH, Q to quantize the particles, Escape to exit.
 
 * Uses WINAPI for input, threads, and window stuff.
 
-* Worker threads render groups of rows of pixels into a common frame buffer which is     
-  then sent to the GPU, and each frame rendered via OpenGL.
-
-* It only supports spheres and axis-aligned planes.
+* Worker threads render tiles of pixels into a common frame buffer which is then sent to
+  the GPU, and each frame rendered via OpenGL. The buffer is stored tile by tile, with 4
+  bytes per pixel, so the tiles of different threads never share a cache line, and it's
+  copied to a row-major one when the frame is done.
+
+* Before rendering a frame, each sphere is projected to the screen to make a list for each
+  tile of the spheres that its primary rays can hit, and we check which tiles can see the
+  plane. Tiles where there's nothing to hit are filled with the background directly.
+
+* It supports spheres, planes, axis-aligned boxes and triangles. Each kind of shape is
+  stored in its own bucket, with an array per component, and has its own intersection
+  kernel that tests 4 rays at a time with SSE. Only spheres cast soft shadows, the rest
+  cast hard shadows.
+
+* Triangle meshes can be loaded from OBJ files. They're stored as an array of vertex
+  positions and 3 indices per triangle, and each one has a BVH built with the surface area
+  heuristic. The worker threads build it in parallel: first they bin the triangles of the
+  top nodes by chunks, and then each one builds a whole subtree. The 4 rays are traced
+  through the BVH together, visiting the nodes that any of them hits. The 5th scene loads
+  data/model.obj, or makes a knot of a million triangles if there's no such file.
+
+* Meshes can be animated (the 5th scene has a small knot that twists back and forth).
+  Their BVHs aren't rebuilt every frame, just refitted: the bounds of each node are
+  recomputed bottom-up from the moved vertices, with the worker threads refitting a
+  subtree each. That gets worse as the triangles move around, so when the SAH cost of the
+  refitted BVH grows 30% over the cost it had when it was built, a new one is built from a
+  copy of the mesh on a background thread, and it replaces the refitted one when it's done.
+
+* A mesh can be drawn many times with instances, which have their own position, rotation,
+  scale and material but share the triangles and the BVH of the mesh. There's a BVH over
+  the instances too, and when a leaf is reached the rays are moved to the space of the
+  instance's mesh to traverse its BVH. The 6th scene has 4000 instances of the same knot.
+
+* Particle clouds of small moving spheres (the 7th scene has 200k). Everything moves every
+  frame, so instead of refitting, the worker threads put the particles in a uniform grid
+  from scratch: they count the particles of each cell, and after a prefix sum of the
+  counts they put each one in its cells. Each ray walks through the cells it crosses in
+  order, and stops at the first one with a hit inside. G switches to a BVH built every
+  frame instead, to compare them.
+  With Q the rays read the particles from a traversal cache of 8 bytes per sphere, with the
+  center in 16 bit fixed point relative to its grid cell or BVH leaf, stored in the order
+  the rays visit them. The moving particles need their full spheres, so for them it's rebuilt
+  every frame next to those, and it makes the rays read less memory, not the scene take less.
+
+* Static point clouds are mapped from files instead of loaded, so they can be bigger than
+  the memory. The file has the BVH, with the nodes of each subtree next to each other, and
+  only the quantized spheres, sorted by leaf, which take half the pages of full ones. The
+  parts of it near the camera are prefetched. The 8th scene maps data/points.spheres, and
+  writes a point cloud of 2 million spheres there first if there isn't one.
+
+* The memory that only lives for a frame (the particle grids and BVHs, the refit state)
+  comes from a frame arena that is reset when the frame begins, and each worker thread has
+  a scratch arena for its tile buffers that is reset before each work entry, so the render
+  loop doesn't allocate. The arenas are aligned to cache lines, and can use large pages.
+
+* Frames can be split between processes: started with -coordinator [port], the program
+  gives part of the tiles of each frame to the processes started with -worker <host>
+  [port] (on the same machine or others), which render them and send their pixels back
+  over TCP. The tiles of a worker that takes too long are rendered by the coordinator.
+
+* With -server [port] there's no window: the program keeps the scene loaded and renders
+  the frames that other programs ask for over TCP, with their own camera and resolution.
+  The most urgent requests go first, and requests for the same view share one frame.
 
 * Each pixel that hits a shape shoots one light ray and one reflection ray. The reflection
   doesn't bounce and isn't shaded. Pixels are shaded using the Blinn-Phong reflectivity
-  model. The shading could easily and cheaply be improved to make more different materials
-  and allow lights of different colors.
+  model. The shading could easily and cheaply be improved to make more different materials.
+
+* There can be any number of spherical lights of different colors. Each tile first traces
+  its primary rays, and then only shades with the lights that can reach the bounding box
+  of its hit positions (the light strength fades out to 0 at a certain distance). For each
+  of those lights, the shadows only test the spheres that are close to the cone between
+  the tile's hit positions and the light.
 
 * Soft shadows are computed via a hack I came up with, which only works for spherical
   lights and spherical blockers. You project each blocker sphere into the plane
@@ -34,6 +100,14 @@
   spheres that blocked any light. I just experimented a bit and came up with these values
   and their weights to reduce some artifacts that ocurred when only using one value.
 
+* The soft shadows cast by static spheres onto static shapes are baked into a world-space
+  cache when the scene loads: a lightmap over the plane and a latitude-longitude map over
+  each sphere, per light. The maps are split in chunks of texels that the worker threads
+  bake in parallel. Each texel stores the raw shadow accumulators instead of the final
+  light value, so that the dynamic spheres (like the camera) can still be accumulated on
+  top of it at render time. When a sphere or a light moves, only the chunks it could have
+  shadowed before or after the move get rebaked.
+
 * The coordinate system is left-handed: +X is right, +Z is forward, and +Y is up. This
   means that the cross product follows the left hand rule. Angles are counterclockwise and
   follow the right hand rule (thumb points to the direction of the axis of rotation).
@@ -48,6 +122,7 @@
 
 #define CREATE_CONSOLE false
 #define NUM_WORKER_THREADS 7
+#define USE_LARGE_PAGES false // The arenas need the "Lock pages in memory" privilege to use them.
 #define FRAME_BUFFER_WIDTH 640
 #define FRAME_BUFFER_HEIGHT 480
 
@@ -55,6 +130,8 @@
 
 
 
+#include <winsock2.h> // Before windows.h, which includes the old winsock.h otherwise.
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <stdio.h>
 #include <malloc.h>
@@ -330,6 +407,105 @@ void DeallocateMemory(void * ptr){
     free(ptr);
 }
 
+// Linear allocator for memory that doesn't outlive a frame (or a work entry): allocating just moves a
+// pointer forward, and everything is freed at once by resetting it. The allocations are aligned to
+// cache lines, so the ones of different threads never share one.
+#define ARENA_ALIGNMENT 64
+#define FRAME_ARENA_SIZE Megabytes(256)
+#define SCRATCH_ARENA_SIZE Megabytes(1)
+#define Megabytes(n) ((umm)(n)*1024*1024)
+
+struct memory_arena{
+    u8 *base;
+    umm size;
+    umm used;
+};
+
+// Tries to get the privilege that large pages need, once. Returns false if the user doesn't have it.
+b32 EnableLargePages(){
+    static b32 tried = false;
+    static b32 result = false;
+    if (!tried){
+        tried = true;
+        HANDLE token;
+        if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)){
+            TOKEN_PRIVILEGES privileges = {};
+            privileges.PrivilegeCount = 1;
+            privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+            if (LookupPrivilegeValueA(0, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)){
+                AdjustTokenPrivileges(token, FALSE, &privileges, 0, 0, 0);
+                result = (GetLastError() == ERROR_SUCCESS);
+            }
+            CloseHandle(token);
+        }
+        if (!result){
+            Printf("Large pages aren't available, using normal pages.\n");
+        }
+    }
+    return result;
+}
+
+// The memory is committed up front, but the OS only backs the pages when they are touched (unless they
+// are large pages).
+void InitArena(memory_arena *arena, umm size){
+    ZeroStruct(arena);
+    if (USE_LARGE_PAGES && EnableLargePages()){
+        umm largePageSize = GetLargePageMinimum();
+        umm largeSize = (size + largePageSize - 1)/largePageSize*largePageSize;
+        arena->base = (u8 *)VirtualAlloc(0, largeSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        arena->size = largeSize;
+    }
+    if (!arena->base){
+        arena->base = (u8 *)VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        arena->size = size;
+    }
+    Assert(arena->base);
+}
+
+u8 *PushSize(memory_arena *arena, umm size){
+    umm start = (arena->used + ARENA_ALIGNMENT - 1) & ~(umm)(ARENA_ALIGNMENT - 1);
+    Assert(start + size <= arena->size);
+    arena->used = start + size;
+    return arena->base + start;
+}
+#define PushArray(arena, type, count) ((type *)PushSize((arena), (count)*sizeof(type)))
+#define PushStruct(arena, type) ((type *)PushSize((arena), sizeof(type)))
+
+inline void ResetArena(memory_arena *arena){
+    arena->used = 0;
+}
+
+// Returns the contents of the file followed by a null terminator, or 0 if it can't be read. It must be
+// freed with DeallocateMemory().
+char *ReadEntireFile(char *path, umm *size){
+    char *result = 0;
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
+    if (file != INVALID_HANDLE_VALUE){
+        LARGE_INTEGER fileSize;
+        if (GetFileSizeEx(file, &fileSize)){
+            result = (char *)AllocateMemory((umm)fileSize.QuadPart + 1);
+            umm bytesRead = 0;
+            while(bytesRead < (umm)fileSize.QuadPart){ // ReadFile() can't read more than 4GB at a time.
+                umm remaining = (umm)fileSize.QuadPart - bytesRead;
+                DWORD chunkSize = (remaining > (1u << 30) ? (1u << 30) : (DWORD)remaining);
+                DWORD chunkRead = 0;
+                if (!ReadFile(file, result + bytesRead, chunkSize, &chunkRead, 0) || !chunkRead)
+                    break;
+                bytesRead += chunkRead;
+            }
+            if (bytesRead == (umm)fileSize.QuadPart){
+                result[bytesRead] = 0;
+                *size = bytesRead;
+            }else{
+                DeallocateMemory(result);
+                result = 0;
+            }
+        }
+        CloseHandle(file);
+    }
+    return result;
+}
+
 LRESULT CALLBACK Win32MainWindowCallback(HWND window, UINT   message, WPARAM wParam, LPARAM lParam) {
     LRESULT result = 0;
 
@@ -358,19 +534,423 @@ LRESULT CALLBACK Win32MainWindowCallback(HWND window, UINT   message, WPARAM wPa
 // World data ,,
 //
 
+#define TILE_SIZE 16 // Frames are rendered in square tiles of TILE_SIZE*TILE_SIZE pixels.
+#define MAX_TILE_PIXELS (TILE_SIZE*TILE_SIZE)
+#define MAX_TILES ((FRAME_BUFFER_WIDTH + TILE_SIZE - 1)/TILE_SIZE)*((FRAME_BUFFER_HEIGHT + TILE_SIZE - 1)/TILE_SIZE)
+#define MAX_WORK_ENTRIES 4096
+#define MAX_URGENT_ENTRIES 1024 // Strips of an image (see AddUrgentWorkEntry()).
+#define MAX_FRAMES_IN_FLIGHT 3 // Their tiles must fit in the work queue.
+#define BACKGROUND_PIXEL 0xff000000 // Black RGBX, with X = 255 since the texture is RGBA.
+
+#define MAX_SPHERES 256
+#define MAX_PLANES 8
+#define MAX_BOXES 64
+#define MAX_TRIANGLES 256
+#define MAX_MESHES 16
+#define MAX_INSTANCES 4096
+#define MAX_LIGHTS 64
+
+enum shape_type{
+    SHAPE_NONE,
+    SHAPE_SPHERE,
+    SHAPE_PLANE,
+    SHAPE_BOX,
+    SHAPE_TRIANGLE,
+    SHAPE_MESH,
+    SHAPE_INSTANCE,
+    SHAPE_PARTICLE,
+};
+
+struct sphere{
+    v3 c;
+    f32 r;
+};
+
+struct shape_material{
+    v3 color;
+    f32 reflectivity;
+    f32 emit;
+};
+inline shape_material ShapeMaterial(v3 color, f32 reflectivity){
+    shape_material result = {color, reflectivity, 0};
+    return result;
+}
+
+// Each kind of shape other than spheres is stored in a bucket with an array for each component, and
+// has its own intersection kernel (see IntersectSpheres4()). There's no generic shape, so a scene with
+// only spheres doesn't pay for the other kinds.
+
+// Infinite planes: Dot(n, p) = d
+struct plane_bucket{
+    f32 nx[MAX_PLANES];
+    f32 ny[MAX_PLANES];
+    f32 nz[MAX_PLANES];
+    f32 d[MAX_PLANES];
+    shape_material materials[MAX_PLANES];
+    s32 count;
+};
+
+// Axis-aligned boxes
+struct box_bucket{
+    f32 minX[MAX_BOXES];
+    f32 minY[MAX_BOXES];
+    f32 minZ[MAX_BOXES];
+    f32 maxX[MAX_BOXES];
+    f32 maxY[MAX_BOXES];
+    f32 maxZ[MAX_BOXES];
+    shape_material materials[MAX_BOXES];
+    s32 count;
+};
+
+// Triangles with vertices a, a + e1 and a + e2. They're double-sided.
+struct triangle_bucket{
+    f32 ax[MAX_TRIANGLES];
+    f32 ay[MAX_TRIANGLES];
+    f32 az[MAX_TRIANGLES];
+    f32 e1x[MAX_TRIANGLES];
+    f32 e1y[MAX_TRIANGLES];
+    f32 e1z[MAX_TRIANGLES];
+    f32 e2x[MAX_TRIANGLES];
+    f32 e2y[MAX_TRIANGLES];
+    f32 e2z[MAX_TRIANGLES];
+    shape_material materials[MAX_TRIANGLES];
+    s32 count;
+};
+
+// Bounding volume hierarchy of the triangles of a mesh, the instances of the scene or the particles. The two
+// children of a node are next to each other, and the primitives of a leaf are contiguous.
+struct bvh_node{
+    v3 min;
+    u32 first; // Leaves: first primitive. Inner nodes: first child.
+    v3 max;
+    u32 count; // Number of primitives. 0 for inner nodes.
+};
+struct bvh_tree{
+    bvh_node *nodes; // The root is the first one.
+    s32 numNodes;
+    f32 builtCost; // SAH cost of the BVH when it was built (see CompactBvh()).
+    f32 cost;      // SAH cost after the last refit.
+};
+
+// Indexed triangle mesh, with 3 vertex indices per triangle. Triangles are double-sided, like the ones of
+// the triangle bucket.
+struct mesh{
+    v3 *vertices;
+    u32 *indices;
+    s32 numVertices;
+    s32 numTriangles;
+    bvh_tree bvh;
+    shape_material material;
+    b32 instanced; // Only drawn through instances (see AddInstance()).
+
+    // Animation (see AnimateMeshes()): the vertices are the rest vertices twisted around the Z axis
+    // through twistCenter, back and forth.
+    v3 *restVertices; // 0 for static meshes.
+    v3 twistCenter;
+    f32 twistAmount; // Maximum twist, in radians per unit along Z.
+    struct bvh_rebuild *rebuild; // BVH being built in the background, or 0.
+};
+
+// A copy of a mesh placed somewhere else, which shares its triangles and its BVH. The rays are moved to
+// the space of the mesh to intersect it.
+struct instance{
+    s32 meshIndex;
+    v3 position;
+    mat3 toWorld;  // Rotation and scale, with row vectors (see MatrixMultiply()).
+    mat3 toObject; // Inverse of toWorld.
+    v3 min; // Bounds in world space.
+    v3 max;
+    shape_material material;
+};
+
+// How the particles of a cloud are found by the rays. Both are rebuilt from scratch every frame.
+enum particle_structure{
+    PARTICLES_GRID, // Uniform grid, traversed cell by cell along each ray.
+    PARTICLES_BVH,  // BVH with a few particles per leaf.
+};
+
+// Circular path of a particle around the center of its cloud.
+struct particle_orbit{
+    f32 radius;
+    f32 angle; // At time 0.
+    f32 height;
+    f32 speed; // Radians per second.
+};
+
+// Sphere stored in 8 bytes instead of 16, for the traversal of big particle clouds. The center is in 16 bit
+// fixed point relative to a box that contains it (the bounds of its BVH leaf, or its grid cell grown by the
+// maximum radius), and the radius relative to the maximum radius of the cloud. Sphere files only store
+// these, relative to their leaves. For the moving particles they're a cache that the rays read instead of
+// the spheres, since the particles move with their spheres at full precision.
+struct quantized_sphere{
+    u16 x, y, z;
+    u16 r;
+};
+
+// Lots of small moving spheres with the same material. They don't cast soft shadows or go in the
+// shadow cache like the scene's spheres, they're intersected like the rest of shapes.
+struct particle_cloud{
+    sphere *spheres;
+    particle_orbit *orbits;
+    s32 count;
+    f32 maxRadius;
+    v3 center;
+    shape_material material;
+    particle_structure structure;
+    v3 min; // Bounds of the current frame.
+    v3 max;
+    v3 *chunkMin; // Bounds of each chunk of PARTICLE_CHUNK_SIZE particles.
+    v3 *chunkMax;
+
+    // The grid, the BVH and the quantized spheres are in the frame arena, since they're rebuilt every frame.
+    // Grid: the particles of cell i are cellParticles[cellStarts[i]] to cellParticles[cellStarts[i + 1] - 1].
+    // A particle is in every cell its bounding box overlaps.
+    v3 gridMin;
+    f32 cellSize;
+    s32 gridDim[3];
+    u32 *cellStarts; // One per cell, plus the total at the end.
+    volatile LONG *cellCounts; // Used while the grid is built.
+    u32 *cellParticles;
+
+    // BVH
+    bvh_tree bvh;
+    u32 *sortedParticles; // Particles sorted by leaf.
+
+    // With 'quantized', the rays read these instead of the spheres. They are in the same order as
+    // cellParticles or sortedParticles, so the rays read them one after another instead of jumping
+    // around the spheres. For moving particles they're a traversal cache built every frame in addition
+    // to the spheres (one per cell a particle overlaps, with the grid), which are still used to move the
+    // particles and for the normals, so they reduce the memory the rays read, not the memory of the cloud.
+    b32 quantized;
+    quantized_sphere *quantizedSpheres;
+
+    // Clouds mapped from a sphere file (see MapSphereFile()) don't move, and they always use the BVH of
+    // the file. They're always quantized: the file only has the quantized spheres, relative to their
+    // leaves and already sorted by leaf, so there are no 'spheres' and no sortedParticles.
+    HANDLE file;
+    HANDLE fileMapping;
+    u8 *fileView; // 0 if the cloud isn't mapped.
+    struct sphere_file_region *regions;
+    s32 numRegions;
+    b32 *regionsPrefetched;
+};
+
+// NOTE: Lights are spheres too, so they are visible and reflected like the rest of shapes. Emissive
+// spheres don't cast shadows.
+struct sphere_light{
+    s32 sphereIndex;
+    v3 color;
+    f32 intensity; // Scales the distance attenuation, so it also determines the light's reach.
+    f32 reach;     // Distance from the light's center beyond which it doesn't affect anything.
+};
+
+struct scene{
+    sphere spheres[MAX_SPHERES];
+    shape_material sphereMaterials[MAX_SPHERES];
+    b32 dynamicSpheres[MAX_SPHERES]; // Spheres that move around all the time, which aren't included in the shadow cache.
+    s32 numSpheres;
+
+    plane_bucket planes;
+    box_bucket boxes;
+    triangle_bucket triangles;
+    mesh meshes[MAX_MESHES];
+    s32 numMeshes;
+    instance instances[MAX_INSTANCES];
+    u32 sortedInstances[MAX_INSTANCES]; // Instances sorted by leaf of instanceBvh.
+    s32 numInstances;
+    bvh_tree instanceBvh;
+    particle_cloud particles;
+
+    sphere_light lights[MAX_LIGHTS];
+    s32 numLights;
+
+    s32 cameraSphereIndex; // Sphere that follows the camera.
+};
+
+inline shape_material *GetShapeMaterial(scene *s, shape_type type, s32 index){
+    shape_material *result = 0;
+    switch(type){
+        case SHAPE_SPHERE:   result = &s->sphereMaterials[index]; break;
+        case SHAPE_PLANE:    result = &s->planes.materials[index]; break;
+        case SHAPE_BOX:      result = &s->boxes.materials[index]; break;
+        case SHAPE_TRIANGLE: result = &s->triangles.materials[index]; break;
+        case SHAPE_MESH:     result = &s->meshes[index].material; break;
+        case SHAPE_INSTANCE: result = &s->instances[index].material; break;
+        case SHAPE_PARTICLE: result = &s->particles.material; break;
+        default: Assert(false);
+    }
+    return result;
+}
+
+// Shadows from the static spheres, precomputed for the static surfaces: the planes and the static spheres.
+// There's a map for each pair of surface and light. The texels are baked in chunks, in parallel, when
+// the scene is loaded and when something moves (only the chunks that can be affected).
+#define SHADOW_CHUNK_SIZE 16 // The chunks are SHADOW_CHUNK_SIZE*SHADOW_CHUNK_SIZE texels.
+#define SHADOW_TEXELS_PER_UNIT 4.f
+#define SHADOW_MAX_PLANE_EXTENT 48.f // Half of the maximum width of a plane map.
+#define SHADOW_CACHE_R0 .0003f // Radius of the light cone at the surface (about the size of a pixel).
+
+// The state of the shadow accumulation (see AccumulateShadow()) quantized to 16 bits.
+struct shadow_texel{
+    u16 lMin;
+    u16 lSum;
+    u16 blockedAverage;
+    u16 blockCount;
+};
+
+struct shadow_map{
+    s32 lightIndex;
+    shape_type shapeType; // SHAPE_SPHERE or SHAPE_PLANE
+    s32 shapeIndex;
+    // For planes, texel (x, y) is at planePoint + (origin.x + x/SHADOW_TEXELS_PER_UNIT)*planeU + (origin.y + y/SHADOW_TEXELS_PER_UNIT)*planeV.
+    // For spheres, x is the longitude (wraps around), and y is the latitude from the top (+y) to the bottom.
+    v2 origin;
+    v3 planePoint;
+    v3 planeU;
+    v3 planeV;
+    v2s dim;
+    v2s chunkDim;
+    shadow_texel *texels;
+    b32 *dirtyChunks;
+};
+
+#define MAX_SHADOW_MAPS 2048
+struct shadow_cache{
+    shadow_map maps[MAX_SHADOW_MAPS];
+    s32 numMaps;
+    s16 planeMaps[MAX_LIGHTS][MAX_PLANES]; // Index of the map of each light and plane. -1 if there's none.
+    s16 sphereMaps[MAX_LIGHTS][MAX_SPHERES]; // Index of the map of each light and sphere. -1 if there's none.
+};
+
+struct bvh_builder;
+struct bvh_refit;
+
+enum work_type{
+    WORK_RENDER_TILE,
+    WORK_BAKE_SHADOW_CHUNK,
+    WORK_PREPARE_BVH_CHUNK,
+    WORK_BIN_BVH_CHUNK,
+    WORK_BUILD_BVH_SUBTREE,
+    WORK_ANIMATE_MESH_CHUNK,
+    WORK_REFIT_BVH_SUBTREE,
+    WORK_MOVE_PARTICLES,
+    WORK_COUNT_PARTICLE_CELLS,
+    WORK_FILL_PARTICLE_CELLS,
+    WORK_ENCODE_IMAGE_STRIP,
+};
 struct work_entry{
-    s32 firstRowY;
-    s32 numRows;
+    work_type type;
+    union{
+        struct{
+            struct frame_view *view;
+            v2s tileMin; // First pixel of the tile.
+            v2s tileMax; // One past the last pixel of the tile.
+            s32 tileIndex; // Subscript of view->tileBins.
+        };
+        struct{
+            s32 shadowMapIndex;
+            s32 shadowChunkIndex;
+        };
+        struct{
+            bvh_builder *bvhBuilder;
+            s32 bvhTaskIndex; // Chunk or subtree.
+        };
+        struct{
+            mesh *animatedMesh;
+            s32 meshChunkIndex;
+        };
+        struct{
+            bvh_refit *bvhRefit;
+            s32 refitTaskIndex;
+        };
+        struct{
+            particle_cloud *particleCloud;
+            s32 particleChunkIndex;
+        };
+        struct{
+            struct image_encoder *imageEncoder;
+            s32 imageStripIndex;
+        };
+    };
 };
-struct global_state{
-    u8 *frameBuffer;
+// Per-frame constants of a sphere for the primary rays, which all start at the camera position.
+struct primary_sphere{
+    v3 ro; // Camera position relative to the sphere's center.
+    f32 c; // Constant term of the quadratic equation of IntersectSphere().
+};
+
+// Shapes that can be hit by the primary rays of a tile (see BinShapes()).
+// The other kinds of shapes aren't binned individually, we just check if any of them can be hit.
+struct tile_bin{
+    s32 firstSphere; // Subscript of view->binnedSpheres.
+    s32 numSpheres;
+    b32 planes;
+    b32 boxes;
+    b32 triangles;
+    b32 meshes;
+    b32 instances;
+    b32 particles;
+};
+
+enum video_format{
+    VIDEO_NONE,
+    VIDEO_YUV420, // Planar 8 bit Y, then U and V at half resolution (what Y4M calls C420jpeg).
+    VIDEO_RGB,    // 3 bytes per pixel.
+};
+
+// Everything about a frame that depends on its camera, so that frames of different views can be
+// rendered at the same time.
+struct frame_view{
     v2s frameDim;
+    v3 camPos;
+    v3 camForward;
+    v3 camRight;
+    v3 camUp;
+    f32 camAngleX;
+    f32 camAngleY;
+    f32 fovY;
+
+    // A copy of gs->scene with the sphere that follows the camera at its position. What the copy points to
+    // (meshes, BVHs, particles) is shared, so all the views in flight must be of the same scene time.
+    scene scene;
+
+    // The workers render into 'tiles': tile after tile (in the order of 'tileBins'), each one
+    // MAX_TILE_PIXELS RGBX pixels in rows of TILE_SIZE, so each tile starts at a cache line and
+    // no two threads write to the same one. DetileFrame() makes a row-major frame from it when the
+    // frame is done.
+    u32 *tiles;
+    volatile LONG tilesLeft; // Tiles queued that haven't been rendered yet.
+
+    // With a video format, each tile is also converted to it into 'video' after it's rendered (see
+    // ConvertTileToVideo()).
+    video_format videoFormat;
+    u8 *video;
+
+    b32 heatmap; // Each pixel shows the cycles it took instead of its color (see HeatmapPixel()).
+    b32 useShadowCache; // So a frame doesn't mix cached and uncached shadows when it's toggled.
+
+    // Primary ray constants (see PrecomputePrimaryRays())
+    primary_sphere primarySpheres[MAX_SPHERES];
+    f32 primaryPlaneNumerators[MAX_PLANES]; // d - Dot(n, ro) in IntersectPlanes4().
+    v3 cameraRayDirs[FRAME_BUFFER_WIDTH*FRAME_BUFFER_HEIGHT]; // Only recomputed when the camera rotates.
+    b32 tileRayDirsValid[MAX_TILES];
+    f32 rayDirsAngleX;
+    f32 rayDirsAngleY;
+    f32 rayDirsFovY;
+    v2s rayDirsFrameDim;
+
+    // Screen-space binning
+    v2s numTiles;
+    tile_bin tileBins[MAX_TILES];
+    s32 binnedSpheres[MAX_TILES*MAX_SPHERES]; // Sphere indices of all the bins, one after another.
+};
+
+struct global_state{
+    u32 *frameBuffer; // Row-major RGBX, 4 bytes per pixel (see DetileFrame()).
+    v2s frameDim; // Of the next frames.
 
-    // Current frame camera position (doesn't change till the current frame is finished)
-    v3 frameCamPos;
-    v3 frameCamForward;
-    v3 frameCamRight;
-    v3 frameCamUp;
+    // The interactive frames use the first view, and RenderBatch() has a frame in flight in each one.
+    frame_view *views[MAX_FRAMES_IN_FLIGHT];
 
     // Current logical camera position (can change more often than we draw frames)
     v3 camPos; // Eye pos.
@@ -381,13 +961,40 @@ struct global_state{
     f32 camNear; // Near clip plane
     f32 camFar; // Far clip plane
     f32 fovY;
-    
+
+    // Scene (doesn't change till the current frame is finished)
+    scene scene;
+    s32 sceneIndex;
+    s32 requestedSceneIndex;
+    LARGE_INTEGER sceneStartTime;
+    f32 sceneTime; // Seconds since the scene was loaded, at the start of the current frame.
+    v3 requestedLightMove;  // Applied to the first light when the current frame is finished.
+    v3 requestedSphereMove; // Applied to the first sphere when the current frame is finished.
+    b32 requestedParticleToggle; // Switches between the grid and the BVH of the particles when the current frame is finished.
+    b32 requestedQuantizeToggle; // Switches the particles between full and quantized spheres when the current frame is finished.
+
+    shadow_cache shadowCache;
+    b32 useShadowCache; // Copied to the views when they're prepared, like heatmap.
+    b32 heatmap; // Copied to the views when they're prepared.
+    b32 prefetchSphereFile; // See PrefetchSphereFile().
+
+    memory_arena frameArena; // Reset at the start of each frame.
+    memory_arena scratchArenas[NUM_WORKER_THREADS]; // One per worker thread, reset before each work entry.
+
     // Work queue
     s32 numEntries;
-    work_entry entries[100];
+    work_entry entries[MAX_WORK_ENTRIES];
     HANDLE semaphoreEntriesToDo;
     volatile s32 nextEntry;
     volatile s32 completedEntriesCount;
+
+    // Entries that the workers take before the ones above, only added by the main thread. The counts are
+    // never reset.
+    work_entry urgentEntries[MAX_URGENT_ENTRIES];
+    s32 urgentEntriesAdded;
+    volatile s32 numUrgentEntries; // Posted.
+    volatile s32 nextUrgentEntry;
+    volatile s32 completedUrgentEntries;
 };
 
 static global_state globalState;
@@ -397,399 +1004,5949 @@ static global_state globalState;
 #define INITIAL_CAM_ANGLE_X -.5f
 
 
-void BeginFrame(){
-    auto gs = &globalState;
+//
+// Lights
+//
 
-    gs->frameCamPos = gs->camPos;
-    mat3 rotation = YRotation3(gs->camAngleY)*XRotation3(gs->camAngleX);
-    gs->frameCamForward = MatrixMultiply(V3(0, 0, 1.f), rotation);
-    gs->frameCamUp      = MatrixMultiply(V3(0, 1.f, 0), rotation);
-    gs->frameCamRight   = -Cross(gs->frameCamForward, gs->frameCamUp);
+// The lights' contribution is faded out between these two values of attenuation. It's an unnoticeable
+// falloff that lets us ignore lights that are far away.
+#define LIGHT_CUTOFF_MIN .002f
+#define LIGHT_CUTOFF_MAX .01f
 
-    // Fill work queue
-    s32 rowsPerEntry = 10;
+// Light strength based on distance
+inline f32 LightAttenuation(f32 intensity, f32 distance){
+    f32 result = intensity*(10.f/SQUARE(distance) + 5.f/distance);
+    return result;
+}
+
+// Distance at which LightAttenuation() falls to LIGHT_CUTOFF_MIN.
+inline f32 LightReach(f32 intensity){
+    // m = intensity*(10/d^2 + 5/d)
+    // m*d^2 - 5*intensity*d - 10*intensity = 0
+    f32 m = LIGHT_CUTOFF_MIN;
+    f32 result = (5.f*intensity + SquareRoot(SQUARE(5.f*intensity) + 40.f*m*intensity))/(2.f*m);
+    return result;
+}
+
+// Squared distance from 'p' to the closest point of the box. 0 if it's inside.
+inline f32 DistanceSqrToBox(v3 p, v3 boxMin, v3 boxMax){
+    f32 result = 0;
+    for(s32 i = 0; i < 3; i++){
+        if (p.asArray[i] < boxMin.asArray[i])
+            result += SQUARE(boxMin.asArray[i] - p.asArray[i]);
+        else if (p.asArray[i] > boxMax.asArray[i])
+            result += SQUARE(p.asArray[i] - boxMax.asArray[i]);
+    }
+    return result;
+}
+
+
+//
+// Shadows
+//
+
+// Returns whether the sphere ('c', 'r') can block light from 'lightPos' to any point inside the ball
+// ('ballCenter', 'ballRadius'), where 'coneRadius' is the maximum radius of the light cones we use for
+// soft shadows. The points that can block the light are inside the convex hull of the ball and the light
+// position, which is the union of the balls centered at Lerp(ballCenter, lightPos, u) with radius
+// (1 - u)*ballRadius. So we find the minimum over u of the distance to those balls, in 2d coordinates
+// along the axis (a) and away from the axis (h).
+b32 SphereCanBlockLightToBall(v3 c, f32 r, v3 ballCenter, f32 ballRadius, v3 lightPos, f32 coneRadius){
+    v3 axis = lightPos - ballCenter;
+    f32 axisLength = Length(axis);
+    if (axisLength <= ballRadius) // Light inside the ball
+        return true;
+    axis /= axisLength;
+
+    v3 rel = c - ballCenter;
+    f32 a = Dot(rel, axis);
+    f32 h = SquareRoot(Max(0, LengthSqr(rel) - a*a));
+
+    // f(u) = sqrt((a - u*axisLength)^2 + h^2) - (1 - u)*ballRadius is convex, and f'(u) = 0 gives us:
+    f32 k = ballRadius/axisLength;
+    f32 u = Clamp01((a - k*h/SquareRoot(1.f - k*k))/axisLength);
+    f32 distance = SquareRoot(SQUARE(a - u*axisLength) + SQUARE(h)) - (1.f - u)*ballRadius;
+    b32 result = (distance < r + coneRadius);
+    return result;
+}
+
+// Soft shadows are computed by accumulating how much light each blocker sphere blocks.
+struct shadow_accumulator{
+    f32 lMin;
+    f32 lSum;
+    f32 blockCount;
+    f32 blockedSum;
+};
+inline shadow_accumulator ShadowAccumulator(){
+    shadow_accumulator result = {1.f, 1.f, 0, 0};
+    return result;
+}
+
+// Project the sphere to 2d, circle intersection is the blocked area...
+// r0 and r1 are the radius of light that will affect the pixel. r0 is the radius at 'p' and r1 is the radius at the light source.
+inline void AccumulateShadow(shadow_accumulator *acc, sphere blocker, v3 p, v3 lightDir, f32 lightDistance, v3 perpX, v3 perpY, f32 r0, f32 r1){
+    // 'd' is the distance from 'p' to the point in the ray closest to the sphere. Maybe we could use distance to sphere as approximation.
+    f32 d = Dot(blocker.c - p, lightDir);
+    if (d < 0 || d > lightDistance) // Outside blocking range.
+        return;
+
+    v2 sphereProj = {Dot(blocker.c - p, perpX), Dot(blocker.c - p, perpY)};
+
+    // 'r' is the radius of vision at the projected slice (where the sphere covers more area).
+    f32 r = LerpClamp(r0, r1, d/lightDistance);
+    //f32 blockedArea = IntersectionAreaOfTwoCircles(V2(0), r, sphereProj, blocker.r);
+    //f32 blockedAmount = blockedArea/(PI*r*r);
+
+    f32 dis = Length(sphereProj);
+    f32 len = Min(r, dis + blocker.r) - Max(-r, dis - blocker.r);
+    f32 blockedAmount = Map01ToReverseSquare(Clamp01(len/r));
+    if (blockedAmount){
+        acc->blockCount++;
+        acc->blockedSum += blockedAmount;
+        acc->lMin = Min(acc->lMin, 1.f - blockedAmount);
+        acc->lSum = Max(0, acc->lSum - blockedAmount);
+    }
+}
+
+// Returns the amount of light that isn't blocked, [0, 1].
+inline f32 ShadowLightAmount(shadow_accumulator *acc){
+    f32 l = 1.f;
+    if (acc->blockCount){
+        l = Min(acc->lMin, Lerp(acc->lMin, Lerp(acc->lSum, 1.f - acc->blockedSum/acc->blockCount, .5f), .5f));
+    }
+    return l;
+}
+
+
+//
+// Work queue
+//
+
+// Must only be called while the queue is empty (all the previous entries are completed).
+void BeginWorkEntries(){
+    auto gs = &globalState;
     gs->numEntries = 0;
 
     gs->nextEntry = 0;
     gs->completedEntriesCount = 0;
     _ReadWriteBarrier();
+}
 
-    Assert(ArrayCount(gs->entries) > gs->frameDim.y/rowsPerEntry);
-    for(s32 y = 0; y < gs->frameDim.y; y += rowsPerEntry){
-        work_entry *entry = &gs->entries[gs->numEntries];
-        gs->numEntries++;
-        entry->firstRowY = y;
-        entry->numRows = MinS32(rowsPerEntry, gs->frameDim.y - y);
-    }
+// The entries are used as a ring, so entries can be added while the earlier ones are done, as long as
+// there are never more than MAX_WORK_ENTRIES in the queue.
+inline work_entry *AddWorkEntry(work_type type){
+    auto gs = &globalState;
+    Assert(gs->numEntries - gs->completedEntriesCount < ArrayCount(gs->entries));
+    work_entry *entry = &gs->entries[gs->numEntries % ArrayCount(gs->entries)];
+    gs->numEntries++;
+    entry->type = type;
+    return entry;
+}
 
+// Wakes the worker threads up to do the entries added since BeginWorkEntries().
+void PostWorkEntries(){
+    auto gs = &globalState;
     LONG prevCount = 0;
     _ReadWriteBarrier();
     ReleaseSemaphore(gs->semaphoreEntriesToDo, gs->numEntries, &prevCount);
     Assert(prevCount == 0);
 }
 
+// Wakes the worker threads up to do the entries added since 'firstEntry', while the earlier ones may
+// still be being done.
+void PostMoreWorkEntries(s32 firstEntry){
+    auto gs = &globalState;
+    if (gs->numEntries > firstEntry){
+        _ReadWriteBarrier();
+        ReleaseSemaphore(gs->semaphoreEntriesToDo, gs->numEntries - firstEntry, 0);
+    }
+}
 
-struct ray_intersection{
-    f32 t; // distance. 0 for no intersection.
-    s32 material;
-    v3 normal;
+// Entries for the work that the main thread is waiting for while the queue is full of tiles, like the strips
+// of an image. They have their own ring, and the workers check it first whenever they take an entry, so they
+// don't wait behind the tiles of the views in flight. Each posted entry of either queue releases the
+// semaphore once, and each worker takes one entry per wait, so there's always an entry for each wait.
+inline work_entry *AddUrgentWorkEntry(work_type type){
+    auto gs = &globalState;
+    Assert(gs->urgentEntriesAdded - gs->completedUrgentEntries < ArrayCount(gs->urgentEntries));
+    work_entry *entry = &gs->urgentEntries[gs->urgentEntriesAdded % ArrayCount(gs->urgentEntries)];
+    gs->urgentEntriesAdded++;
+    entry->type = type;
+    return entry;
+}
+
+void PostUrgentWorkEntries(){
+    auto gs = &globalState;
+    s32 count = gs->urgentEntriesAdded - gs->numUrgentEntries;
+    if (count > 0){
+        _ReadWriteBarrier();
+        gs->numUrgentEntries = gs->urgentEntriesAdded;
+        ReleaseSemaphore(gs->semaphoreEntriesToDo, count, 0);
+    }
+}
+
+void WaitForWorkEntries(){
+    auto gs = &globalState;
+    while(gs->completedEntriesCount != gs->numEntries || gs->completedUrgentEntries != gs->numUrgentEntries){
+        Sleep(0);
+    }
+    _mm_lfence();
+}
+
+
+//
+// Tracing
+//
+
+// With -trace <file> before the other arguments, or T in the window, the next TRACE_FRAMES frames are recorded as
+// a timeline: each work entry that each worker does, the waits for more entries, and the beginning and the
+// presentation of each frame on the main thread. It's written in the Chrome trace format, for chrome://tracing
+// or ui.perfetto.dev. Each thread has its own buffer of events, so recording them doesn't need atomics.
+#define TRACE_FRAMES 60
+#define TRACE_MAX_EVENTS 65536 // Per thread, the events after that are dropped.
+#define TRACE_MAIN_THREAD NUM_WORKER_THREADS
+
+struct trace_event{
+    char *name;
+    s64 start;
+    s64 end;
+    s32 index; // Tile, entry or frame. -1 if there isn't one.
 };
 
-struct sphere{
-    v3 c;
-    f32 r;
+struct trace_thread{
+    trace_event *events;
+    s32 numEvents;
+    u8 padding[64 - sizeof(trace_event *) - sizeof(s32)]; // Each one in its own cache line.
 };
 
-f32 IntersectSphere(sphere sphere, v3 ro, v3 rd){
-    f32 t = -1.f;
-    ro -= sphere.c; // Make ro relative to sphere center, so that sphere is centered at 0,0,0.
+struct trace{
+    volatile b32 active;
+    char *path;
+    s32 framesLeft;
+    s32 numFrames;
+    s64 startTime;
+    trace_thread threads[NUM_WORKER_THREADS + 1]; // The main thread is the last one.
+};
 
-    // sphere at 0,0,0 equation:   sqrt(dot(p)) = r        (by dot(p) I mean dot(p, p))
-    // ray equation:               p = ro + t*rd
-    // substitution:               sqrt(dot(ro + t*rd)) = r
-    //                             dot(ro + t*rd) = r^2
-    //                             dot(ro + t*rd) - r^2 = 0
-    // (expand binomial squared)   dot(ro) + dot(t*rd) + 2*t*dot(ro, rd) - r^2 = 0
-    // (rd is unitary)             dot(ro) + t*t + 2*dot(ro, rd)*t - r^2 = 0
-    // (reorder)                   t^2  +  2*dot(ro, rd)*t  +  dot(ro) - r^2 = 0
-    // Now we have a quadratic equation on t.
+static trace globalTrace;
+
+static char *globalWorkEntryNames[] = {
+    "Render tile",
+    "Bake shadow chunk",
+    "Prepare BVH chunk",
+    "Bin BVH chunk",
+    "Build BVH subtree",
+    "Animate mesh chunk",
+    "Refit BVH subtree",
+    "Move particles",
+    "Count particle cells",
+    "Fill particle cells",
+    "Encode image strip",
+};
 
-    // a = 1
-    f32 b = 2.f*Dot(ro, rd);
-    f32 c = Dot(ro, ro) - SQUARE(sphere.r);
-    f32 d = b*b - 4.f*c;
-    if (d >= 0){
-        t = (-b - SquareRoot(d))/2.f; // We only care about the lowest solution, i.e. the closest to the camera.
+inline s64 GetTraceTime(){
+    s64 result = (globalTrace.active ? GetCurrentTimeCounter().QuadPart : 0);
+    return result;
+}
+
+// Records something that the thread did since 'start' (from GetTraceTime()). A thread only reserves a slot
+// while the trace is active, and it skips what started before the trace (like a wait from a previous one).
+inline void TraceEvent(s32 threadIndex, char *name, s64 start, s32 index){
+    if (globalTrace.active && start && start >= globalTrace.startTime){
+        trace_thread *thread = &globalTrace.threads[threadIndex];
+        if (thread->numEvents < TRACE_MAX_EVENTS){
+            trace_event *event = &thread->events[thread->numEvents];
+            event->name = name;
+            event->start = start;
+            event->end = GetCurrentTimeCounter().QuadPart;
+            event->index = index;
+            CompletePreviousWritesBeforeFutureWrites;
+            thread->numEvents++;
+        }
     }
-    return t;
 }
-inline v3 NormalSphere(sphere sphere, v3 pos){
-    v3 n = (pos - sphere.c)/sphere.r;
-    return n;
+
+// Waits for the work queue to be empty, since the workers that saw the previous trace still active may be
+// adding an event, and only a worker that is doing an entry (or just woke up for one) can be in TraceEvent().
+void StartTrace(char *path, s32 numFrames){
+    auto t = &globalTrace;
+    if (t->active)
+        return;
+    WaitForWorkEntries();
+    for(s32 i = 0; i < ArrayCount(t->threads); i++){
+        if (!t->threads[i].events){
+            t->threads[i].events = (trace_event *)AllocateMemory(TRACE_MAX_EVENTS*sizeof(trace_event));
+        }
+        t->threads[i].numEvents = 0;
+    }
+    t->path = path;
+    t->framesLeft = numFrames;
+    t->numFrames = 0;
+    t->startTime = GetCurrentTimeCounter().QuadPart;
+    CompletePreviousWritesBeforeFutureWrites;
+    t->active = true;
+    Printf("Trace: recording %i frames.\n", numFrames);
 }
 
-inline f32 IntersectPlane(f32 y, v3 ro, v3 rd){
-    f32 t = -1.f;
-    // plane equation: p.y = y
-    // ray equation:   p = ro + t*rd
-    //                 p.y = ro.y + t*rd.y
-    // substitution:   y = ro.y + t*rd.y
-    //                 y - ro.y = t*rd.y
-    //                 (y - ro.y)/rd.y = t
-    if (rd.y){
-        t = (y - ro.y)/rd.y;
+// Stops recording and writes the file. The workers may still be adding an event, but the ones counted
+// already are complete.
+void FinishTrace(){
+    auto t = &globalTrace;
+    if (!t->active)
+        return;
+    t->active = false;
+    CompletePreviousWritesBeforeFutureWrites;
+
+    s32 numEvents[ArrayCount(t->threads)];
+    s32 totalEvents = 0;
+    for(s32 i = 0; i < ArrayCount(t->threads); i++){
+        numEvents[i] = t->threads[i].numEvents;
+        totalEvents += numEvents[i];
+    }
+    umm maxSize = (umm)(totalEvents + ArrayCount(t->threads) + 2)*160;
+    char *json = (char *)AllocateMemory(maxSize);
+    char *at = json;
+    char *end = json + maxSize;
+    at += snprintf(at, end - at, "{\"traceEvents\":[\n");
+    for(s32 i = 0; i < ArrayCount(t->threads); i++){
+        if (i == TRACE_MAIN_THREAD){
+            at += snprintf(at, end - at, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"Main\"}},\n", i);
+        }else{
+            at += snprintf(at, end - at, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"Worker %i\"}},\n", i, i);
+        }
+    }
+    f64 microsecondsPerTick = 1000000.0/(f64)globalPerformanceFrequency.QuadPart;
+    for(s32 i = 0; i < ArrayCount(t->threads); i++){
+        for(s32 e = 0; e < numEvents[i]; e++){
+            trace_event *event = &t->threads[i].events[e];
+            f64 start = (event->start - t->startTime)*microsecondsPerTick;
+            f64 duration = (event->end - event->start)*microsecondsPerTick;
+            at += snprintf(at, end - at, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"index\":%i}},\n",
+                           event->name, i, start, duration, event->index);
+        }
+    }
+    at -= 2; // The last comma.
+    at += snprintf(at, end - at, "\n]}\n");
+
+    b32 written = false;
+    HANDLE file = CreateFileA(t->path, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 0, 0);
+    if (file != INVALID_HANDLE_VALUE){
+        DWORD bytesWritten;
+        written = WriteFile(file, json, (DWORD)(at - json), &bytesWritten, 0);
+        CloseHandle(file);
+    }
+    if (written){
+        Printf("Trace: %i events written to %s.\n", totalEvents, t->path);
+    }else{
+        Printf("Trace: can't write %s\n", t->path);
+    }
+    DeallocateMemory(json);
+}
+
+// Called when a frame begins, to stop after the last one. Returns the index of the frame in the trace.
+s32 CountTraceFrame(){
+    auto t = &globalTrace;
+    s32 result = -1;
+    if (t->active){
+        if (t->framesLeft){
+            t->framesLeft--;
+            result = t->numFrames++;
+        }else{
+            FinishTrace(); // The frames recorded are done.
+        }
+    }
+    return result;
+}
+
+
+//
+// Profiling
+//
+
+// BEGIN_TIMED_BLOCK(ZONE_X) and END_TIMED_BLOCK(ZONE_X) count the cycles (rdtsc) between them, and how many
+// times they ran, in the counters of the thread that runs them, so the hot paths don't need atomics. When a
+// frame begins, the counters of all the threads are added up for the frame that ended, and PrintProfile()
+// shows the average per pixel and per frame since the last time. The release build defines NO_TIMED_BLOCKS,
+// which leaves nothing of them; "build.bat profile" is the same build with them.
+static thread_local s32 globalThreadIndex = NUM_WORKER_THREADS; // The main thread is after the workers.
+
+#ifndef NO_TIMED_BLOCKS
+
+enum profile_zone{
+    ZONE_RENDER_TILE, // All of RenderTile(), including the zones below.
+    ZONE_PRIMARY_RAYS,
+    ZONE_SHADOW_CULLING,
+    ZONE_HARD_SHADOWS,
+    ZONE_SHADING, // The soft shadows and the light of each pixel.
+    ZONE_REFLECTIONS,
+    ZONE_FINAL_COLOR, // Adding up the light and encoding it as sRGB.
+    ZONE_CONVERT_VIDEO,
+    ZONE_BAKE_SHADOWS, // The chunks of the shadow cache rebaked when a sphere or a light moves.
+
+    ZONE_COUNT,
+};
+
+static char *globalZoneNames[] = {
+    "Render tile",
+    "  Primary rays",
+    "  Shadow culling",
+    "  Hard shadows",
+    "  Shading",
+    "  Reflections",
+    "  Final color",
+    "Convert video",
+    "Bake shadows",
+};
+
+struct profile_counter{
+    u64 cycles;
+    u64 hits;
+};
+
+struct profile_thread{
+    profile_counter zones[ZONE_COUNT];
+    u64 pixels;
+    u8 padding[64 - (ZONE_COUNT*sizeof(profile_counter) + sizeof(u64)) % 64]; // The next thread is in another cache line.
+};
+
+struct profile{
+    profile_thread threads[NUM_WORKER_THREADS + 1];
+
+    // Added up since the last report.
+    profile_counter zones[ZONE_COUNT];
+    u64 pixels;
+    s32 frames;
+};
+
+static profile globalProfile;
+
+#define BEGIN_TIMED_BLOCK(zone) u64 timedBlockStart_##zone = __rdtsc()
+#define END_TIMED_BLOCK(zone) AddTimedBlock(zone, __rdtsc() - timedBlockStart_##zone)
+#define COUNT_TIMED_PIXELS(count) (globalProfile.threads[globalThreadIndex].pixels += (count))
+
+inline void AddTimedBlock(profile_zone zone, u64 cycles){
+    profile_counter *counter = &globalProfile.threads[globalThreadIndex].zones[zone];
+    counter->cycles += cycles;
+    counter->hits++;
+}
+
+// Called when the work of 'numFrames' frames is done, so the counters aren't changing.
+void CollectProfile(s32 numFrames){
+    auto pr = &globalProfile;
+    u64 pixels = 0;
+    for(s32 i = 0; i < ArrayCount(pr->threads); i++){
+        profile_thread *thread = &pr->threads[i];
+        for(s32 zone = 0; zone < ZONE_COUNT; zone++){
+            pr->zones[zone].cycles += thread->zones[zone].cycles;
+            pr->zones[zone].hits += thread->zones[zone].hits;
+            thread->zones[zone] = {};
+        }
+        pixels += thread->pixels;
+        thread->pixels = 0;
+    }
+    if (pixels){
+        pr->pixels += pixels;
+        pr->frames += numFrames;
+    }
+}
+
+void PrintProfile(){
+    auto pr = &globalProfile;
+    if (!pr->frames)
+        return;
+    Printf("Zone               cycles/pixel   Mcycles/frame   hits/frame  (%i frames)\n", pr->frames);
+    for(s32 zone = 0; zone < ZONE_COUNT; zone++){
+        profile_counter *counter = &pr->zones[zone];
+        Printf("%-18s %12.1f %15.2f %12.1f\n", globalZoneNames[zone], (f64)counter->cycles/pr->pixels,
+               (f64)counter->cycles/(1000000.0*pr->frames), (f64)counter->hits/pr->frames);
+        *counter = {};
+    }
+    pr->pixels = 0;
+    pr->frames = 0;
+}
+
+#else
+
+#define BEGIN_TIMED_BLOCK(zone)
+#define END_TIMED_BLOCK(zone)
+#define COUNT_TIMED_PIXELS(count)
+inline void CollectProfile(s32 numFrames){}
+inline void PrintProfile(){}
+
+#endif
+
+
+//
+// Meshes
+//
+
+inline b32 IsObjSpace(char c){
+    b32 result = (c == ' ' || c == '\t');
+    return result;
+}
+inline char *NextLine(char *at){
+    while(*at && *at != '\n')
+        at++;
+    if (*at)
+        at++;
+    return at;
+}
+
+// Parses a vertex of an OBJ face (like "7", "7/2", "7//3" or "-1/2/3") and returns the 0-based index of
+// its position, or -1 if there isn't a valid one.
+s32 ParseObjFaceVertex(char **at, s32 numVertices){
+    while(IsObjSpace(**at))
+        (*at)++;
+    char *start = *at;
+    s32 index = (s32)strtol(start, at, 10);
+    b32 valid = (*at != start);
+    while(**at && !IsObjSpace(**at) && **at != '\r' && **at != '\n') // Skip the texture coordinate and normal.
+        (*at)++;
+    index = (index < 0 ? numVertices + index : index - 1); // Negative indices count from the last vertex.
+    if (!valid || index < 0 || index >= numVertices)
+        index = -1;
+    return index;
+}
+
+// Loads the vertex positions and the faces of a Wavefront OBJ file into an empty mesh. Polygons are split in triangle fans,
+// and everything else (normals, texture coordinates, groups, materials...) is ignored. Returns false if
+// the file can't be read or doesn't have any triangles. The BVH must be built afterwards.
+b32 LoadObj(mesh *m, char *path){
+    umm fileSize;
+    char *file = ReadEntireFile(path, &fileSize);
+    if (!file)
+        return false;
+
+    // Count everything first, so that the arrays are allocated only once.
+    s32 maxVertices = 0;
+    s32 maxTriangles = 0;
+    for(char *line = file; *line; line = NextLine(line)){
+        if (line[0] == 'v' && IsObjSpace(line[1])){
+            maxVertices++;
+        }else if (line[0] == 'f' && IsObjSpace(line[1])){
+            s32 numFaceVertices = 0;
+            for(char *at = line + 1; *at && *at != '\r' && *at != '\n'; at++){
+                if (!IsObjSpace(*at) && IsObjSpace(at[-1]))
+                    numFaceVertices++;
+            }
+            maxTriangles += MaxS32(0, numFaceVertices - 2);
+        }
+    }
+
+    m->numVertices = 0;
+    m->numTriangles = 0;
+    m->vertices = (v3 *)AllocateMemory(MaxS32(maxVertices, 1)*sizeof(v3));
+    m->indices = (u32 *)AllocateMemory(MaxS32(maxTriangles, 1)*3*sizeof(u32));
+    s32 numInvalidFaces = 0;
+    for(char *line = file; *line; line = NextLine(line)){
+        if (line[0] == 'v' && IsObjSpace(line[1])){
+            char *at = line + 1;
+            v3 *v = &m->vertices[m->numVertices++];
+            for(s32 i = 0; i < 3; i++){
+                v->asArray[i] = strtof(at, &at);
+            }
+        }else if (line[0] == 'f' && IsObjSpace(line[1])){
+            // The fan is emitted as the indices are parsed, and taken back if any of them is invalid.
+            char *at = line + 1;
+            s32 firstTriangle = m->numTriangles;
+            s32 first = ParseObjFaceVertex(&at, m->numVertices);
+            s32 prev = ParseObjFaceVertex(&at, m->numVertices);
+            b32 invalid = (first < 0 || prev < 0);
+            while(!invalid){
+                while(IsObjSpace(*at))
+                    at++;
+                if (!*at || *at == '\r' || *at == '\n')
+                    break;
+                s32 index = ParseObjFaceVertex(&at, m->numVertices);
+                if (index < 0){
+                    invalid = true;
+                    break;
+                }
+                u32 *triangle = &m->indices[3*m->numTriangles++];
+                triangle[0] = (u32)first;
+                triangle[1] = (u32)prev;
+                triangle[2] = (u32)index;
+                prev = index;
+            }
+            if (invalid){
+                m->numTriangles = firstTriangle;
+                numInvalidFaces++;
+            }
+        }
+    }
+    DeallocateMemory(file);
+
+    if (numInvalidFaces){
+        Printf("%s: Skipped %i faces with invalid vertices.\n", path, numInvalidFaces);
+    }
+    if (!m->numTriangles){
+        Printf("%s: There are no triangles.\n", path);
+        DeallocateMemory(m->vertices);
+        DeallocateMemory(m->indices);
+        m->vertices = 0;
+        m->indices = 0;
+        return false;
+    }
+    Printf("Loaded %s: %i vertices, %i triangles\n", path, m->numVertices, m->numTriangles);
+    return true;
+}
+
+// Moves and scales the mesh so that its bounding box is centered at 'center', and its longest side is 'size'.
+void FitMesh(mesh *m, v3 center, f32 size){
+    v3 min = V3(MAX_F32);
+    v3 max = V3(-MAX_F32);
+    for(s32 i = 0; i < m->numVertices; i++){
+        min = Min(min, m->vertices[i]);
+        max = Max(max, m->vertices[i]);
+    }
+    v3 dim = max - min;
+    f32 scale = SafeDivide0(size, Max(dim.x, Max(dim.y, dim.z)));
+    for(s32 i = 0; i < m->numVertices; i++){
+        m->vertices[i] = center + scale*(m->vertices[i] - (min + max)/2);
+    }
+}
+
+inline v3 TorusKnotPoint(f32 u){
+    f32 r = 2.f + Cos(3.f*u);
+    v3 result = {r*Cos(2.f*u), -Sin(3.f*u), r*Sin(2.f*u)};
+    return result;
+}
+
+// A tube along a (2, 3) torus knot, with 2*segments*sides triangles. It's there so that we can test big
+// meshes without any model file.
+void GenerateTorusKnot(mesh *m, s32 segments, s32 sides, f32 tubeRadius){
+    m->numVertices = segments*sides;
+    m->numTriangles = 2*segments*sides;
+    m->vertices = (v3 *)AllocateMemory(m->numVertices*sizeof(v3));
+    m->indices = (u32 *)AllocateMemory(m->numTriangles*3*sizeof(u32));
+    for(s32 i = 0; i < segments; i++){
+        f32 u = 2.f*PI*i/segments;
+        v3 p = TorusKnotPoint(u);
+        v3 tangent = Normalize(TorusKnotPoint(u + .001f) - TorusKnotPoint(u - .001f));
+        v3 normal = Normalize(Cross(tangent, p));
+        v3 binormal = Cross(normal, tangent);
+        for(s32 j = 0; j < sides; j++){
+            f32 angle = 2.f*PI*j/sides;
+            m->vertices[i*sides + j] = p + tubeRadius*(Cos(angle)*normal + Sin(angle)*binormal);
+        }
+    }
+    u32 *triangle = m->indices;
+    for(s32 i = 0; i < segments; i++){
+        for(s32 j = 0; j < sides; j++){
+            u32 v00 = (u32)(i*sides + j);
+            u32 v01 = (u32)(i*sides + (j + 1) % sides);
+            u32 v10 = (u32)(((i + 1) % segments)*sides + j);
+            u32 v11 = (u32)(((i + 1) % segments)*sides + (j + 1) % sides);
+            triangle[0] = v00; triangle[1] = v10; triangle[2] = v11;
+            triangle[3] = v00; triangle[4] = v11; triangle[5] = v01;
+            triangle += 6;
+        }
+    }
+}
+
+#define BVH_NUM_BINS 16
+#define BVH_MAX_LEAF_TRIANGLES 8
+#define BVH_MAX_LEAF_INSTANCES 1
+#define BVH_MAX_LEAF_SPHERES 4
+#define BVH_MAX_DEPTH 64
+#define BVH_NODE_COST 1.f // Cost of visiting a node relative to intersecting a primitive.
+#define BVH_CHUNK_PRIMITIVES 16384 // Minimum primitives per work entry, when binning in parallel.
+#define BVH_MAX_CHUNKS 256
+#define BVH_MIN_SUBTREE_PRIMITIVES 1024
+#define BVH_MAX_SUBTREES 1024
+
+// Bounding box of a primitive or a group of them, for building BVHs. The 4th lane is unused.
+struct bvh_bounds{
+    __m128 min;
+    __m128 max;
+};
+inline bvh_bounds EmptyBvhBounds(){
+    bvh_bounds result = {_mm_set1_ps(MAX_F32), _mm_set1_ps(-MAX_F32)};
+    return result;
+}
+inline void GrowBvhBounds(bvh_bounds *bounds, __m128 min, __m128 max){
+    bounds->min = _mm_min_ps(bounds->min, min);
+    bounds->max = _mm_max_ps(bounds->max, max);
+}
+inline v3 BvhV3(__m128 a){
+    f32 v[4];
+    _mm_storeu_ps(v, a);
+    v3 result = {v[0], v[1], v[2]};
+    return result;
+}
+
+// Half of the surface area of a box, which is proportional to the probability of a ray hitting it.
+inline f32 BoxHalfArea(v3 min, v3 max){
+    v3 d = max - min;
+    f32 result = d.x*d.y + d.y*d.z + d.z*d.x;
+    return result;
+}
+inline f32 BoxHalfArea(bvh_bounds *bounds){
+    f32 result = BoxHalfArea(BvhV3(bounds->min), BvhV3(bounds->max));
+    return result;
+}
+
+struct bvh_bin{
+    bvh_bounds bounds;
+    s32 count;
+};
+
+// A node whose primitives are known, but isn't built yet. Its bounds are already in the node.
+struct bvh_pending_node{
+    u32 nodeIndex;
+    u32 first;
+    u32 count;
+    s32 depth;
+    bvh_bounds centroids;
+    u32 firstFreeNode; // For subtrees: where their nodes go.
+};
+
+// State of a BVH build shared with the worker threads.
+struct bvh_builder{
+    bvh_tree *tree;
+    u32 numPrimitives;
+    mesh *m; // Mesh whose triangles are the primitives, or 0 if they are instances or spheres.
+    instance *instances;
+    sphere *spheres;
+    u32 maxLeafSize;
+    bvh_bounds *primitiveBounds; // The centroids of the primitives are the centers of their bounds.
+    u32 *order; // Primitives sorted by leaf.
+    u32 *sortedIndices; // Triangles of the mesh sorted by leaf.
+
+    // Parallel passes over the primitives, split in chunks.
+    u32 chunkFirst;
+    u32 chunkSize;
+    u32 chunkEnd;
+    bvh_pending_node binnedNode;
+    bvh_bounds chunkBounds[BVH_MAX_CHUNKS];
+    bvh_bounds chunkCentroids[BVH_MAX_CHUNKS];
+    bvh_bin chunkBins[BVH_MAX_CHUNKS][3][BVH_NUM_BINS];
+
+    // The top of the tree is split on the main thread, and then each subtree is built by a worker.
+    bvh_pending_node subtrees[BVH_MAX_SUBTREES];
+    s32 numSubtrees;
+
+    b32 background; // Background builds do all the work on their own thread, without the work queue.
+    b32 quiet; // Doesn't print the stats, for BVHs that are built every frame.
+    memory_arena *arena; // If there's one, the nodes and the order come from it instead of AllocateMemory().
+};
+
+// Scale from centroid positions to bins along each axis.
+inline __m128 BvhBinScale(bvh_bounds *centroids){
+    f32 extent[4];
+    _mm_storeu_ps(extent, _mm_sub_ps(centroids->max, centroids->min));
+    f32 scale[4] = {};
+    for(s32 axis = 0; axis < 3; axis++){
+        scale[axis] = (extent[axis] > 0 ? BVH_NUM_BINS/extent[axis] : 0);
+    }
+    __m128 result = _mm_loadu_ps(scale);
+    return result;
+}
+
+// Bin of the primitive along each axis. Returns its centroid.
+inline __m128 BvhBinIndices(bvh_bounds *primitive, __m128 centroidMin, __m128 scale, s32 *indices){
+    __m128 centroid = _mm_mul_ps(_mm_add_ps(primitive->min, primitive->max), _mm_set1_ps(.5f));
+    __m128 bins = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(centroid, centroidMin), scale), _mm_set1_ps(BVH_NUM_BINS - 1));
+    _mm_storeu_si128((__m128i *)indices, _mm_cvttps_epi32(bins));
+    return centroid;
+}
+
+// Puts the primitives in the bins along each axis, by their centroid.
+void BinBvhPrimitives(bvh_builder *b, u32 first, u32 count, bvh_bounds *centroids, bvh_bin bins[3][BVH_NUM_BINS]){
+    for(s32 axis = 0; axis < 3; axis++){
+        for(s32 i = 0; i < BVH_NUM_BINS; i++){
+            bins[axis][i] = {EmptyBvhBounds(), 0};
+        }
+    }
+    __m128 scale = BvhBinScale(centroids);
+    for(u32 i = first; i < first + count; i++){
+        bvh_bounds *primitive = &b->primitiveBounds[b->order[i]];
+        s32 indices[4];
+        BvhBinIndices(primitive, centroids->min, scale, indices);
+        for(s32 axis = 0; axis < 3; axis++){
+            bvh_bin *bin = &bins[axis][indices[axis]];
+            GrowBvhBounds(&bin->bounds, primitive->min, primitive->max);
+            bin->count++;
+        }
+    }
+}
+
+// Work entry: bounds of a chunk of primitives.
+void PrepareBvhChunk(bvh_builder *b, s32 chunkIndex){
+    mesh *m = b->m;
+    bvh_bounds bounds = EmptyBvhBounds();
+    bvh_bounds centroids = EmptyBvhBounds();
+    u32 first = chunkIndex*b->chunkSize;
+    u32 end = MinS32(first + b->chunkSize, b->chunkEnd);
+    for(u32 i = first; i < end; i++){
+        v3 min, max;
+        if (m){
+            v3 p0 = m->vertices[m->indices[3*i]];
+            v3 p1 = m->vertices[m->indices[3*i + 1]];
+            v3 p2 = m->vertices[m->indices[3*i + 2]];
+            min = Min(p0, Min(p1, p2));
+            max = Max(p0, Max(p1, p2));
+        }else if (b->instances){
+            min = b->instances[i].min;
+            max = b->instances[i].max;
+        }else{
+            sphere sp = b->spheres[i];
+            min = sp.c - V3(sp.r);
+            max = sp.c + V3(sp.r);
+        }
+        bvh_bounds *primitive = &b->primitiveBounds[i];
+        primitive->min = _mm_setr_ps(min.x, min.y, min.z, 0);
+        primitive->max = _mm_setr_ps(max.x, max.y, max.z, 0);
+        __m128 centroid = _mm_mul_ps(_mm_add_ps(primitive->min, primitive->max), _mm_set1_ps(.5f));
+        GrowBvhBounds(&bounds, primitive->min, primitive->max);
+        GrowBvhBounds(&centroids, centroid, centroid);
+        b->order[i] = i;
+    }
+    b->chunkBounds[chunkIndex] = bounds;
+    b->chunkCentroids[chunkIndex] = centroids;
+}
+
+// Work entry: bins a chunk of the primitives of b->binnedNode.
+void BinBvhChunk(bvh_builder *b, s32 chunkIndex){
+    u32 first = b->chunkFirst + chunkIndex*b->chunkSize;
+    u32 end = MinS32(first + b->chunkSize, b->chunkEnd);
+    BinBvhPrimitives(b, first, end - first, &b->binnedNode.centroids, b->chunkBins[chunkIndex]);
+}
+
+// Runs 'type' for each chunk of the range of primitives, using the worker threads, and returns the number of chunks.
+s32 DoBvhChunks(bvh_builder *b, work_type type, u32 first, u32 count){
+    b->chunkSize = MaxS32(BVH_CHUNK_PRIMITIVES, (count + BVH_MAX_CHUNKS - 1)/BVH_MAX_CHUNKS);
+    b->chunkFirst = first;
+    b->chunkEnd = first + count;
+    s32 numChunks = (count + b->chunkSize - 1)/b->chunkSize;
+    if (b->background){
+        for(s32 i = 0; i < numChunks; i++){
+            if (type == WORK_PREPARE_BVH_CHUNK){
+                PrepareBvhChunk(b, i);
+            }else{
+                BinBvhChunk(b, i);
+            }
+        }
+        return numChunks;
+    }
+    BeginWorkEntries();
+    for(s32 i = 0; i < numChunks; i++){
+        work_entry *entry = AddWorkEntry(type);
+        entry->bvhBuilder = b;
+        entry->bvhTaskIndex = i;
+    }
+    PostWorkEntries();
+    WaitForWorkEntries();
+    return numChunks;
+}
+
+// Decides whether the node is a leaf or it's split. If it's split, its primitives are partitioned, and
+// the pending nodes of its children (at 'childrenIndex') are returned.
+b32 SplitBvhNode(bvh_builder *b, bvh_pending_node *pending, bvh_bin bins[3][BVH_NUM_BINS], u32 childrenIndex, bvh_pending_node *children){
+    mesh *m = b->m;
+    bvh_node *node = &b->tree->nodes[pending->nodeIndex];
+
+    // Find the plane with the lowest cost. The bins are swept from the right to get every right side,
+    // and then from the left.
+    f32 extent[4];
+    _mm_storeu_ps(extent, _mm_sub_ps(pending->centroids.max, pending->centroids.min));
+    f32 bestCost = MAX_F32;
+    s32 bestAxis = -1;
+    s32 bestBin = 0; // The left child gets the bins before this one.
+    bvh_bin sides[2] = {}; // Left and right
+    for(s32 axis = 0; axis < 3 && pending->count > 1; axis++){
+        if (extent[axis] <= 0)
+            continue;
+        bvh_bin rights[BVH_NUM_BINS];
+        bvh_bin right = {EmptyBvhBounds(), 0};
+        for(s32 i = BVH_NUM_BINS - 1; i > 0; i--){
+            GrowBvhBounds(&right.bounds, bins[axis][i].bounds.min, bins[axis][i].bounds.max);
+            right.count += bins[axis][i].count;
+            rights[i] = right;
+        }
+        bvh_bin left = {EmptyBvhBounds(), 0};
+        for(s32 i = 1; i < BVH_NUM_BINS; i++){
+            GrowBvhBounds(&left.bounds, bins[axis][i - 1].bounds.min, bins[axis][i - 1].bounds.max);
+            left.count += bins[axis][i - 1].count;
+            if (left.count == 0 || rights[i].count == 0)
+                continue;
+            f32 cost = BoxHalfArea(&left.bounds)*left.count + BoxHalfArea(&rights[i].bounds)*rights[i].count;
+            if (cost < bestCost){
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = i;
+                sides[0] = left;
+                sides[1] = rights[i];
+            }
+        }
+    }
+    bestCost = BVH_NODE_COST + bestCost/BoxHalfArea(node->min, node->max);
+
+    b32 makeLeaf = (pending->count <= b->maxLeafSize && bestCost >= (f32)pending->count);
+    if (pending->count == 1 || pending->depth >= BVH_MAX_DEPTH - 1)
+        makeLeaf = true;
+    if (makeLeaf){
+        node->first = pending->first;
+        node->count = pending->count;
+        if (m){
+            for(u32 i = pending->first; i < pending->first + pending->count; i++){
+                for(s32 j = 0; j < 3; j++){
+                    b->sortedIndices[3*i + j] = m->indices[3*b->order[i] + j];
+                }
+            }
+        }
+        return false;
+    }
+
+    // Partition the primitives by their bin, and get the bounds of the centroids of each side.
+    bvh_bounds sideCentroids[2] = {EmptyBvhBounds(), EmptyBvhBounds()};
+    if (bestAxis >= 0){
+        __m128 scale = BvhBinScale(&pending->centroids);
+        u32 *begin = &b->order[pending->first];
+        u32 *end = begin + pending->count;
+        while(begin < end){
+            s32 indices[4];
+            __m128 centroid = BvhBinIndices(&b->primitiveBounds[*begin], pending->centroids.min, scale, indices);
+            if (indices[bestAxis] < bestBin){
+                GrowBvhBounds(&sideCentroids[0], centroid, centroid);
+                begin++;
+            }else{
+                GrowBvhBounds(&sideCentroids[1], centroid, centroid);
+                end--;
+                SWAP(*begin, *end);
+            }
+        }
+        Assert(begin - &b->order[pending->first] == sides[0].count);
+    }else{
+        // All the centroids are in the same place, and there are too many for a leaf. Just split them in half.
+        sides[0] = {EmptyBvhBounds(), 0};
+        sides[1] = {EmptyBvhBounds(), 0};
+        for(u32 i = 0; i < pending->count; i++){
+            bvh_bounds *primitive = &b->primitiveBounds[b->order[pending->first + i]];
+            s32 side = (i < pending->count/2 ? 0 : 1);
+            GrowBvhBounds(&sides[side].bounds, primitive->min, primitive->max);
+            sides[side].count++;
+        }
+        sideCentroids[0] = sideCentroids[1] = pending->centroids;
+    }
+
+    node->first = childrenIndex;
+    node->count = 0;
+    u32 first = pending->first;
+    for(s32 i = 0; i < 2; i++){
+        b->tree->nodes[childrenIndex + i].min = BvhV3(sides[i].bounds.min);
+        b->tree->nodes[childrenIndex + i].max = BvhV3(sides[i].bounds.max);
+        children[i] = {childrenIndex + i, first, (u32)sides[i].count, pending->depth + 1, sideCentroids[i], 0};
+        first += sides[i].count;
+    }
+    return true;
+}
+
+// Work entry: builds a subtree on its own. A subtree of n primitives can't have more than 2n - 2 nodes
+// below its root, so that's the space each one gets.
+void BuildBvhSubtree(bvh_builder *b, s32 subtreeIndex){
+    bvh_pending_node *subtree = &b->subtrees[subtreeIndex];
+    u32 nextNode = subtree->firstFreeNode;
+
+    bvh_pending_node stack[BVH_MAX_DEPTH + 1];
+    s32 stackSize = 0;
+    stack[stackSize++] = *subtree;
+    while(stackSize){
+        bvh_pending_node pending = stack[--stackSize];
+        bvh_bin bins[3][BVH_NUM_BINS];
+        BinBvhPrimitives(b, pending.first, pending.count, &pending.centroids, bins);
+        bvh_pending_node children[2];
+        if (SplitBvhNode(b, &pending, bins, nextNode, children)){
+            nextNode += 2;
+            Assert(stackSize + 2 <= ArrayCount(stack));
+            stack[stackSize++] = children[1];
+            stack[stackSize++] = children[0];
+        }
+    }
+    Assert(nextNode <= subtree->firstFreeNode + 2*subtree->count);
+}
+
+// Copies the nodes in depth-first order without the gaps left between the subtrees, and returns the
+// SAH cost of the tree: the expected cost of a ray that hits the root.
+f32 CompactBvh(bvh_tree *tree, memory_arena *arena){
+    bvh_node *nodes = (arena ? PushArray(arena, bvh_node, tree->numNodes) : (bvh_node *)AllocateMemory(tree->numNodes*sizeof(bvh_node)));
+    s32 numNodes = 1;
+    nodes[0] = tree->nodes[0];
+    f32 rootArea = BoxHalfArea(nodes[0].min, nodes[0].max);
+    f32 cost = 0;
+
+    u32 stack[BVH_MAX_DEPTH + 1];
+    s32 stackSize = 0;
+    stack[stackSize++] = 0;
+    while(stackSize){
+        bvh_node *node = &nodes[stack[--stackSize]];
+        f32 probability = SafeDivide0(BoxHalfArea(node->min, node->max), rootArea);
+        if (node->count){
+            cost += probability*node->count;
+        }else{
+            cost += probability*BVH_NODE_COST;
+            u32 first = (u32)numNodes;
+            nodes[first] = tree->nodes[node->first];
+            nodes[first + 1] = tree->nodes[node->first + 1];
+            numNodes += 2;
+            node->first = first;
+            stack[stackSize++] = first + 1;
+            stack[stackSize++] = first;
+        }
+    }
+    if (!arena){
+        DeallocateMemory(tree->nodes);
+    }
+    tree->nodes = nodes;
+    tree->numNodes = numNodes;
+    return cost;
+}
+
+// Builds a BVH with the surface area heuristic: each node is split by the plane that minimizes the sum
+// of the area of each child times its number of primitives. The candidate planes are the boundaries of
+// BVH_NUM_BINS bins along each axis, where the primitives are put by the center of their bounding box.
+// The primitives are sorted by leaf in b->order.
+// The worker threads do the work: the big nodes at the top are binned in parallel by chunks, and once
+// they are small enough each subtree is built by a thread. Must only be called while no frame is being
+// rendered, unless it's a background build, which does everything on the calling thread.
+void BuildBvh(bvh_builder *b){
+    LARGE_INTEGER startTime = GetCurrentTimeCounter();
+    bvh_tree *tree = b->tree;
+    u32 numPrimitives = b->numPrimitives;
+    if (b->arena){
+        tree->nodes = PushArray(b->arena, bvh_node, 2*numPrimitives);
+        b->primitiveBounds = PushArray(b->arena, bvh_bounds, numPrimitives);
+        b->order = PushArray(b->arena, u32, numPrimitives);
+    }else{
+        DeallocateMemory(tree->nodes);
+        tree->nodes = (bvh_node *)AllocateMemory(2*numPrimitives*sizeof(bvh_node));
+        b->primitiveBounds = (bvh_bounds *)AllocateMemory(numPrimitives*sizeof(bvh_bounds));
+        b->order = (u32 *)AllocateMemory(numPrimitives*sizeof(u32));
+    }
+    tree->numNodes = 1;
+    b->numSubtrees = 0;
+
+    s32 numChunks = DoBvhChunks(b, WORK_PREPARE_BVH_CHUNK, 0, numPrimitives);
+    bvh_bounds rootBounds = EmptyBvhBounds();
+    bvh_bounds rootCentroids = EmptyBvhBounds();
+    for(s32 i = 0; i < numChunks; i++){
+        GrowBvhBounds(&rootBounds, b->chunkBounds[i].min, b->chunkBounds[i].max);
+        GrowBvhBounds(&rootCentroids, b->chunkCentroids[i].min, b->chunkCentroids[i].max);
+    }
+    tree->nodes[0].min = BvhV3(rootBounds.min);
+    tree->nodes[0].max = BvhV3(rootBounds.max);
+
+    // Split the top of the tree into subtrees of about numPrimitives/64 primitives, enough to keep every
+    // thread busy.
+    u32 subtreeSize = MaxS32(BVH_MIN_SUBTREE_PRIMITIVES, numPrimitives/64);
+    bvh_pending_node stack[BVH_MAX_SUBTREES];
+    s32 stackSize = 0;
+    stack[stackSize++] = {0, 0, numPrimitives, 0, rootCentroids, 0};
+    while(stackSize){
+        bvh_pending_node pending = stack[--stackSize];
+        if (pending.count <= subtreeSize || b->numSubtrees + stackSize + 2 >= BVH_MAX_SUBTREES){
+            b->subtrees[b->numSubtrees++] = pending;
+            continue;
+        }
+        bvh_bin bins[3][BVH_NUM_BINS];
+        if (pending.count >= 2*BVH_CHUNK_PRIMITIVES){
+            b->binnedNode = pending;
+            numChunks = DoBvhChunks(b, WORK_BIN_BVH_CHUNK, pending.first, pending.count);
+            for(s32 axis = 0; axis < 3; axis++){
+                for(s32 i = 0; i < BVH_NUM_BINS; i++){
+                    bins[axis][i] = b->chunkBins[0][axis][i];
+                    for(s32 chunk = 1; chunk < numChunks; chunk++){
+                        GrowBvhBounds(&bins[axis][i].bounds, b->chunkBins[chunk][axis][i].bounds.min, b->chunkBins[chunk][axis][i].bounds.max);
+                        bins[axis][i].count += b->chunkBins[chunk][axis][i].count;
+                    }
+                }
+            }
+        }else{
+            BinBvhPrimitives(b, pending.first, pending.count, &pending.centroids, bins);
+        }
+        bvh_pending_node children[2];
+        if (SplitBvhNode(b, &pending, bins, (u32)tree->numNodes, children)){
+            tree->numNodes += 2;
+            stack[stackSize++] = children[1];
+            stack[stackSize++] = children[0];
+        }
+    }
+
+    // Build the subtrees
+    for(s32 i = 0; i < b->numSubtrees; i++){
+        b->subtrees[i].firstFreeNode = (u32)tree->numNodes;
+        tree->numNodes += 2*b->subtrees[i].count - 2;
+    }
+    if (b->background){
+        for(s32 i = 0; i < b->numSubtrees; i++){
+            BuildBvhSubtree(b, i);
+        }
+    }else{
+        BeginWorkEntries();
+        for(s32 i = 0; i < b->numSubtrees; i++){
+            work_entry *entry = AddWorkEntry(WORK_BUILD_BVH_SUBTREE);
+            entry->bvhBuilder = b;
+            entry->bvhTaskIndex = i;
+        }
+        PostWorkEntries();
+        WaitForWorkEntries();
+    }
+
+    f32 cost = CompactBvh(tree, b->arena);
+    tree->builtCost = tree->cost = cost;
+    if (!b->arena){
+        DeallocateMemory(b->primitiveBounds);
+    }
+
+    if (!b->quiet){
+        Printf("BVH: %i %s, %i nodes, %i subtrees, built in %.2fms, SAH cost %.2f\n", numPrimitives, (b->m ? "triangles" : b->instances ? "instances" : "spheres"),
+               tree->numNodes, b->numSubtrees, 1000.f*GetSecondsElapsed(startTime, GetCurrentTimeCounter()), cost);
+    }
+}
+
+// The triangles of the mesh are reordered to make the leaves contiguous.
+void BuildMeshBvh(mesh *m, b32 background){
+    bvh_builder *b = (bvh_builder *)AllocateMemory(sizeof(bvh_builder));
+    ZeroStruct(b);
+    b->tree = &m->bvh;
+    b->numPrimitives = (u32)m->numTriangles;
+    b->m = m;
+    b->maxLeafSize = BVH_MAX_LEAF_TRIANGLES;
+    b->sortedIndices = (u32 *)AllocateMemory(m->numTriangles*3*sizeof(u32));
+    b->background = background;
+    BuildBvh(b);
+
+    DeallocateMemory(m->indices);
+    m->indices = b->sortedIndices;
+    DeallocateMemory(b->order);
+    DeallocateMemory(b);
+}
+
+
+//
+// Animated meshes
+//
+
+#define MESH_CHUNK_VERTICES 16384 // Vertices per work entry, when animating meshes.
+#define BVH_REFIT_TASKS 64 // Subtrees refitted in parallel.
+#define BVH_MAX_REFIT_NODES 512
+#define BVH_REBUILD_COST_RATIO 1.3f // Refitted BVHs are rebuilt when their SAH cost grows this much.
+
+// Makes the mesh twist around the Z axis through 'center'. Its BVH must be built already.
+void SetMeshTwist(mesh *m, v3 center, f32 amount){
+    m->restVertices = (v3 *)AllocateMemory(m->numVertices*sizeof(v3));
+    CopyArray(m->restVertices, m->vertices, m->numVertices);
+    m->twistCenter = center;
+    m->twistAmount = amount;
+}
+
+// Work entry: moves a chunk of the vertices of the mesh to their position at 'time'.
+void AnimateMeshChunk(mesh *m, s32 chunkIndex, f32 time){
+    s32 first = chunkIndex*MESH_CHUNK_VERTICES;
+    s32 end = MinS32(first + MESH_CHUNK_VERTICES, m->numVertices);
+    f32 twist = m->twistAmount*Sin(time);
+    for(s32 i = first; i < end; i++){
+        v3 p = m->restVertices[i] - m->twistCenter;
+        f32 angle = twist*p.z;
+        f32 sin = Sin(angle), cos = Cos(angle);
+        m->vertices[i] = m->twistCenter + V3(cos*p.x - sin*p.y, sin*p.x + cos*p.y, p.z);
+    }
+}
+
+// Recomputes the bounds of the node and everything below it from the current vertices, keeping the
+// structure of the tree. Returns the sum of the area of each node times its cost (see CompactBvh()).
+f32 RefitBvhNode(mesh *m, u32 nodeIndex){
+    bvh_node *node = &m->bvh.nodes[nodeIndex];
+    f32 cost;
+    if (node->count){
+        v3 min = V3(MAX_F32);
+        v3 max = V3(-MAX_F32);
+        for(u32 i = 3*node->first; i < 3*(node->first + node->count); i++){
+            v3 p = m->vertices[m->indices[i]];
+            min = Min(min, p);
+            max = Max(max, p);
+        }
+        node->min = min;
+        node->max = max;
+        cost = BoxHalfArea(min, max)*node->count;
+    }else{
+        cost = RefitBvhNode(m, node->first) + RefitBvhNode(m, node->first + 1);
+        bvh_node *children = &m->bvh.nodes[node->first];
+        node->min = Min(children[0].min, children[1].min);
+        node->max = Max(children[0].max, children[1].max);
+        cost += BoxHalfArea(node->min, node->max)*BVH_NODE_COST;
+    }
+    return cost;
+}
+
+// A refit splits the top of the tree into subtrees, which the worker threads refit in parallel, and
+// then the main thread refits the nodes above them.
+struct bvh_refit{
+    mesh *m;
+    u32 topNodes[BVH_MAX_REFIT_NODES]; // Inner nodes above the subtrees, parents before children.
+    s32 numTopNodes;
+    u32 subtrees[BVH_MAX_REFIT_NODES];
+    f32 subtreeCosts[BVH_MAX_REFIT_NODES];
+    s32 numSubtrees;
+};
+
+// Work entry
+void RefitBvhSubtree(bvh_refit *r, s32 subtreeIndex){
+    r->subtreeCosts[subtreeIndex] = RefitBvhNode(r->m, r->subtrees[subtreeIndex]);
+}
+
+// Refits the whole BVH with the worker threads, and updates its SAH cost.
+void RefitMeshBvh(mesh *m){
+    auto gs = &globalState;
+    bvh_refit *r = PushStruct(&gs->frameArena, bvh_refit);
+    ZeroStruct(r);
+    r->m = m;
+
+    // Expand the nodes breadth-first until there are enough subtrees.
+    u32 queue[BVH_MAX_REFIT_NODES];
+    s32 queueStart = 0, queueEnd = 0;
+    queue[queueEnd++] = 0;
+    while(queueStart < queueEnd && queueEnd - queueStart < BVH_REFIT_TASKS && queueEnd + 2 <= ArrayCount(queue)){
+        u32 nodeIndex = queue[queueStart++];
+        bvh_node *node = &m->bvh.nodes[nodeIndex];
+        if (node->count){
+            r->subtrees[r->numSubtrees++] = nodeIndex;
+        }else{
+            r->topNodes[r->numTopNodes++] = nodeIndex;
+            queue[queueEnd++] = node->first;
+            queue[queueEnd++] = node->first + 1;
+        }
+    }
+    while(queueStart < queueEnd){
+        r->subtrees[r->numSubtrees++] = queue[queueStart++];
+    }
+
+    BeginWorkEntries();
+    for(s32 i = 0; i < r->numSubtrees; i++){
+        work_entry *entry = AddWorkEntry(WORK_REFIT_BVH_SUBTREE);
+        entry->bvhRefit = r;
+        entry->refitTaskIndex = i;
+    }
+    PostWorkEntries();
+    WaitForWorkEntries();
+
+    f32 cost = 0;
+    for(s32 i = 0; i < r->numSubtrees; i++){
+        cost += r->subtreeCosts[i];
+    }
+    for(s32 i = r->numTopNodes - 1; i >= 0; i--){
+        bvh_node *node = &m->bvh.nodes[r->topNodes[i]];
+        bvh_node *children = &m->bvh.nodes[node->first];
+        node->min = Min(children[0].min, children[1].min);
+        node->max = Max(children[0].max, children[1].max);
+        cost += BoxHalfArea(node->min, node->max)*BVH_NODE_COST;
+    }
+    m->bvh.cost = SafeDivide0(cost, BoxHalfArea(m->bvh.nodes[0].min, m->bvh.nodes[0].max));
+}
+
+// A BVH built on its own thread from a copy of the mesh, while the frames keep being rendered with the
+// refitted one. The triangles of the copy are reordered, but the vertices are the same, so the new BVH
+// can replace the old one and be refitted to the current vertices.
+struct bvh_rebuild{
+    mesh copy;
+    volatile b32 done;
+};
+
+DWORD WINAPI BvhRebuildThreadProc(void *param){
+    bvh_rebuild *rebuild = (bvh_rebuild *)param;
+    BuildMeshBvh(&rebuild->copy, true);
+    _mm_sfence();
+    rebuild->done = true;
+    return 0;
+}
+
+void StartBvhRebuild(mesh *m){
+    bvh_rebuild *rebuild = (bvh_rebuild *)AllocateMemory(sizeof(bvh_rebuild));
+    ZeroStruct(rebuild);
+    mesh *copy = &rebuild->copy;
+    copy->numVertices = m->numVertices;
+    copy->numTriangles = m->numTriangles;
+    copy->vertices = (v3 *)AllocateMemory(m->numVertices*sizeof(v3));
+    copy->indices = (u32 *)AllocateMemory(m->numTriangles*3*sizeof(u32));
+    CopyArray(copy->vertices, m->vertices, m->numVertices);
+    CopyArray(copy->indices, m->indices, 3*m->numTriangles);
+
+    HANDLE thread = CreateThread(NULL, 0, BvhRebuildThreadProc, rebuild, 0, NULL);
+    if (!thread){
+        Printf("Error creating the BVH rebuild thread.\n");
+        DeallocateMemory(copy->vertices);
+        DeallocateMemory(copy->indices);
+        DeallocateMemory(rebuild);
+        return;
+    }
+    CloseHandle(thread);
+    m->rebuild = rebuild;
+}
+
+// Waits for the background build, and if 'useIt' replaces the BVH of the mesh with the new one.
+void FinishBvhRebuild(mesh *m, b32 useIt){
+    bvh_rebuild *rebuild = m->rebuild;
+    while(!rebuild->done){
+        Sleep(0);
+    }
+    _mm_lfence();
+    mesh *copy = &rebuild->copy;
+    if (useIt){
+        SWAP(m->indices, copy->indices);
+        SWAP(m->bvh, copy->bvh);
+    }
+    DeallocateMemory(copy->vertices);
+    DeallocateMemory(copy->indices);
+    DeallocateMemory(copy->bvh.nodes);
+    DeallocateMemory(rebuild);
+    m->rebuild = 0;
+}
+
+// Moves the vertices of the animated meshes to their position at gs->sceneTime and refits their BVHs.
+// Refitting gets worse as the triangles move away from where they were when the BVH was built, so
+// when the SAH cost has grown too much a new BVH is built in the background, and it replaces the
+// refitted one at the start of the first frame after it's finished.
+// Must only be called while no frame is being rendered.
+void AnimateMeshes(){
+    auto gs = &globalState;
+    scene *s = &gs->scene;
+    for(s32 meshIndex = 0; meshIndex < s->numMeshes; meshIndex++){
+        mesh *m = &s->meshes[meshIndex];
+        if (!m->restVertices || m->instanced) // The bounds of the instances would need to be updated.
+            continue;
+
+        if (m->rebuild && m->rebuild->done){
+            FinishBvhRebuild(m, true);
+        }
+
+        BeginWorkEntries();
+        for(s32 i = 0; i < m->numVertices; i += MESH_CHUNK_VERTICES){
+            work_entry *entry = AddWorkEntry(WORK_ANIMATE_MESH_CHUNK);
+            entry->animatedMesh = m;
+            entry->meshChunkIndex = i/MESH_CHUNK_VERTICES;
+        }
+        PostWorkEntries();
+        WaitForWorkEntries();
+
+        RefitMeshBvh(m);
+        if (!m->rebuild && m->bvh.cost > m->bvh.builtCost*BVH_REBUILD_COST_RATIO){
+            Printf("BVH refit SAH cost %.2f (%.2f when built), rebuilding\n", m->bvh.cost, m->bvh.builtCost);
+            StartBvhRebuild(m);
+        }
+    }
+}
+
+void FreeMesh(mesh *m){
+    if (m->rebuild){
+        FinishBvhRebuild(m, false);
+    }
+    DeallocateMemory(m->restVertices);
+    DeallocateMemory(m->vertices);
+    DeallocateMemory(m->indices);
+    DeallocateMemory(m->bvh.nodes);
+    ZeroStruct(m);
+}
+
+
+//
+// Particles
+//
+
+#define PARTICLE_CHUNK_SIZE 8192 // Particles per work entry.
+#define PARTICLES_PER_CELL 2.f // Average that the cell size aims for.
+#define MAX_PARTICLE_CELLS (1 << 22)
+
+// Work entry: moves a chunk of particles to their position at 'time', and gets their bounds.
+void MoveParticleChunk(particle_cloud *c, s32 chunkIndex, f32 time){
+    s32 first = chunkIndex*PARTICLE_CHUNK_SIZE;
+    s32 end = MinS32(first + PARTICLE_CHUNK_SIZE, c->count);
+    v3 min = V3(MAX_F32);
+    v3 max = V3(-MAX_F32);
+    for(s32 i = first; i < end; i++){
+        particle_orbit *orbit = &c->orbits[i];
+        f32 angle = orbit->angle + orbit->speed*time;
+        sphere *sp = &c->spheres[i];
+        sp->c = c->center + V3(orbit->radius*Cos(angle), orbit->height + .3f*Sin(2.f*time + 3.f*orbit->angle), orbit->radius*Sin(angle));
+        min = Min(min, sp->c - V3(sp->r));
+        max = Max(max, sp->c + V3(sp->r));
+    }
+    c->chunkMin[chunkIndex] = min;
+    c->chunkMax[chunkIndex] = max;
+}
+
+// Range of cells overlapped by the box of the particle, inclusive.
+inline void GetParticleCells(particle_cloud *c, sphere *sp, s32 *cellMin, s32 *cellMax){
+    f32 invCellSize = 1.f/c->cellSize;
+    for(s32 axis = 0; axis < 3; axis++){
+        cellMin[axis] = ClampS32((s32)((sp->c.asArray[axis] - sp->r - c->gridMin.asArray[axis])*invCellSize), 0, c->gridDim[axis] - 1);
+        cellMax[axis] = ClampS32((s32)((sp->c.asArray[axis] + sp->r - c->gridMin.asArray[axis])*invCellSize), 0, c->gridDim[axis] - 1);
+    }
+}
+
+#define QUANTIZED_SPHERE_MAX 65535.f
+
+// 'invStep' is QUANTIZED_SPHERE_MAX over the size of the box.
+inline quantized_sphere QuantizeSphere(sphere sp, v3 boxMin, v3 invStep, f32 invRadiusStep){
+    quantized_sphere result;
+    result.x = (u16)Clamp((sp.c.x - boxMin.x)*invStep.x + .5f, 0, QUANTIZED_SPHERE_MAX);
+    result.y = (u16)Clamp((sp.c.y - boxMin.y)*invStep.y + .5f, 0, QUANTIZED_SPHERE_MAX);
+    result.z = (u16)Clamp((sp.c.z - boxMin.z)*invStep.z + .5f, 0, QUANTIZED_SPHERE_MAX);
+    result.r = (u16)Clamp(sp.r*invRadiusStep + .5f, 0, QUANTIZED_SPHERE_MAX);
+    return result;
+}
+// 'step' is the size of the box over QUANTIZED_SPHERE_MAX.
+inline sphere DequantizeSphere(quantized_sphere q, v3 boxMin, v3 step, f32 radiusStep){
+    sphere result;
+    result.c = V3(boxMin.x + q.x*step.x, boxMin.y + q.y*step.y, boxMin.z + q.z*step.z);
+    result.r = q.r*radiusStep;
+    return result;
+}
+
+// Quantizes the spheres of each leaf of the tree relative to the bounds of the leaf. 'order' has the
+// sphere of each slot of the leaves.
+void QuantizeBvhLeaves(bvh_tree *tree, sphere *spheres, u32 *order, f32 maxRadius, quantized_sphere *result){
+    f32 invRadiusStep = QUANTIZED_SPHERE_MAX/maxRadius;
+    for(s32 nodeIndex = 0; nodeIndex < tree->numNodes; nodeIndex++){
+        bvh_node *node = &tree->nodes[nodeIndex];
+        v3 extent = node->max - node->min;
+        v3 invStep = V3(SafeDivide0(QUANTIZED_SPHERE_MAX, extent.x), SafeDivide0(QUANTIZED_SPHERE_MAX, extent.y), SafeDivide0(QUANTIZED_SPHERE_MAX, extent.z));
+        for(u32 i = node->first; i < node->first + node->count; i++){
+            result[i] = QuantizeSphere(spheres[order[i]], node->min, invStep, invRadiusStep);
+        }
+    }
+}
+
+// Sphere of a particle that was hit. Mapped clouds only have the quantized spheres, so they need the leaf
+// it was hit in.
+inline sphere GetParticleSphere(particle_cloud *c, s32 index, s32 leaf){
+    sphere result;
+    if (c->spheres){
+        result = c->spheres[index];
+    }else{
+        bvh_node *node = &c->bvh.nodes[leaf];
+        result = DequantizeSphere(c->quantizedSpheres[index], node->min, (node->max - node->min)/QUANTIZED_SPHERE_MAX, c->maxRadius/QUANTIZED_SPHERE_MAX);
+    }
+    return result;
+}
+
+// Box that the centers of the particles of the cell are quantized to: the particles are in every cell they
+// overlap, so their centers can be outside the cell by up to the maximum radius.
+inline v3 ParticleCellQuantizationMin(particle_cloud *c, s32 x, s32 y, s32 z){
+    v3 result = c->gridMin + c->cellSize*V3((f32)x, (f32)y, (f32)z) - V3(c->maxRadius);
+    return result;
+}
+inline f32 ParticleCellQuantizationSize(particle_cloud *c){
+    f32 result = c->cellSize + 2.f*c->maxRadius;
+    return result;
+}
+
+// Work entry: counts the particles of a chunk in each cell they overlap, or puts them in the cells
+// after the counts have been turned into the starts of the cells. The threads add particles to the same
+// cells, so the slots are taken with atomic increments.
+void GridParticleChunk(particle_cloud *c, s32 chunkIndex, b32 fill){
+    s32 first = chunkIndex*PARTICLE_CHUNK_SIZE;
+    s32 end = MinS32(first + PARTICLE_CHUNK_SIZE, c->count);
+    b32 quantize = (fill && c->quantized);
+    v3 invStep = V3(QUANTIZED_SPHERE_MAX/ParticleCellQuantizationSize(c));
+    f32 invRadiusStep = QUANTIZED_SPHERE_MAX/c->maxRadius;
+    for(s32 i = first; i < end; i++){
+        s32 cellMin[3], cellMax[3];
+        GetParticleCells(c, &c->spheres[i], cellMin, cellMax);
+        for(s32 z = cellMin[2]; z <= cellMax[2]; z++){
+            for(s32 y = cellMin[1]; y <= cellMax[1]; y++){
+                for(s32 x = cellMin[0]; x <= cellMax[0]; x++){
+                    s32 cellIndex = (z*c->gridDim[1] + y)*c->gridDim[0] + x;
+                    LONG slot = InterlockedIncrement(&c->cellCounts[cellIndex]) - 1;
+                    if (fill){
+                        c->cellParticles[slot] = (u32)i;
+                    }
+                    if (quantize){
+                        c->quantizedSpheres[slot] = QuantizeSphere(c->spheres[i], ParticleCellQuantizationMin(c, x, y, z), invStep, invRadiusStep);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void DoParticleChunks(particle_cloud *c, work_type type){
+    BeginWorkEntries();
+    for(s32 i = 0; i*PARTICLE_CHUNK_SIZE < c->count; i++){
+        work_entry *entry = AddWorkEntry(type);
+        entry->particleCloud = c;
+        entry->particleChunkIndex = i;
+    }
+    PostWorkEntries();
+    WaitForWorkEntries();
+}
+
+// Puts the particles in a uniform grid that covers their bounds, with cells of about PARTICLES_PER_CELL
+// particles. It's a counting sort: count the particles of each cell, get the start of each cell from
+// the counts, and then put each particle in its cells.
+void BuildParticleGrid(particle_cloud *c, memory_arena *arena){
+    v3 extent = c->max - c->min;
+    f32 volume = Max(extent.x, .001f)*Max(extent.y, .001f)*Max(extent.z, .001f);
+    c->cellSize = Max(2.f*c->maxRadius, Pow(volume*PARTICLES_PER_CELL/c->count, 1.f/3));
+    s32 numCells;
+    while(1){
+        numCells = 1;
+        for(s32 axis = 0; axis < 3; axis++){
+            c->gridDim[axis] = MaxS32(1, (s32)Ceil(extent.asArray[axis]/c->cellSize));
+            numCells *= c->gridDim[axis];
+        }
+        if (numCells <= MAX_PARTICLE_CELLS)
+            break;
+        c->cellSize *= 1.25f;
+    }
+    c->gridMin = c->min;
+    c->cellStarts = PushArray(arena, u32, numCells + 1);
+    c->cellCounts = PushArray(arena, volatile LONG, numCells);
+
+    ZeroArrayPtr(c->cellCounts, numCells);
+    DoParticleChunks(c, WORK_COUNT_PARTICLE_CELLS);
+
+    u32 total = 0;
+    for(s32 i = 0; i < numCells; i++){
+        c->cellStarts[i] = total;
+        total += (u32)c->cellCounts[i];
+        c->cellCounts[i] = (LONG)c->cellStarts[i];
+    }
+    c->cellStarts[numCells] = total;
+    c->cellParticles = PushArray(arena, u32, total);
+    if (c->quantized){
+        c->quantizedSpheres = PushArray(arena, quantized_sphere, total);
+    }
+    DoParticleChunks(c, WORK_FILL_PARTICLE_CELLS);
+}
+
+void BuildParticleBvh(particle_cloud *c, memory_arena *arena){
+    bvh_builder *b = PushStruct(arena, bvh_builder);
+    ZeroStruct(b);
+    b->arena = arena;
+    b->tree = &c->bvh;
+    b->numPrimitives = (u32)c->count;
+    b->spheres = c->spheres;
+    b->maxLeafSize = BVH_MAX_LEAF_SPHERES;
+    b->quiet = true;
+    BuildBvh(b);
+
+    c->sortedParticles = b->order;
+
+    if (c->quantized){
+        c->quantizedSpheres = PushArray(arena, quantized_sphere, c->count);
+        QuantizeBvhLeaves(&c->bvh, c->spheres, c->sortedParticles, c->maxRadius, c->quantizedSpheres);
+    }
+}
+
+// Moves the particles and rebuilds their acceleration structure. Must only be called while no frame is
+// being rendered.
+void UpdateParticles(){
+    auto gs = &globalState;
+    particle_cloud *c = &gs->scene.particles;
+    if (!c->count || c->fileView)
+        return;
+
+    DoParticleChunks(c, WORK_MOVE_PARTICLES);
+    c->min = V3(MAX_F32);
+    c->max = V3(-MAX_F32);
+    for(s32 i = 0; i*PARTICLE_CHUNK_SIZE < c->count; i++){
+        c->min = Min(c->min, c->chunkMin[i]);
+        c->max = Max(c->max, c->chunkMax[i]);
+    }
+
+    if (c->structure == PARTICLES_GRID){
+        BuildParticleGrid(c, &gs->frameArena);
+    }else{
+        BuildParticleBvh(c, &gs->frameArena);
+    }
+}
+
+
+void FreeParticles(particle_cloud *c){
+    if (c->fileView){
+        UnmapViewOfFile(c->fileView);
+        CloseHandle(c->fileMapping);
+        CloseHandle(c->file);
+        DeallocateMemory(c->regionsPrefetched);
+    }else{
+        DeallocateMemory(c->spheres);
+        DeallocateMemory(c->orbits);
+        DeallocateMemory(c->chunkMin);
+        DeallocateMemory(c->chunkMax);
+    }
+    ZeroStruct(c);
+}
+
+
+//
+// Sphere files
+//
+// Static clouds of spheres (like point clouds of scanned places) are read from files that are mapped to
+// memory instead of loaded, so they can be bigger than the physical memory: the OS reads the pages the
+// rays touch, and drops them when it needs the memory. The file has the BVH nodes in the order
+// CompactBvh() leaves them, so the nodes of a subtree are next to each other, and the spheres sorted by
+// leaf. The spheres are only stored quantized relative to their leaves (see QuantizeSphere()), so they
+// take half the pages. To avoid stalling the rays on page faults, the parts of the file near the camera
+// are prefetched.
+//
+
+#define SPHERE_FILE_MAGIC 0x52485053 // "SPHR"
+#define SPHERE_FILE_VERSION 2
+#define SPHERE_FILE_ALIGNMENT 4096 // The sections start at page boundaries.
+#define SPHERE_FILE_REGION_DEPTH 10 // The prefetch regions are the subtrees at this depth.
+#define SPHERE_FILE_PREFETCH_DISTANCE 40.f
+
+struct sphere_file_header{
+    u32 magic;
+    u32 version;
+    u32 numSpheres;
+    u32 numNodes;
+    u32 numRegions;
+    f32 maxRadius; // The radii of the quantized spheres are relative to it.
+    u64 regionsOffset;
+    u64 nodesOffset;
+    u64 spheresOffset; // quantized_sphere
+};
+
+// A subtree of the BVH, and the parts of the file it's in.
+struct sphere_file_region{
+    v3 min;
+    u32 firstNode; // The nodes below the root of the subtree. The root is with its sibling.
+    v3 max;
+    u32 numNodes;
+    u32 firstSphere;
+    u32 numSpheres;
+};
+
+// Number of nodes below the node, and the range of its spheres.
+void GetBvhSubtreeRanges(bvh_node *nodes, u32 nodeIndex, u32 *numNodes, u32 *firstSphere, u32 *endSphere){
+    bvh_node *node = &nodes[nodeIndex];
+    if (node->count){
+        if (node->first < *firstSphere) *firstSphere = node->first;
+        if (node->first + node->count > *endSphere) *endSphere = node->first + node->count;
+    }else{
+        *numNodes += 2;
+        GetBvhSubtreeRanges(nodes, node->first, numNodes, firstSphere, endSphere);
+        GetBvhSubtreeRanges(nodes, node->first + 1, numNodes, firstSphere, endSphere);
+    }
+}
+
+// Writes 'size' bytes, and then zeros up to the next multiple of SPHERE_FILE_ALIGNMENT.
+b32 WriteSphereFileSection(HANDLE file, void *data, u64 size){
+    u64 written = 0;
+    while(written < size){ // WriteFile() can't write more than 4GB at a time.
+        u64 remaining = size - written;
+        DWORD chunkSize = (remaining > (1u << 30) ? (1u << 30) : (DWORD)remaining);
+        DWORD chunkWritten = 0;
+        if (!WriteFile(file, (u8 *)data + written, chunkSize, &chunkWritten, 0) || !chunkWritten)
+            return false;
+        written += chunkWritten;
+    }
+    static u8 zeros[SPHERE_FILE_ALIGNMENT];
+    DWORD padding = (DWORD)((SPHERE_FILE_ALIGNMENT - size % SPHERE_FILE_ALIGNMENT) % SPHERE_FILE_ALIGNMENT);
+    DWORD paddingWritten = 0;
+    b32 result = (!padding || (WriteFile(file, zeros, padding, &paddingWritten, 0) && paddingWritten == padding));
+    return result;
+}
+
+inline u64 AlignSphereFileOffset(u64 offset){
+    u64 result = (offset + SPHERE_FILE_ALIGNMENT - 1)/SPHERE_FILE_ALIGNMENT*SPHERE_FILE_ALIGNMENT;
+    return result;
+}
+
+// Builds the BVH of the spheres and writes the file. Returns false if it can't be written.
+b32 WriteSphereFile(char *path, sphere *spheres, s32 count){
+    bvh_tree tree = {};
+    bvh_builder *b = (bvh_builder *)AllocateMemory(sizeof(bvh_builder));
+    ZeroStruct(b);
+    b->tree = &tree;
+    b->numPrimitives = (u32)count;
+    b->spheres = spheres;
+    b->maxLeafSize = BVH_MAX_LEAF_SPHERES;
+    BuildBvh(b);
+
+    f32 maxRadius = 0;
+    for(s32 i = 0; i < count; i++){
+        maxRadius = Max(maxRadius, spheres[i].r);
+    }
+    quantized_sphere *quantizedSpheres = (quantized_sphere *)AllocateMemory(count*sizeof(quantized_sphere));
+    QuantizeBvhLeaves(&tree, spheres, b->order, maxRadius, quantizedSpheres);
+    DeallocateMemory(b->order);
+    DeallocateMemory(b);
+
+    // The regions are the subtrees at SPHERE_FILE_REGION_DEPTH, or the leaves above it.
+    s32 maxRegions = 1 << SPHERE_FILE_REGION_DEPTH;
+    sphere_file_region *regions = (sphere_file_region *)AllocateMemory(maxRegions*sizeof(sphere_file_region));
+    s32 numRegions = 0;
+    u32 stack[BVH_MAX_DEPTH + 1];
+    s32 depths[BVH_MAX_DEPTH + 1];
+    s32 stackSize = 0;
+    stack[stackSize] = 0;
+    depths[stackSize++] = 0;
+    while(stackSize){
+        stackSize--;
+        bvh_node *node = &tree.nodes[stack[stackSize]];
+        s32 depth = depths[stackSize];
+        if (node->count || depth == SPHERE_FILE_REGION_DEPTH){
+            sphere_file_region *region = &regions[numRegions++];
+            region->min = node->min;
+            region->max = node->max;
+            region->firstNode = node->first;
+            region->numNodes = 0;
+            u32 firstSphere = 0xffffffff, endSphere = 0;
+            GetBvhSubtreeRanges(tree.nodes, stack[stackSize], &region->numNodes, &firstSphere, &endSphere);
+            region->firstSphere = firstSphere;
+            region->numSpheres = endSphere - firstSphere;
+        }else{
+            stack[stackSize] = node->first + 1;
+            depths[stackSize++] = depth + 1;
+            stack[stackSize] = node->first;
+            depths[stackSize++] = depth + 1;
+        }
+    }
+
+    sphere_file_header header = {};
+    header.magic = SPHERE_FILE_MAGIC;
+    header.version = SPHERE_FILE_VERSION;
+    header.numSpheres = (u32)count;
+    header.numNodes = (u32)tree.numNodes;
+    header.numRegions = (u32)numRegions;
+    header.maxRadius = maxRadius;
+    header.regionsOffset = SPHERE_FILE_ALIGNMENT;
+    header.nodesOffset = AlignSphereFileOffset(header.regionsOffset + numRegions*sizeof(sphere_file_region));
+    header.spheresOffset = AlignSphereFileOffset(header.nodesOffset + tree.numNodes*sizeof(bvh_node));
+
+    b32 result = false;
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 0, 0);
+    if (file != INVALID_HANDLE_VALUE){
+        result = (WriteSphereFileSection(file, &header, sizeof(header)) &&
+                  WriteSphereFileSection(file, regions, numRegions*sizeof(sphere_file_region)) &&
+                  WriteSphereFileSection(file, tree.nodes, tree.numNodes*sizeof(bvh_node)) &&
+                  WriteSphereFileSection(file, quantizedSpheres, count*sizeof(quantized_sphere)));
+        CloseHandle(file);
+    }
+    if (!result){
+        Printf("Sphere file: can't write %s\n", path);
+    }
+    DeallocateMemory(tree.nodes);
+    DeallocateMemory(quantizedSpheres);
+    DeallocateMemory(regions);
+    return result;
+}
+
+// Whether 'count' elements of 'elementSize' bytes at 'offset' are inside a file of 'size' bytes, without
+// overflowing.
+inline b32 SphereFileSectionFits(u64 offset, u64 count, u64 elementSize, u64 size){
+    b32 result = (offset <= size && count <= (size - offset)/elementSize);
+    return result;
+}
+
+// Checks everything that the traversal and the prefetch index with: the leaves' spheres, the children of the
+// inner nodes (which must come after their parents, so there are no cycles, and be no deeper than the
+// traversal stacks allow), and the ranges of the regions.
+b32 ValidateSphereFile(sphere_file_header *header, bvh_node *nodes, sphere_file_region *regions){
+    u32 numNodes = header->numNodes;
+    u32 numSpheres = header->numSpheres;
+    u8 *depths = (u8 *)AllocateMemory(numNodes);
+    ZeroArrayPtr(depths, numNodes);
+    b32 valid = true;
+    for(u32 i = 0; i < numNodes && valid; i++){
+        bvh_node *node = &nodes[i];
+        if (node->count){
+            valid = (node->first <= numSpheres && node->count <= numSpheres - node->first);
+        }else{
+            valid = (node->first > i && node->first < numNodes - 1 && depths[i] < BVH_MAX_DEPTH - 1);
+            if (valid){
+                depths[node->first] = (u8)MaxS32(depths[node->first], depths[i] + 1);
+                depths[node->first + 1] = (u8)MaxS32(depths[node->first + 1], depths[i] + 1);
+            }
+        }
+    }
+    DeallocateMemory(depths);
+    for(u32 i = 0; i < header->numRegions && valid; i++){
+        sphere_file_region *region = &regions[i];
+        valid = (region->firstNode <= numNodes && region->numNodes <= numNodes - region->firstNode &&
+                 region->firstSphere <= numSpheres && region->numSpheres <= numSpheres - region->firstSphere);
+    }
+    return valid;
+}
+
+// Makes the cloud of the scene use the spheres of the file, which don't move. Returns false if the file
+// can't be mapped or isn't valid.
+b32 MapSphereFile(scene *s, char *path, shape_material material){
+    particle_cloud *c = &s->particles;
+    Assert(!c->count);
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize = {};
+    HANDLE mapping = 0;
+    u8 *view = 0;
+    if (GetFileSizeEx(file, &fileSize) && (u64)fileSize.QuadPart >= sizeof(sphere_file_header)){
+        mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+        if (mapping){
+            view = (u8 *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+    }
+
+    b32 valid = false;
+    if (view){
+        sphere_file_header *header = (sphere_file_header *)view;
+        u64 size = (u64)fileSize.QuadPart;
+        valid = (header->magic == SPHERE_FILE_MAGIC && header->version == SPHERE_FILE_VERSION &&
+                 header->numSpheres && header->numNodes && header->maxRadius > 0 && header->maxRadius < MAX_F32 &&
+                 header->numSpheres <= MAX_S32 && header->numNodes <= MAX_S32 && header->numRegions <= MAX_S32 &&
+                 SphereFileSectionFits(header->regionsOffset, header->numRegions, sizeof(sphere_file_region), size) &&
+                 SphereFileSectionFits(header->nodesOffset, header->numNodes, sizeof(bvh_node), size) &&
+                 SphereFileSectionFits(header->spheresOffset, header->numSpheres, sizeof(quantized_sphere), size) &&
+                 ValidateSphereFile(header, (bvh_node *)(view + header->nodesOffset), (sphere_file_region *)(view + header->regionsOffset)));
+        if (valid){
+            c->count = (s32)header->numSpheres;
+            c->material = material;
+            c->structure = PARTICLES_BVH;
+            c->maxRadius = header->maxRadius;
+            c->quantized = true;
+            c->quantizedSpheres = (quantized_sphere *)(view + header->spheresOffset);
+            c->bvh.nodes = (bvh_node *)(view + header->nodesOffset);
+            c->bvh.numNodes = (s32)header->numNodes;
+            c->min = c->bvh.nodes[0].min;
+            c->max = c->bvh.nodes[0].max;
+            c->regions = (sphere_file_region *)(view + header->regionsOffset);
+            c->numRegions = (s32)header->numRegions;
+            c->regionsPrefetched = (b32 *)AllocateMemory(c->numRegions*sizeof(b32));
+            ZeroArrayPtr(c->regionsPrefetched, c->numRegions);
+            c->file = file;
+            c->fileMapping = mapping;
+            c->fileView = view;
+            Printf("Sphere file: mapped %s, %i spheres, %i nodes, %.1fMB\n", path, c->count, c->bvh.numNodes, fileSize.QuadPart/(1024.f*1024.f));
+        }else{
+            Printf("Sphere file: %s isn't valid\n", path);
+        }
+    }
+    if (!valid){
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+    }
+    return valid;
+}
+
+// Asks the OS to start reading the parts of the file of the regions that come close to the camera. They
+// are prefetched again if the camera goes away and comes back, because their pages may have been dropped.
+void PrefetchSphereFile(particle_cloud *c, v3 camPos){
+    WIN32_MEMORY_RANGE_ENTRY ranges[64];
+    s32 numRanges = 0;
+    for(s32 i = 0; i < c->numRegions; i++){
+        sphere_file_region *region = &c->regions[i];
+        b32 close = (DistanceSqrToBox(camPos, region->min, region->max) < SQUARE(SPHERE_FILE_PREFETCH_DISTANCE));
+        if (close && !c->regionsPrefetched[i]){
+            if (numRanges + 2 > ArrayCount(ranges)){
+                PrefetchVirtualMemory(GetCurrentProcess(), numRanges, ranges, 0);
+                numRanges = 0;
+            }
+            if (region->numNodes){
+                ranges[numRanges++] = {&c->bvh.nodes[region->firstNode], region->numNodes*sizeof(bvh_node)};
+            }
+            ranges[numRanges++] = {&c->quantizedSpheres[region->firstSphere], region->numSpheres*sizeof(quantized_sphere)};
+        }
+        c->regionsPrefetched[i] = close;
+    }
+    if (numRanges){
+        PrefetchVirtualMemory(GetCurrentProcess(), numRanges, ranges, 0);
+    }
+}
+
+// A patch of hills, as if it was scanned. The spheres overlap so that it looks like a surface.
+sphere *GeneratePointCloud(s32 side, s32 *count){
+    *count = side*side;
+    sphere *result = (sphere *)AllocateMemory(*count*sizeof(sphere));
+    f32 spacing = .1f;
+    for(s32 z = 0; z < side; z++){
+        for(s32 x = 0; x < side; x++){
+            u32 hash = SimpleHash((u32)(z*side + x));
+            f32 px = (x - side/2 + ((hash & 0xff)/255.f - .5f))*spacing;
+            f32 pz = 10.f + (z + (((hash >> 8) & 0xff)/255.f - .5f))*spacing;
+            f32 py = 3.f + 2.5f*Sin(.11f*px)*Cos(.09f*pz) + 1.2f*Sin(.23f*px + .7f)*Sin(.19f*pz);
+            result[z*side + x] = {V3(px, py, pz), .07f + .02f*((hash >> 16) & 0xff)/255.f};
+        }
+    }
+    return result;
+}
+
+
+//
+// Image files
+//
+
+// Stills are compressed in strips of rows that the worker threads encode at the same time, and that are
+// written one after another. For PNG, each strip is a deflate block with the fixed Huffman codes in its own
+// IDAT chunk, aligned to a byte with an empty stored block, and the matches don't reach the previous strips.
+// For QOI, each strip starts from the last pixel of the previous one, and only uses the entries of the
+// color index that it has set itself. For PPM, the strips are the rows as RGB.
+#define IMAGE_STRIP_ROWS 16 // At most, wide images have less so a PNG strip fits in the scratch arena.
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_HASH_BITS 15
+
+enum image_format{
+    IMAGE_PPM,
+    IMAGE_PNG,
+    IMAGE_QOI,
+};
+
+struct image_encoder{
+    image_format format;
+
+    // The image being encoded, set by BeginImage().
+    v2s dim;
+    u8 *pixels; // First byte of the top row, R, G and B first in each pixel.
+    s32 stride; // Bytes from a row to the one below, negative for the frame buffer that starts at the bottom.
+    s32 pixelSize; // 3 for RGB, 4 for RGBX.
+
+    s32 stripRows;
+    s32 numStrips;
+    umm maxStripSize;
+    u8 *strips; // numStrips*maxStripSize bytes, each strip at the start of its part.
+    umm *stripSizes;
+    u32 *stripAdlers; // Adler-32 of the uncompressed data of each PNG strip, combined when they're written.
+    volatile LONG stripsLeft;
+
+    // Allocated sizes, the buffers grow when an image needs more.
+    umm stripsCapacity;
+    s32 maxNumStrips;
+};
+
+static u32 globalCrcTable[256];
+
+inline void PutU32BigEndian(u8 *at, u32 value){
+    at[0] = (u8)(value >> 24);
+    at[1] = (u8)(value >> 16);
+    at[2] = (u8)(value >> 8);
+    at[3] = (u8)value;
+}
+
+u32 Crc32(u8 *data, umm size){
+    u32 crc = 0xffffffff;
+    for(umm i = 0; i < size; i++){
+        crc = globalCrcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+}
+
+// The Adler-32 of two buffers one after another, from the Adler-32 of each one and the size of the second.
+u32 CombineAdler32(u32 adler1, u32 adler2, umm size2){
+    u32 base = 65521;
+    u32 rem = (u32)(size2 % base);
+    u32 sum1 = adler1 & 0xffff;
+    u32 sum2 = (u32)(((u64)rem*sum1) % base);
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= 2*base) sum2 -= 2*base;
+    if (sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+}
+
+// Deflate writes the bits of its values from the lowest, and the bits of its Huffman codes from the highest.
+struct bit_writer{
+    u8 *at;
+    u64 bits;
+    s32 numBits;
+};
+
+inline void PutBits(bit_writer *w, u32 value, s32 count){
+    w->bits |= (u64)value << w->numBits;
+    w->numBits += count;
+    while(w->numBits >= 8){
+        *w->at++ = (u8)w->bits;
+        w->bits >>= 8;
+        w->numBits -= 8;
+    }
+}
+inline void FlushBits(bit_writer *w){
+    if (w->numBits > 0){
+        *w->at++ = (u8)w->bits;
+    }
+    w->bits = 0;
+    w->numBits = 0;
+}
+inline void PutHuffmanCode(bit_writer *w, u32 code, s32 count){
+    u32 reversed = 0;
+    for(s32 i = 0; i < count; i++){
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    PutBits(w, reversed, count);
+}
+// Literal, end of block (256) or length symbol, with the fixed Huffman codes.
+inline void PutFixedSymbol(bit_writer *w, s32 symbol){
+    if (symbol < 144){
+        PutHuffmanCode(w, 0x30 + symbol, 8);
+    }else if (symbol < 256){
+        PutHuffmanCode(w, 0x190 + symbol - 144, 9);
+    }else if (symbol < 280){
+        PutHuffmanCode(w, symbol - 256, 7);
+    }else{
+        PutHuffmanCode(w, 0xc0 + symbol - 280, 8);
+    }
+}
+
+static u16 globalDeflateLengthBases[] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static u8 globalDeflateLengthExtraBits[] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static u16 globalDeflateDistanceBases[] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static u8 globalDeflateDistanceExtraBits[] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+inline void PutMatch(bit_writer *w, s32 length, s32 distance){
+    s32 l = ArrayCount(globalDeflateLengthBases) - 1;
+    while(globalDeflateLengthBases[l] > length)
+        l--;
+    PutFixedSymbol(w, 257 + l);
+    PutBits(w, length - globalDeflateLengthBases[l], globalDeflateLengthExtraBits[l]);
+    s32 d = ArrayCount(globalDeflateDistanceBases) - 1;
+    while(globalDeflateDistanceBases[d] > distance)
+        d--;
+    PutHuffmanCode(w, d, 5);
+    PutBits(w, distance - globalDeflateDistanceBases[d], globalDeflateDistanceExtraBits[d]);
+}
+
+// Compresses 'src' as a block with the fixed Huffman codes, with a greedy search of the last position
+// of each hash of 3 bytes. Unless it's the last block, it ends with an empty stored block, so the next
+// one starts at a byte. 'dest' must have space for size*9/8 + 16 bytes. Returns the size written.
+umm DeflateFixedBlock(u8 *src, umm size, u8 *dest, b32 last, memory_arena *scratch){
+    s32 *lastPositions = PushArray(scratch, s32, 1 << DEFLATE_HASH_BITS);
+    for(s32 i = 0; i < (1 << DEFLATE_HASH_BITS); i++){
+        lastPositions[i] = -1;
+    }
+    bit_writer w = {dest};
+    PutBits(&w, (last ? 1 : 0), 1);
+    PutBits(&w, 1, 2); // Fixed Huffman codes.
+    s32 end = (s32)size;
+    for(s32 i = 0; i < end;){
+        s32 length = 0;
+        s32 distance = 0;
+        if (i + 3 <= end){
+            u32 hash = ((src[i] | (src[i + 1] << 8) | (src[i + 2] << 16))*2654435761u) >> (32 - DEFLATE_HASH_BITS);
+            s32 candidate = lastPositions[hash];
+            lastPositions[hash] = i;
+            if (candidate >= 0 && i - candidate <= DEFLATE_WINDOW_SIZE){
+                s32 maxLength = MinS32(DEFLATE_MAX_MATCH, end - i);
+                while(length < maxLength && src[candidate + length] == src[i + length])
+                    length++;
+                distance = i - candidate;
+            }
+        }
+        if (length >= 3){
+            PutMatch(&w, length, distance);
+            for(s32 j = i + 1; j < i + length && j + 3 <= end; j++){
+                u32 hash = ((src[j] | (src[j + 1] << 8) | (src[j + 2] << 16))*2654435761u) >> (32 - DEFLATE_HASH_BITS);
+                lastPositions[hash] = j;
+            }
+            i += length;
+        }else{
+            PutFixedSymbol(&w, src[i]);
+            i++;
+        }
+    }
+    PutFixedSymbol(&w, 256); // End of block.
+    if (!last){
+        PutBits(&w, 0, 3); // Stored block, LEN 0 and NLEN 0xffff after the byte boundary.
+        FlushBits(&w);
+        *w.at++ = 0x00;
+        *w.at++ = 0x00;
+        *w.at++ = 0xff;
+        *w.at++ = 0xff;
+    }
+    FlushBits(&w);
+    return (umm)(w.at - dest);
+}
+
+inline u8 PaethPredictor(s32 a, s32 b, s32 c){
+    s32 p = a + b - c;
+    s32 pa = AbsS32(p - a);
+    s32 pb = AbsS32(p - b);
+    s32 pc = AbsS32(p - c);
+    u8 result = (u8)((pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c));
+    return result;
+}
+
+inline u8 *GetImageRow(image_encoder *encoder, s32 row){
+    u8 *result = encoder->pixels + (smm)row*encoder->stride;
+    return result;
+}
+
+// Copies a row as RGB.
+void PackImageRow(image_encoder *encoder, s32 row, u8 *dest){
+    u8 *src = GetImageRow(encoder, row);
+    if (encoder->pixelSize == 3){
+        memcpy(dest, src, (umm)encoder->dim.x*3);
+    }else{
+        for(s32 x = 0; x < encoder->dim.x; x++){
+            *dest++ = src[0];
+            *dest++ = src[1];
+            *dest++ = src[2];
+            src += encoder->pixelSize;
+        }
+    }
+}
+
+// Scratch memory used by EncodePngStrip() for a strip of 'numRows' rows of 'rowSize' bytes.
+inline umm GetPngStripScratchSize(s32 rowSize, s32 numRows){
+    umm result = (umm)numRows*(rowSize + 1) + 6*(umm)rowSize + sizeof(s32)*(1 << DEFLATE_HASH_BITS);
+    return result;
+}
+
+// An IDAT chunk with the rows of the strip, each one with the filter (none, sub, up or Paeth) that makes its
+// bytes the closest to 0.
+void EncodePngStrip(image_encoder *encoder, s32 stripIndex, memory_arena *scratch){
+    s32 rowSize = encoder->dim.x*3;
+    s32 firstRow = stripIndex*encoder->stripRows;
+    s32 numRows = MinS32(encoder->stripRows, encoder->dim.y - firstRow);
+    umm filteredSize = (umm)numRows*(rowSize + 1);
+    u8 *filtered = PushArray(scratch, u8, filteredSize);
+    u8 *candidates = PushArray(scratch, u8, 4*rowSize);
+    u8 *packed = PushArray(scratch, u8, 2*rowSize); // The current and the previous row, as RGB.
+    if (firstRow > 0){
+        PackImageRow(encoder, firstRow - 1, &packed[rowSize]);
+    }
+    for(s32 r = 0; r < numRows; r++){
+        s32 row = firstRow + r;
+        u8 *cur = &packed[(r & 1)*rowSize];
+        u8 *prev = (row > 0 ? &packed[((r + 1) & 1)*rowSize] : 0);
+        PackImageRow(encoder, row, cur);
+        s32 bestFilter = 0;
+        u32 bestCost = MAX_U32;
+        for(s32 filter = 0; filter < 4; filter++){
+            u8 *dest = &candidates[filter*rowSize];
+            u32 cost = 0;
+            for(s32 i = 0; i < rowSize; i++){
+                s32 a = (i >= 3 ? cur[i - 3] : 0);
+                s32 b = (prev ? prev[i] : 0);
+                s32 c = (prev && i >= 3 ? prev[i - 3] : 0);
+                s32 predicted = (filter == 0 ? 0 : filter == 1 ? a : filter == 2 ? b : PaethPredictor(a, b, c));
+                dest[i] = (u8)(cur[i] - predicted);
+                cost += AbsS32((s8)dest[i]);
+            }
+            if (cost < bestCost){
+                bestCost = cost;
+                bestFilter = filter;
+            }
+        }
+        u8 *dest = &filtered[(umm)r*(rowSize + 1)];
+        dest[0] = (u8)(bestFilter == 3 ? 4 : bestFilter); // Paeth is 4, we skip average.
+        memcpy(dest + 1, &candidates[bestFilter*rowSize], rowSize);
+    }
+
+    u32 s1 = 1, s2 = 0;
+    for(umm i = 0; i < filteredSize; i++){
+        s1 = (s1 + filtered[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    encoder->stripAdlers[stripIndex] = s1 | (s2 << 16);
+
+    u8 *chunk = &encoder->strips[stripIndex*encoder->maxStripSize];
+    u8 *data = chunk + 8;
+    if (stripIndex == 0){ // zlib header: deflate with a 32K window, no dictionary.
+        *data++ = 0x78;
+        *data++ = 0x01;
+    }
+    data += DeflateFixedBlock(filtered, filteredSize, data, stripIndex == encoder->numStrips - 1, scratch);
+    u32 dataSize = (u32)(data - (chunk + 8));
+    PutU32BigEndian(chunk, dataSize);
+    memcpy(chunk + 4, "IDAT", 4);
+    PutU32BigEndian(data, Crc32(chunk + 4, dataSize + 4));
+    encoder->stripSizes[stripIndex] = dataSize + 12;
+}
+
+inline u32 QoiHash(u8 r, u8 g, u8 b){
+    u32 result = (r*3 + g*5 + b*7 + 255*11) % 64;
+    return result;
+}
+
+void EncodeQoiStrip(image_encoder *encoder, s32 stripIndex){
+    s32 firstRow = stripIndex*encoder->stripRows;
+    s32 numRows = MinS32(encoder->stripRows, encoder->dim.y - firstRow);
+    s32 width = encoder->dim.x;
+    s32 pixelSize = encoder->pixelSize;
+    u8 *dest = &encoder->strips[stripIndex*encoder->maxStripSize];
+    u8 *start = dest;
+
+    u8 index[64][3];
+    u64 indexSet = 0; // The entries set by this strip, the others depend on the previous strips.
+    u8 prev[3] = {0, 0, 0};
+    if (firstRow > 0){
+        memcpy(prev, GetImageRow(encoder, firstRow - 1) + (width - 1)*pixelSize, 3);
+    }
+    s32 run = 0;
+    umm i = 0;
+    umm end = (umm)numRows*width;
+    for(s32 row = firstRow; row < firstRow + numRows; row++){
+        u8 *px = GetImageRow(encoder, row);
+        for(s32 x = 0; x < width; x++, i++, px += pixelSize){
+            if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]){
+                u32 hash = QoiHash(px[0], px[1], px[2]); // The decoder puts the pixel of a run in the index too.
+                memcpy(index[hash], px, 3);
+                indexSet |= (1ull << hash);
+                run++;
+                if (run == 62 || i == end - 1){
+                    *dest++ = (u8)(0xc0 | (run - 1));
+                    run = 0;
+                }
+            }else{
+                if (run > 0){
+                    *dest++ = (u8)(0xc0 | (run - 1));
+                    run = 0;
+                }
+                u32 hash = QoiHash(px[0], px[1], px[2]);
+                if ((indexSet & (1ull << hash)) && !memcmp(index[hash], px, 3)){
+                    *dest++ = (u8)hash;
+                }else{
+                    memcpy(index[hash], px, 3);
+                    indexSet |= (1ull << hash);
+                    s8 dr = (s8)(px[0] - prev[0]);
+                    s8 dg = (s8)(px[1] - prev[1]);
+                    s8 db = (s8)(px[2] - prev[2]);
+                    s8 drg = (s8)(dr - dg);
+                    s8 dbg = (s8)(db - dg);
+                    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1){
+                        *dest++ = (u8)(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+                    }else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7){
+                        *dest++ = (u8)(0x80 | (dg + 32));
+                        *dest++ = (u8)(((drg + 8) << 4) | (dbg + 8));
+                    }else{
+                        *dest++ = 0xfe;
+                        *dest++ = px[0];
+                        *dest++ = px[1];
+                        *dest++ = px[2];
+                    }
+                }
+            }
+            memcpy(prev, px, 3);
+        }
+    }
+    encoder->stripSizes[stripIndex] = (umm)(dest - start);
+}
+
+// Called by the worker threads.
+void EncodeImageStrip(image_encoder *encoder, s32 stripIndex, memory_arena *scratch){
+    if (encoder->format == IMAGE_PPM){
+        s32 firstRow = stripIndex*encoder->stripRows;
+        s32 numRows = MinS32(encoder->stripRows, encoder->dim.y - firstRow);
+        umm rowSize = (umm)encoder->dim.x*3;
+        u8 *dest = &encoder->strips[stripIndex*encoder->maxStripSize];
+        for(s32 r = 0; r < numRows; r++){
+            PackImageRow(encoder, firstRow + r, &dest[r*rowSize]);
+        }
+        encoder->stripSizes[stripIndex] = numRows*rowSize;
+    }else if (encoder->format == IMAGE_PNG){
+        EncodePngStrip(encoder, stripIndex, scratch);
+    }else if (encoder->format == IMAGE_QOI){
+        EncodeQoiStrip(encoder, stripIndex);
+    }
+    InterlockedDecrement(&encoder->stripsLeft);
+}
+
+void InitImageEncoder(image_encoder *encoder, image_format format){
+    *encoder = {};
+    encoder->format = format;
+    for(u32 i = 0; i < 256; i++){
+        u32 c = i;
+        for(s32 k = 0; k < 8; k++){
+            c = (c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1);
+        }
+        globalCrcTable[i] = c;
+    }
+}
+
+void FreeImageEncoder(image_encoder *encoder){
+    if (encoder->strips){
+        DeallocateMemory(encoder->strips);
+        DeallocateMemory(encoder->stripSizes);
+        DeallocateMemory(encoder->stripAdlers);
+    }
+    *encoder = {};
+}
+
+// Starts encoding the pixels with the worker threads, 'stride' bytes from a row to the one below it. The
+// strips are urgent entries, so they're done before the tiles that are already in the queue. The pixels
+// must not change until FinishImage().
+b32 BeginImage(image_encoder *encoder, u8 *pixels, v2s dim, s32 stride, s32 pixelSize){
+    auto gs = &globalState;
+    if (dim.x <= 0 || dim.y <= 0 || (pixelSize != 3 && pixelSize != 4)){
+        Printf("Can't encode a %ix%i image\n", dim.x, dim.y);
+        return false;
+    }
+    s32 rowSize = dim.x*3;
+    s32 stripRows = IMAGE_STRIP_ROWS;
+    if (encoder->format == IMAGE_PNG){
+        while(stripRows > 0 && GetPngStripScratchSize(rowSize, stripRows) > SCRATCH_ARENA_SIZE){
+            stripRows--;
+        }
+    }
+    s32 numStrips = (stripRows ? (dim.y + stripRows - 1)/stripRows : 0);
+    if (!stripRows || numStrips > MAX_URGENT_ENTRIES){
+        Printf("Can't encode a %ix%i image, it's too big\n", dim.x, dim.y);
+        return false;
+    }
+    umm stripPixels = (umm)dim.x*stripRows;
+    umm maxStripSize = stripPixels*3;
+    if (encoder->format == IMAGE_PNG){
+        maxStripSize = (stripPixels*3 + stripRows)*9/8 + 32; // With the chunk and the zlib header.
+    }else if (encoder->format == IMAGE_QOI){
+        maxStripSize = stripPixels*4;
+    }
+    if (numStrips*maxStripSize > encoder->stripsCapacity || numStrips > encoder->maxNumStrips){
+        image_format format = encoder->format;
+        FreeImageEncoder(encoder);
+        encoder->format = format;
+        encoder->stripsCapacity = numStrips*maxStripSize;
+        encoder->maxNumStrips = numStrips;
+        encoder->strips = (u8 *)AllocateMemory(encoder->stripsCapacity);
+        encoder->stripSizes = (umm *)AllocateMemory(numStrips*sizeof(umm));
+        encoder->stripAdlers = (u32 *)AllocateMemory(numStrips*sizeof(u32));
+    }
+    encoder->dim = dim;
+    encoder->pixels = pixels;
+    encoder->stride = stride;
+    encoder->pixelSize = pixelSize;
+    encoder->stripRows = stripRows;
+    encoder->numStrips = numStrips;
+    encoder->maxStripSize = maxStripSize;
+
+    encoder->stripsLeft = numStrips;
+    for(s32 i = 0; i < numStrips; i++){
+        work_entry *entry = AddUrgentWorkEntry(WORK_ENCODE_IMAGE_STRIP);
+        entry->imageEncoder = encoder;
+        entry->imageStripIndex = i;
+    }
+    PostUrgentWorkEntries();
+    return true;
+}
+
+void FinishImage(image_encoder *encoder){
+    while(encoder->stripsLeft){
+        Sleep(0);
+    }
+    _mm_lfence();
+}
+
+// The bytes before the strips, at most 64.
+s32 GetImageHeader(image_encoder *encoder, u8 *header){
+    s32 result = 0;
+    if (encoder->format == IMAGE_PPM){
+        char text[64];
+        result = sprintf_s(text, "P6 %i %i 255\n", encoder->dim.x, encoder->dim.y);
+        memcpy(header, text, result);
+    }else if (encoder->format == IMAGE_PNG){
+        u8 *ihdr = header + 8;
+        memcpy(header, "\x89PNG\r\n\x1a\n", 8);
+        PutU32BigEndian(ihdr, 13);
+        memcpy(ihdr + 4, "IHDR", 4);
+        PutU32BigEndian(ihdr + 8, encoder->dim.x);
+        PutU32BigEndian(ihdr + 12, encoder->dim.y);
+        u8 ihdrRest[] = {8, 2, 0, 0, 0}; // 8 bits per channel, RGB, deflate, adaptive filters, no interlacing.
+        memcpy(ihdr + 16, ihdrRest, sizeof(ihdrRest));
+        PutU32BigEndian(ihdr + 21, Crc32(ihdr + 4, 17));
+        result = 8 + 25;
+    }else if (encoder->format == IMAGE_QOI){
+        memcpy(header, "qoif", 4);
+        PutU32BigEndian(header + 4, encoder->dim.x);
+        PutU32BigEndian(header + 8, encoder->dim.y);
+        header[12] = 3; // RGB
+        header[13] = 0; // sRGB
+        result = 14;
+    }
+    return result;
+}
+
+// The bytes after the strips, at most 32. Only after FinishImage().
+s32 GetImageTrailer(image_encoder *encoder, u8 *trailer){
+    s32 result = 0;
+    if (encoder->format == IMAGE_PNG){
+        u32 adler = 1;
+        umm filteredRowSize = (umm)encoder->dim.x*3 + 1;
+        for(s32 i = 0; i < encoder->numStrips; i++){
+            s32 numRows = MinS32(encoder->stripRows, encoder->dim.y - i*encoder->stripRows);
+            adler = CombineAdler32(adler, encoder->stripAdlers[i], numRows*filteredRowSize);
+        }
+        // An IDAT chunk with the Adler-32 that ends the zlib stream, and IEND.
+        PutU32BigEndian(trailer, 4);
+        memcpy(trailer + 4, "IDAT", 4);
+        PutU32BigEndian(trailer + 8, adler);
+        PutU32BigEndian(trailer + 12, Crc32(trailer + 4, 8));
+        PutU32BigEndian(trailer + 16, 0);
+        memcpy(trailer + 20, "IEND", 4);
+        PutU32BigEndian(trailer + 24, Crc32(trailer + 20, 4));
+        result = 16 + 12;
+    }else if (encoder->format == IMAGE_QOI){
+        u8 end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        memcpy(trailer, end, sizeof(end));
+        result = sizeof(end);
+    }
+    return result;
+}
+
+// The size of the whole file. Only after FinishImage().
+umm GetEncodedImageSize(image_encoder *encoder){
+    u8 buffer[64];
+    umm result = GetImageHeader(encoder, buffer) + GetImageTrailer(encoder, buffer);
+    for(s32 i = 0; i < encoder->numStrips; i++){
+        result += encoder->stripSizes[i];
+    }
+    return result;
+}
+
+// Copies the whole file to 'dest', which must have GetEncodedImageSize() bytes. Only after FinishImage().
+void CopyEncodedImage(image_encoder *encoder, u8 *dest){
+    dest += GetImageHeader(encoder, dest);
+    for(s32 i = 0; i < encoder->numStrips; i++){
+        memcpy(dest, &encoder->strips[i*encoder->maxStripSize], encoder->stripSizes[i]);
+        dest += encoder->stripSizes[i];
+    }
+    GetImageTrailer(encoder, dest);
+}
+
+// Encodes the pixels (see BeginImage()) and writes the file.
+b32 WriteImage(image_encoder *encoder, u8 *pixels, v2s dim, s32 stride, s32 pixelSize, char *path){
+    if (!BeginImage(encoder, pixels, dim, stride, pixelSize)){
+        return false;
+    }
+    u8 header[64];
+    s32 headerSize = GetImageHeader(encoder, header);
+
+    // Opening the file while the strips are encoded.
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 0, 0);
+    FinishImage(encoder);
+    if (file == INVALID_HANDLE_VALUE){
+        Printf("Can't write %s\n", path);
+        return false;
+    }
+
+    DWORD bytesWritten;
+    b32 written = WriteFile(file, header, headerSize, &bytesWritten, 0);
+    for(s32 i = 0; i < encoder->numStrips && written; i++){
+        written = WriteFile(file, &encoder->strips[i*encoder->maxStripSize], (DWORD)encoder->stripSizes[i], &bytesWritten, 0);
+    }
+    u8 trailer[32];
+    s32 trailerSize = GetImageTrailer(encoder, trailer);
+    if (trailerSize){
+        written = written && WriteFile(file, trailer, trailerSize, &bytesWritten, 0);
+    }
+    CloseHandle(file);
+    if (!written){
+        Printf("Can't write %s\n", path);
+    }
+    return written;
+}
+
+//
+// Scenes
+//
+
+s32 AddSphere(scene *s, v3 c, f32 r, shape_material material){
+    Assert(s->numSpheres < MAX_SPHERES);
+    s32 index = s->numSpheres++;
+    s->spheres[index] = {c, r};
+    s->sphereMaterials[index] = material;
+    return index;
+}
+
+// 'n' must be normalized.
+s32 AddPlane(scene *s, v3 n, f32 d, shape_material material){
+    plane_bucket *planes = &s->planes;
+    Assert(planes->count < MAX_PLANES);
+    s32 index = planes->count++;
+    planes->nx[index] = n.x;
+    planes->ny[index] = n.y;
+    planes->nz[index] = n.z;
+    planes->d[index] = d;
+    planes->materials[index] = material;
+    return index;
+}
+
+s32 AddBox(scene *s, v3 min, v3 max, shape_material material){
+    box_bucket *boxes = &s->boxes;
+    Assert(boxes->count < MAX_BOXES);
+    s32 index = boxes->count++;
+    boxes->minX[index] = min.x;
+    boxes->minY[index] = min.y;
+    boxes->minZ[index] = min.z;
+    boxes->maxX[index] = max.x;
+    boxes->maxY[index] = max.y;
+    boxes->maxZ[index] = max.z;
+    boxes->materials[index] = material;
+    return index;
+}
+
+s32 AddTriangle(scene *s, v3 a, v3 b, v3 c, shape_material material){
+    triangle_bucket *triangles = &s->triangles;
+    Assert(triangles->count < MAX_TRIANGLES);
+    s32 index = triangles->count++;
+    triangles->ax[index] = a.x;
+    triangles->ay[index] = a.y;
+    triangles->az[index] = a.z;
+    triangles->e1x[index] = b.x - a.x;
+    triangles->e1y[index] = b.y - a.y;
+    triangles->e1z[index] = b.z - a.z;
+    triangles->e2x[index] = c.x - a.x;
+    triangles->e2y[index] = c.y - a.y;
+    triangles->e2z[index] = c.z - a.z;
+    triangles->materials[index] = material;
+    return index;
+}
+
+// The mesh must be filled (see LoadObj() and GenerateTorusKnot()), and then BuildMeshBvh() must be called.
+mesh *AddMesh(scene *s, shape_material material){
+    Assert(s->numMeshes < MAX_MESHES);
+    mesh *result = &s->meshes[s->numMeshes++];
+    ZeroStruct(result);
+    result->material = material;
+    return result;
+}
+
+// Adds a copy of the mesh, rotated and scaled around the mesh's origin and then moved to 'position'. The
+// mesh's BVH must be built, and the mesh stops being drawn on its own. BuildInstanceBvh() must be called
+// after adding all the instances.
+s32 AddInstance(scene *s, s32 meshIndex, v3 position, mat3 rotation, f32 scale, shape_material material){
+    Assert(s->numInstances < MAX_INSTANCES);
+    s32 index = s->numInstances++;
+    instance *inst = &s->instances[index];
+    mesh *m = &s->meshes[meshIndex];
+    m->instanced = true;
+    inst->meshIndex = meshIndex;
+    inst->position = position;
+    inst->toWorld = Scale3(V3(scale))*rotation;
+    inst->toObject = Transpose(rotation)*Scale3(V3(1.f/scale));
+    inst->material = material;
+
+    // Bounds of the corners of the mesh's box.
+    bvh_node *root = &m->bvh.nodes[0];
+    inst->min = V3(MAX_F32);
+    inst->max = V3(-MAX_F32);
+    for(s32 i = 0; i < 8; i++){
+        v3 corner = V3((i & 1) ? root->max.x : root->min.x, (i & 2) ? root->max.y : root->min.y, (i & 4) ? root->max.z : root->min.z);
+        v3 p = position + MatrixMultiply(corner, inst->toWorld);
+        inst->min = Min(inst->min, p);
+        inst->max = Max(inst->max, p);
+    }
+    return index;
+}
+
+// Builds the top level BVH, whose leaves are the instances.
+void BuildInstanceBvh(scene *s){
+    if (!s->numInstances)
+        return;
+    bvh_builder *b = (bvh_builder *)AllocateMemory(sizeof(bvh_builder));
+    ZeroStruct(b);
+    b->tree = &s->instanceBvh;
+    b->numPrimitives = (u32)s->numInstances;
+    b->instances = s->instances;
+    b->maxLeafSize = BVH_MAX_LEAF_INSTANCES;
+    BuildBvh(b);
+
+    CopyArray(s->sortedInstances, b->order, s->numInstances);
+    DeallocateMemory(b->order);
+    DeallocateMemory(b);
+}
+
+// A scene has one particle cloud at most. The orbits and the radius of each particle must be filled,
+// and the radii can't be bigger than 'maxRadius'. The particles are moved at the start of each frame.
+particle_cloud *AddParticles(scene *s, s32 count, v3 center, f32 maxRadius, particle_structure structure, shape_material material){
+    particle_cloud *c = &s->particles;
+    Assert(!c->count);
+    c->count = count;
+    c->center = center;
+    c->maxRadius = maxRadius;
+    c->structure = structure;
+    c->material = material;
+    c->spheres = (sphere *)AllocateMemory(count*sizeof(sphere));
+    c->orbits = (particle_orbit *)AllocateMemory(count*sizeof(particle_orbit));
+    s32 numChunks = (count + PARTICLE_CHUNK_SIZE - 1)/PARTICLE_CHUNK_SIZE;
+    c->chunkMin = (v3 *)AllocateMemory(numChunks*sizeof(v3));
+    c->chunkMax = (v3 *)AllocateMemory(numChunks*sizeof(v3));
+    return c;
+}
+
+inline v3 GetPlaneNormal(plane_bucket *planes, s32 index){
+    v3 result = {planes->nx[index], planes->ny[index], planes->nz[index]};
+    return result;
+}
+inline v3 GetBoxMin(box_bucket *boxes, s32 index){
+    v3 result = {boxes->minX[index], boxes->minY[index], boxes->minZ[index]};
+    return result;
+}
+inline v3 GetBoxMax(box_bucket *boxes, s32 index){
+    v3 result = {boxes->maxX[index], boxes->maxY[index], boxes->maxZ[index]};
+    return result;
+}
+inline void GetTriangle(triangle_bucket *triangles, s32 index, v3 *a, v3 *e1, v3 *e2){
+    *a  = V3(triangles->ax[index], triangles->ay[index], triangles->az[index]);
+    *e1 = V3(triangles->e1x[index], triangles->e1y[index], triangles->e1z[index]);
+    *e2 = V3(triangles->e2x[index], triangles->e2y[index], triangles->e2z[index]);
+}
+
+s32 AddLight(scene *s, v3 c, f32 r, v3 color, f32 intensity){
+    Assert(s->numLights < MAX_LIGHTS);
+    s32 index = s->numLights++;
+    sphere_light *light = &s->lights[index];
+    shape_material material = ShapeMaterial(color/Max(color.r, Max(color.g, color.b)), 0); // Keep the hue of bright lights.
+    material.emit = 1.f;
+    light->sphereIndex = AddSphere(s, c, r, material);
+    light->color = color;
+    light->intensity = intensity;
+    light->reach = LightReach(intensity);
+    return index;
+}
+
+// Must only be called while no frame is being rendered.
+#define NUM_SCENES 8
+
+void LoadScene(scene *s, s32 sceneIndex){
+    for(s32 i = 0; i < s->numMeshes; i++){
+        FreeMesh(&s->meshes[i]);
+    }
+    DeallocateMemory(s->instanceBvh.nodes);
+    FreeParticles(&s->particles);
+    ZeroStruct(s);
+    AddPlane(s, V3(0, 1.f, 0), 0, ShapeMaterial(V3(.5f, .8f, .4f), 0));
+
+    AddSphere(s, V3(0), 5.f,                 ShapeMaterial(V3(.5f), 1.f));
+    AddSphere(s, V3(0, 6.f, 0), 3.f,         ShapeMaterial(V3(1.f, .3f, .3f), 1.f));
+    AddSphere(s, V3(8.f, 0, 0), 2.f,         ShapeMaterial(V3(.3f, 1.f, .5f), 1.f));
+    AddSphere(s, V3(9.2f, 4.f, 1.f), 1.8f,   ShapeMaterial(V3(.3f, .3f, .9f), .5f));
+
+    if (sceneIndex == 1){
+        // Lots of small colored lights. Each one only reaches the shapes close to it.
+        v3 colors[] = {V3(1.f, .2f, .2f), V3(.2f, 1.f, .2f), V3(.2f, .2f, 1.f), V3(1.f, .8f, .2f), V3(.2f, .9f, 1.f), V3(1.f, .3f, .9f)};
+        for(s32 z = 0; z < 8; z++){
+            for(s32 x = 0; x < 8; x++){
+                v3 c = V3(-28.f + 8.f*x, .6f + 1.5f*((x + z) % 3), -28.f + 8.f*z);
+                v3 color = colors[FastHash((u32)(8*z + x)) % ArrayCount(colors)];
+                AddLight(s, c, .3f, 6.f*color, .004f);
+            }
+        }
+    }else if (sceneIndex == 2){
+        // Lots of small spheres around. Each one only casts shadows over a few tiles.
+        AddLight(s, V3(0, 15.f, 0), 2.5f, V3(1.f), 1.f);
+        v3 colors[] = {V3(.9f, .9f, .3f), V3(.3f, .9f, .9f), V3(.9f, .4f, .8f), V3(.8f, .5f, .2f)};
+        for(s32 z = 0; z < 14; z++){
+            for(s32 x = 0; x < 14; x++){
+                u32 hash = SimpleHash((u32)(14*z + x));
+                f32 r = .4f + .8f*(hash & 0xff)/255.f;
+                v3 c = V3(-32.5f + 5.f*x, r, -32.5f + 5.f*z);
+                if (LengthSqr(c - V3(4.f, 0, 0)) < SQUARE(10.f))
+                    continue;
+                AddSphere(s, c, r, ShapeMaterial(colors[(hash >> 8) % ArrayCount(colors)], .5f));
+            }
+        }
+    }else if (sceneIndex == 3){
+        // Other kinds of shapes: a wall, some boxes and a pyramid.
+        AddLight(s, V3(0, 15.f, 0), 2.5f, V3(1.f), 1.f);
+        AddPlane(s, V3(0, 0, -1.f), -40.f, ShapeMaterial(V3(.8f, .7f, .6f), 0));
+        AddBox(s, V3(-14.f, 0, -2.f), V3(-10.f, 4.f, 2.f), ShapeMaterial(V3(.9f, .5f, .2f), .5f));
+        AddBox(s, V3(-13.f, 4.f, -1.f), V3(-11.f, 6.f, 1.f), ShapeMaterial(V3(.2f, .5f, .9f), .5f));
+        AddBox(s, V3(-9.f, 0, 6.f), V3(-7.f, 2.f, 8.f), ShapeMaterial(V3(.9f, .9f, .9f), 1.f));
+        v3 apex = V3(3.f, 4.f, -9.f);
+        v3 base[4] = {V3(.5f, 0, -11.5f), V3(5.5f, 0, -11.5f), V3(5.5f, 0, -6.5f), V3(.5f, 0, -6.5f)};
+        for(s32 i = 0; i < 4; i++){
+            AddTriangle(s, base[i], base[(i + 1) % 4], apex, ShapeMaterial(V3(.9f, .8f, .3f), .5f));
+        }
+    }else if (sceneIndex == 4){
+        // A big mesh: data/model.obj if there's one, or else a knot of a million triangles.
+        AddLight(s, V3(0, 15.f, 0), 2.5f, V3(1.f), 1.f);
+        mesh *m = AddMesh(s, ShapeMaterial(V3(.8f, .6f, .9f), .5f));
+        if (!LoadObj(m, "data/model.obj")){
+            GenerateTorusKnot(m, 2048, 256, .5f);
+        }
+        FitMesh(m, V3(-9.f, 5.f, 10.f), 10.f);
+        BuildMeshBvh(m, false);
+
+        // A smaller knot that twists back and forth. Its BVH is refitted every frame.
+        m = AddMesh(s, ShapeMaterial(V3(.3f, .8f, .9f), .5f));
+        GenerateTorusKnot(m, 512, 64, .5f);
+        FitMesh(m, V3(9.f, 4.5f, 12.f), 7.f);
+        BuildMeshBvh(m, false);
+        SetMeshTwist(m, V3(9.f, 4.5f, 12.f), .3f);
+    }else if (sceneIndex == 5){
+        // Thousands of instances of a knot, which is only stored once.
+        AddLight(s, V3(0, 15.f, 0), 2.5f, V3(1.f), 1.f);
+        AddLight(s, V3(-30.f, 12.f, 40.f), 2.5f, V3(1.f, .8f, .6f), 1.f);
+        AddLight(s, V3(30.f, 12.f, 40.f), 2.5f, V3(.6f, .8f, 1.f), 1.f);
+        mesh *m = AddMesh(s, ShapeMaterial(V3(1.f), 0));
+        s32 meshIndex = s->numMeshes - 1;
+        GenerateTorusKnot(m, 256, 32, .5f);
+        FitMesh(m, V3(0), 2.f);
+        BuildMeshBvh(m, false);
+        v3 colors[] = {V3(.9f, .4f, .3f), V3(.3f, .8f, .5f), V3(.4f, .5f, .9f), V3(.9f, .8f, .3f), V3(.8f, .4f, .9f)};
+        for(s32 z = 0; z < 64; z++){
+            for(s32 x = 0; x < 64; x++){
+                u32 hash = SimpleHash((u32)(64*z + x));
+                v3 c = V3(-94.5f + 3.f*x, 0, -94.5f + 3.f*z);
+                if (LengthSqr(c - V3(4.f, 0, 0)) < SQUARE(12.f))
+                    continue;
+                f32 scale = .6f + .8f*(hash & 0xff)/255.f;
+                f32 yaw = 2*PI*((hash >> 8) & 0xff)/255.f;
+                f32 tilt = .6f*(((hash >> 16) & 0xff)/255.f - .5f);
+                c.y = scale;
+                AddInstance(s, meshIndex, c, XRotation3(tilt)*YRotation3(yaw), scale, ShapeMaterial(colors[(hash >> 24) % ArrayCount(colors)], .5f));
+            }
+        }
+        BuildInstanceBvh(s);
+    }else if (sceneIndex == 6){
+        // A disc of 200k small particles orbiting around, faster near the center. Their grid (or BVH) is
+        // rebuilt every frame.
+        AddLight(s, V3(0, 15.f, 0), 2.5f, V3(1.f), 1.f);
+        AddLight(s, V3(0, 14.f, 30.f), 2.5f, V3(1.f, .7f, .4f), 1.f);
+        s32 count = 200000;
+        particle_cloud *c = AddParticles(s, count, V3(0, 6.f, 30.f), .12f, PARTICLES_GRID, ShapeMaterial(V3(.9f, .8f, .6f), .5f));
+        for(s32 i = 0; i < count; i++){
+            u32 hash = SimpleHash((u32)i);
+            u32 hash2 = SimpleHash(hash);
+            particle_orbit *orbit = &c->orbits[i];
+            orbit->radius = 7.f + 15.f*(hash & 0xffff)/65535.f;
+            orbit->angle = 2*PI*(hash >> 16)/65535.f;
+            orbit->height = 2.f*((hash2 & 0xffff)/65535.f - .5f);
+            orbit->speed = 2.f/SquareRoot(orbit->radius);
+            c->spheres[i].r = .06f + .06f*(hash2 >> 16)/65535.f;
+        }
+    }else if (sceneIndex == 7){
+        // A point cloud mapped from a file, which can be bigger than the memory. If there's no such file, a
+        // patch of hills of 2 million spheres is written first.
+        AddLight(s, V3(0, 15.f, 0), 2.5f, V3(1.f), 1.f);
+        AddLight(s, V3(-20.f, 14.f, 60.f), 2.5f, V3(1.f, .8f, .6f), 1.f);
+        shape_material material = ShapeMaterial(V3(.7f, .6f, .5f), 0);
+        char *path = "data/points.spheres";
+        if (!MapSphereFile(s, path, material)){
+            s32 count;
+            sphere *spheres = GeneratePointCloud(1448, &count);
+            CreateDirectoryA("data", 0);
+            if (WriteSphereFile(path, spheres, count)){
+                MapSphereFile(s, path, material);
+            }
+            DeallocateMemory(spheres);
+        }
+    }else{
+        AddLight(s, V3(0, 15.f, 0), 2.5f, V3(1.f), 1.f);
+    }
+
+    s->cameraSphereIndex = AddSphere(s, INITIAL_CAM_POS, 1.5f, ShapeMaterial(V3(.3f, .3f, .3f), 0));
+    s->dynamicSpheres[s->cameraSphereIndex] = true;
+}
+
+
+//
+// Shadow cache
+//
+
+inline shadow_texel EncodeShadowTexel(shadow_accumulator *acc){
+    shadow_texel result;
+    result.lMin = (u16)(Clamp01(acc->lMin)*65535.f + .5f);
+    result.lSum = (u16)(Clamp01(acc->lSum)*65535.f + .5f);
+    result.blockedAverage = (u16)(Clamp01(SafeDivide0(acc->blockedSum, acc->blockCount))*65535.f + .5f);
+    result.blockCount = (u16)Min(acc->blockCount, 65535.f);
+    return result;
+}
+inline shadow_accumulator DecodeShadowTexel(shadow_texel texel){
+    shadow_accumulator result;
+    result.lMin = texel.lMin/65535.f;
+    result.lSum = texel.lSum/65535.f;
+    result.blockCount = (f32)texel.blockCount;
+    result.blockedSum = texel.blockedAverage/65535.f*result.blockCount;
+    return result;
+}
+
+inline v3 ShadowTexelPosition(scene *s, shadow_map *map, s32 x, s32 y){
+    v3 result;
+    if (map->shapeType == SHAPE_PLANE){
+        result = map->planePoint + (map->origin.x + x/SHADOW_TEXELS_PER_UNIT)*map->planeU + (map->origin.y + y/SHADOW_TEXELS_PER_UNIT)*map->planeV;
+    }else{
+        sphere sp = s->spheres[map->shapeIndex];
+        f32 longitude = 2.f*PI*x/map->dim.x - PI;
+        f32 latitude = PI*y/(map->dim.y - 1);
+        v3 n = {Sin(latitude)*Cos(longitude), Cos(latitude), Sin(latitude)*Sin(longitude)};
+        result = sp.c + sp.r*n;
+    }
+    return result;
+}
+
+// Ball that contains all the texels of the chunk.
+void GetShadowChunkBall(scene *s, shadow_map *map, s32 chunkIndex, v3 *center, f32 *radius){
+    if (map->shapeType == SHAPE_PLANE){
+        v2s chunk = {chunkIndex % map->chunkDim.x, chunkIndex / map->chunkDim.x};
+        v2 chunkMin = map->origin + V2(chunk*SHADOW_CHUNK_SIZE)/SHADOW_TEXELS_PER_UNIT;
+        v2 chunkMax = map->origin + V2(V2S(MinS32((chunk.x + 1)*SHADOW_CHUNK_SIZE, map->dim.x - 1), MinS32((chunk.y + 1)*SHADOW_CHUNK_SIZE, map->dim.y - 1)))/SHADOW_TEXELS_PER_UNIT;
+        *center = map->planePoint + (chunkMin.x + chunkMax.x)/2*map->planeU + (chunkMin.y + chunkMax.y)/2*map->planeV;
+        *radius = Length(chunkMax - chunkMin)/2;
+    }else{ // The whole sphere, we don't bother with the chunk's patch.
+        sphere sp = s->spheres[map->shapeIndex];
+        *center = sp.c;
+        *radius = sp.r;
+    }
+}
+
+// Returns -1 if the cache is full.
+s32 AddShadowMap(shadow_cache *cache, s32 lightIndex, shape_type shapeType, s32 shapeIndex, v2s dim){
+    if (cache->numMaps >= ArrayCount(cache->maps))
+        return -1;
+    s32 index = cache->numMaps++;
+    shadow_map *map = &cache->maps[index];
+    map->lightIndex = lightIndex;
+    map->shapeType = shapeType;
+    map->shapeIndex = shapeIndex;
+    map->dim = dim;
+    map->chunkDim = V2S((dim.x + SHADOW_CHUNK_SIZE - 1)/SHADOW_CHUNK_SIZE, (dim.y + SHADOW_CHUNK_SIZE - 1)/SHADOW_CHUNK_SIZE);
+    map->texels = (shadow_texel *)AllocateMemory(dim.x*dim.y*sizeof(shadow_texel));
+    map->dirtyChunks = (b32 *)AllocateMemory(map->chunkDim.x*map->chunkDim.y*sizeof(b32));
+    for(s32 i = 0; i < map->chunkDim.x*map->chunkDim.y; i++){
+        map->dirtyChunks[i] = true;
+    }
+    return index;
+}
+
+// A plane's map is centered at the projection of the light onto the plane. The axes of the horizontal
+// planes are x and z.
+void UpdatePlaneShadowMapOrigin(scene *s, shadow_map *map){
+    v3 n = GetPlaneNormal(&s->planes, map->shapeIndex);
+    map->planePoint = n*s->planes.d[map->shapeIndex];
+    map->planeU = Normalize(V3(1.f, 0, 0) - n.x*n);
+    if (Abs(n.x) > .9f){
+        map->planeU = Normalize(V3(0, 0, 1.f) - n.z*n);
+    }
+    map->planeV = Cross(map->planeU, n);
+
+    v3 lightPos = s->spheres[s->lights[map->lightIndex].sphereIndex].c;
+    f32 halfExtent = (map->dim.x - 1)/SHADOW_TEXELS_PER_UNIT/2;
+    map->origin = V2(Dot(lightPos - map->planePoint, map->planeU) - halfExtent, Dot(lightPos - map->planePoint, map->planeV) - halfExtent);
+}
+
+void FreeShadowCache(shadow_cache *cache){
+    for(s32 i = 0; i < cache->numMaps; i++){
+        DeallocateMemory(cache->maps[i].texels);
+        DeallocateMemory(cache->maps[i].dirtyChunks);
+    }
+    cache->numMaps = 0;
+}
+
+// Creates the maps for the shadows of the planes and every static sphere that each light can reach. The
+// maps start dirty, so UpdateShadowCache() must be called afterwards.
+void InitShadowCache(shadow_cache *cache, scene *s){
+    FreeShadowCache(cache);
+    for(s32 lightIndex = 0; lightIndex < MAX_LIGHTS; lightIndex++){
+        for(s32 i = 0; i < MAX_PLANES; i++){
+            cache->planeMaps[lightIndex][i] = -1;
+        }
+        for(s32 i = 0; i < MAX_SPHERES; i++){
+            cache->sphereMaps[lightIndex][i] = -1;
+        }
+    }
+
+    for(s32 lightIndex = 0; lightIndex < s->numLights; lightIndex++){
+        sphere_light *light = &s->lights[lightIndex];
+        v3 lightPos = s->spheres[light->sphereIndex].c;
+
+        for(s32 i = 0; i < s->planes.count; i++){
+            f32 lightHeight = Dot(GetPlaneNormal(&s->planes, i), lightPos) - s->planes.d[i];
+            if (lightHeight > 0 && lightHeight < light->reach){
+                f32 halfExtent = Min(light->reach, SHADOW_MAX_PLANE_EXTENT);
+                s32 mapIndex = AddShadowMap(cache, lightIndex, SHAPE_PLANE, i, V2S(1 + 2*(s32)(halfExtent*SHADOW_TEXELS_PER_UNIT)));
+                if (mapIndex >= 0){
+                    UpdatePlaneShadowMapOrigin(s, &cache->maps[mapIndex]);
+                    cache->planeMaps[lightIndex][i] = (s16)mapIndex;
+                }
+            }
+        }
+
+        for(s32 i = 0; i < s->numSpheres; i++){
+            sphere sp = s->spheres[i];
+            if (s->dynamicSpheres[i] || s->sphereMaterials[i].emit)
+                continue;
+            if (Length(sp.c - lightPos) - sp.r < light->reach){
+                v2s dim = V2S(MaxS32(8, (s32)Ceil(2.f*PI*sp.r*SHADOW_TEXELS_PER_UNIT)),
+                              MaxS32(5, 1 + (s32)Ceil(PI*sp.r*SHADOW_TEXELS_PER_UNIT)));
+                s32 mapIndex = AddShadowMap(cache, lightIndex, SHAPE_SPHERE, i, dim);
+                if (mapIndex >= 0){
+                    cache->sphereMaps[lightIndex][i] = (s16)mapIndex;
+                }
+            }
+        }
+    }
+}
+
+void BakeShadowChunk(shadow_cache *cache, s32 mapIndex, s32 chunkIndex){
+    scene *s = &globalState.scene;
+    shadow_map *map = &cache->maps[mapIndex];
+    sphere lightSphere = s->spheres[s->lights[map->lightIndex].sphereIndex];
+
+    // Static occluders that can block the light to the chunk.
+    v3 ballCenter;
+    f32 ballRadius;
+    GetShadowChunkBall(s, map, chunkIndex, &ballCenter, &ballRadius);
+    s32 occluders[MAX_SPHERES];
+    s32 numOccluders = 0;
+    for(s32 i = 0; i < s->numSpheres; i++){
+        if (s->dynamicSpheres[i] || s->sphereMaterials[i].emit)
+            continue;
+        if (SphereCanBlockLightToBall(s->spheres[i].c, s->spheres[i].r, ballCenter, ballRadius, lightSphere.c, Max(SHADOW_CACHE_R0, lightSphere.r))){
+            occluders[numOccluders++] = i;
+        }
+    }
+
+    v2s chunk = {chunkIndex % map->chunkDim.x, chunkIndex / map->chunkDim.x};
+    v2s texelMin = chunk*SHADOW_CHUNK_SIZE;
+    v2s texelMax = V2S(MinS32(texelMin.x + SHADOW_CHUNK_SIZE, map->dim.x), MinS32(texelMin.y + SHADOW_CHUNK_SIZE, map->dim.y));
+    for(s32 y = texelMin.y; y < texelMax.y; y++){
+        for(s32 x = texelMin.x; x < texelMax.x; x++){
+            v3 p = ShadowTexelPosition(s, map, x, y);
+            f32 lightDistance = Length(lightSphere.c - p);
+            v3 lightDir = Normalize(lightSphere.c - p);
+            v3 perpX = Perpendicular(lightDir);
+            v3 perpY = Cross(perpX, lightDir);
+
+            shadow_accumulator shadow = ShadowAccumulator();
+            for(s32 i = 0; i < numOccluders; i++){
+                AccumulateShadow(&shadow, s->spheres[occluders[i]], p, lightDir, lightDistance, perpX, perpY, SHADOW_CACHE_R0, lightSphere.r);
+            }
+            map->texels[y*map->dim.x + x] = EncodeShadowTexel(&shadow);
+        }
+    }
+    map->dirtyChunks[chunkIndex] = false;
+}
+
+// Bakes all the dirty chunks using the worker threads, and waits till they're done.
+// Must only be called while no frame is being rendered.
+// Returns the number of chunks baked.
+s32 UpdateShadowCache(shadow_cache *cache){
+    auto gs = &globalState;
+    s32 numBakedChunks = 0;
+
+    BeginWorkEntries();
+    for(s32 mapIndex = 0; mapIndex < cache->numMaps; mapIndex++){
+        shadow_map *map = &cache->maps[mapIndex];
+        for(s32 chunkIndex = 0; chunkIndex < map->chunkDim.x*map->chunkDim.y; chunkIndex++){
+            if (map->dirtyChunks[chunkIndex]){
+                if (gs->numEntries == ArrayCount(gs->entries)){
+                    PostWorkEntries();
+                    WaitForWorkEntries();
+                    BeginWorkEntries();
+                }
+                work_entry *entry = AddWorkEntry(WORK_BAKE_SHADOW_CHUNK);
+                entry->shadowMapIndex = mapIndex;
+                entry->shadowChunkIndex = chunkIndex;
+                numBakedChunks++;
+            }
+        }
+    }
+    PostWorkEntries();
+    WaitForWorkEntries();
+    return numBakedChunks;
+}
+
+// Marks as dirty the chunks whose shadows may change when the sphere moves from 'oldSphere' to its
+// current position.
+void InvalidateShadowCacheForSphere(shadow_cache *cache, scene *s, s32 sphereIndex, sphere oldSphere){
+    sphere newSphere = s->spheres[sphereIndex];
+    for(s32 mapIndex = 0; mapIndex < cache->numMaps; mapIndex++){
+        shadow_map *map = &cache->maps[mapIndex];
+        sphere lightSphere = s->spheres[s->lights[map->lightIndex].sphereIndex];
+        f32 coneRadius = Max(SHADOW_CACHE_R0, lightSphere.r);
+        for(s32 chunkIndex = 0; chunkIndex < map->chunkDim.x*map->chunkDim.y; chunkIndex++){
+            if (map->dirtyChunks[chunkIndex])
+                continue;
+            v3 ballCenter;
+            f32 ballRadius;
+            GetShadowChunkBall(s, map, chunkIndex, &ballCenter, &ballRadius);
+            if ((map->shapeType == SHAPE_SPHERE && map->shapeIndex == sphereIndex) ||
+                SphereCanBlockLightToBall(oldSphere.c, oldSphere.r, ballCenter, ballRadius, lightSphere.c, coneRadius) ||
+                SphereCanBlockLightToBall(newSphere.c, newSphere.r, ballCenter, ballRadius, lightSphere.c, coneRadius)){
+                map->dirtyChunks[chunkIndex] = true;
+            }
+        }
+    }
+}
+
+void InvalidateShadowCacheForLight(shadow_cache *cache, scene *s, s32 lightIndex){
+    for(s32 mapIndex = 0; mapIndex < cache->numMaps; mapIndex++){
+        shadow_map *map = &cache->maps[mapIndex];
+        if (map->lightIndex == lightIndex){
+            if (map->shapeType == SHAPE_PLANE){
+                UpdatePlaneShadowMapOrigin(s, map);
+            }
+            for(s32 chunkIndex = 0; chunkIndex < map->chunkDim.x*map->chunkDim.y; chunkIndex++){
+                map->dirtyChunks[chunkIndex] = true;
+            }
+        }
+    }
+}
+
+// Returns false if the shadow of this shape for this light isn't cached.
+b32 SampleShadowCache(shadow_cache *cache, scene *s, shape_type shapeType, s32 shapeIndex, s32 lightIndex, v3 p, shadow_accumulator *result){
+    s32 mapIndex = -1;
+    if (shapeType == SHAPE_SPHERE){
+        mapIndex = cache->sphereMaps[lightIndex][shapeIndex];
+    }else if (shapeType == SHAPE_PLANE){
+        mapIndex = cache->planeMaps[lightIndex][shapeIndex];
+    }
+    if (mapIndex < 0)
+        return false;
+    shadow_map *map = &cache->maps[mapIndex];
+
+    f32 fx, fy;
+    if (map->shapeType == SHAPE_PLANE){
+        fx = (Dot(p - map->planePoint, map->planeU) - map->origin.x)*SHADOW_TEXELS_PER_UNIT;
+        fy = (Dot(p - map->planePoint, map->planeV) - map->origin.y)*SHADOW_TEXELS_PER_UNIT;
+        if (fx < 0 || fy < 0 || fx >= map->dim.x - 1 || fy >= map->dim.y - 1) // Out of the map
+            return false;
+    }else{
+        sphere sp = s->spheres[map->shapeIndex];
+        v3 n = (p - sp.c)/sp.r;
+        fx = (ATan2(n.z, n.x) + PI)/(2.f*PI)*map->dim.x;
+        fy = Min(ACos(Clamp(n.y, -1.f, 1.f))/PI*(map->dim.y - 1), map->dim.y - 1.001f);
+    }
+
+    // Bilinear interpolation
+    s32 x0 = (s32)fx;
+    s32 y0 = (s32)fy;
+    f32 tx = fx - x0;
+    f32 ty = fy - y0;
+    s32 x1 = x0 + 1;
+    s32 y1 = y0 + 1;
+    if (map->shapeType == SHAPE_SPHERE){ // The longitude wraps around.
+        x0 %= map->dim.x;
+        x1 %= map->dim.x;
+    }
+    shadow_accumulator a = DecodeShadowTexel(map->texels[y0*map->dim.x + x0]);
+    shadow_accumulator b = DecodeShadowTexel(map->texels[y0*map->dim.x + x1]);
+    shadow_accumulator c = DecodeShadowTexel(map->texels[y1*map->dim.x + x0]);
+    shadow_accumulator d = DecodeShadowTexel(map->texels[y1*map->dim.x + x1]);
+    result->lMin       = Lerp(Lerp(a.lMin, b.lMin, tx), Lerp(c.lMin, d.lMin, tx), ty);
+    result->lSum       = Lerp(Lerp(a.lSum, b.lSum, tx), Lerp(c.lSum, d.lSum, tx), ty);
+    result->blockCount = Lerp(Lerp(a.blockCount, b.blockCount, tx), Lerp(c.blockCount, d.blockCount, tx), ty);
+    result->blockedSum = Lerp(Lerp(a.blockedSum, b.blockedSum, tx), Lerp(c.blockedSum, d.blockedSum, tx), ty);
+    return true;
+}
+
+// Must only be called while no frame is being rendered. UpdateShadowCache() must be called afterwards.
+void MoveSphere(s32 sphereIndex, v3 newCenter){
+    auto gs = &globalState;
+    scene *s = &gs->scene;
+    sphere oldSphere = s->spheres[sphereIndex];
+    s->spheres[sphereIndex].c = newCenter;
+
+    if (s->sphereMaterials[sphereIndex].emit){
+        for(s32 lightIndex = 0; lightIndex < s->numLights; lightIndex++){
+            if (s->lights[lightIndex].sphereIndex == sphereIndex){
+                InvalidateShadowCacheForLight(&gs->shadowCache, s, lightIndex);
+            }
+        }
+    }else if (!s->dynamicSpheres[sphereIndex]){
+        InvalidateShadowCacheForSphere(&gs->shadowCache, s, sphereIndex, oldSphere);
+    }
+}
+
+// Must only be called while no frame is being rendered.
+void ChangeScene(s32 sceneIndex){
+    auto gs = &globalState;
+    gs->sceneIndex = sceneIndex;
+    LoadScene(&gs->scene, sceneIndex);
+    gs->sceneStartTime = GetCurrentTimeCounter();
+    LARGE_INTEGER startTime = GetCurrentTimeCounter();
+    InitShadowCache(&gs->shadowCache, &gs->scene);
+    s32 numBakedChunks = UpdateShadowCache(&gs->shadowCache);
+    Printf("Shadow cache: baked %i chunks in %.2fms\n", numBakedChunks, 1000.f*GetSecondsElapsed(startTime, GetCurrentTimeCounter()));
+}
+
+
+//
+// Screen-space binning
+//
+
+// Range of pixel columns (or rows) covered by the projection of the sphere, from the sphere's
+// coordinates relative to the camera along that screen axis (a) and along the forward axis (z).
+// 'worldDim' is the size of the frame at distance 1. Returns false if it doesn't cover any pixel.
+// The tangent lines from the camera to the circle have slopes (a*z -+ r*sqrt(a^2 + z^2 - r^2))/(z^2 - r^2).
+// Needs z > r, so that the sphere is in front of the camera.
+b32 ProjectedSphereRange(f32 a, f32 z, f32 r, f32 worldDim, s32 numPixels, s32 *pixelMin, s32 *pixelMax){
+    f32 k = SquareRoot(a*a + z*z - r*r);
+    f32 denom = z*z - r*r;
+    f32 slopeMin = (a*z - r*k)/denom;
+    f32 slopeMax = (a*z + r*k)/denom;
+    // Pixel i shoots the ray with slope (-1 + 2*i/numPixels)*worldDim/2. We add a pixel of margin for rounding errors.
+    f32 min = (slopeMin/worldDim + .5f)*numPixels - 1.f;
+    f32 max = (slopeMax/worldDim + .5f)*numPixels + 1.f;
+    if (max < 0 || min > numPixels - 1)
+        return false;
+    *pixelMin = (s32)Max(min, 0);
+    *pixelMax = (s32)Min(max, (f32)(numPixels - 1));
+    return true;
+}
+
+// Rectangle of tiles (inclusive) covered by the projection of a sphere, given its center relative to the
+// camera. Returns false if it doesn't cover any tile.
+b32 GetSphereTileRect(frame_view *view, v3 c, f32 r, v2 worldFrameDim, v2s *tileMin, v2s *tileMax){
+    f32 x = Dot(c, view->camRight);
+    f32 y = Dot(c, view->camUp);
+    f32 z = Dot(c, view->camForward);
+    if (z <= -r){
+        return false; // Behind the camera.
+    }
+    if (z <= r){
+        // Crosses the camera plane, so the projection isn't bounded. Just cover the whole frame.
+        *tileMin = V2S(0);
+        *tileMax = view->numTiles - V2S(1);
+        return true;
+    }
+    v2s pixelMin, pixelMax;
+    if (ProjectedSphereRange(x, z, r, worldFrameDim.x, view->frameDim.x, &pixelMin.x, &pixelMax.x) &&
+        ProjectedSphereRange(y, z, r, worldFrameDim.y, view->frameDim.y, &pixelMin.y, &pixelMax.y)){
+        *tileMin = pixelMin/TILE_SIZE;
+        *tileMax = pixelMax/TILE_SIZE;
+        return true;
+    }
+    return false;
+}
+
+// Projects every sphere to the screen to make a list for each tile of the spheres that can be hit by
+// its primary rays. For the other kinds of shapes we only check if any of them can be hit in each tile.
+void BinShapes(frame_view *view){
+    scene *s = &view->scene;
+
+    v2 worldFrameDim;
+    worldFrameDim.y = Tan(view->fovY/2);
+    worldFrameDim.x = worldFrameDim.y*(view->frameDim.x/(f32)view->frameDim.y);
+
+    view->numTiles = V2S((view->frameDim.x + TILE_SIZE - 1)/TILE_SIZE, (view->frameDim.y + TILE_SIZE - 1)/TILE_SIZE);
+    s32 numTiles = view->numTiles.x*view->numTiles.y;
+    Assert(numTiles <= MAX_TILES);
+    for(s32 i = 0; i < numTiles; i++){
+        tile_bin *bin = &view->tileBins[i];
+        bin->numSpheres = 0;
+        bin->planes = false;
+        bin->boxes = false;
+        bin->triangles = false;
+        bin->meshes = false;
+    }
+
+    // Rectangle of tiles covered by each sphere (inclusive). Empty if min > max.
+    v2s sphereTileMin[MAX_SPHERES];
+    v2s sphereTileMax[MAX_SPHERES];
+    for(s32 i = 0; i < s->numSpheres; i++){
+        sphereTileMin[i] = V2S(0);
+        sphereTileMax[i] = V2S(-1);
+        if (view->primarySpheres[i].c <= 0){
+            // The camera is inside, and IntersectSphere() only returns the closest solution, which is behind.
+            continue;
+        }
+        if (!GetSphereTileRect(view, -view->primarySpheres[i].ro, s->spheres[i].r, worldFrameDim, &sphereTileMin[i], &sphereTileMax[i])){
+            sphereTileMax[i] = V2S(-1);
+            continue;
+        }
+        for(s32 tileY = sphereTileMin[i].y; tileY <= sphereTileMax[i].y; tileY++){
+            for(s32 tileX = sphereTileMin[i].x; tileX <= sphereTileMax[i].x; tileX++){
+                view->tileBins[tileY*view->numTiles.x + tileX].numSpheres++;
+            }
+        }
+    }
+
+    // Allocate the lists and fill them in sphere order, so the closest hit is picked the same way as without binning.
+    s32 numBinnedSpheres = 0;
+    for(s32 i = 0; i < numTiles; i++){
+        view->tileBins[i].firstSphere = numBinnedSpheres;
+        numBinnedSpheres += view->tileBins[i].numSpheres;
+        view->tileBins[i].numSpheres = 0;
+    }
+    for(s32 i = 0; i < s->numSpheres; i++){
+        for(s32 tileY = sphereTileMin[i].y; tileY <= sphereTileMax[i].y; tileY++){
+            for(s32 tileX = sphereTileMin[i].x; tileX <= sphereTileMax[i].x; tileX++){
+                tile_bin *bin = &view->tileBins[tileY*view->numTiles.x + tileX];
+                view->binnedSpheres[bin->firstSphere + bin->numSpheres++] = i;
+            }
+        }
+    }
+
+    // Boxes, triangles and meshes: Use their bounding spheres.
+    for(s32 i = 0; i < s->boxes.count; i++){
+        v3 min = GetBoxMin(&s->boxes, i);
+        v3 max = GetBoxMax(&s->boxes, i);
+        v2s tileMin, tileMax;
+        if (GetSphereTileRect(view, (min + max)/2 - view->camPos, Length(max - min)/2, worldFrameDim, &tileMin, &tileMax)){
+            for(s32 tileY = tileMin.y; tileY <= tileMax.y; tileY++){
+                for(s32 tileX = tileMin.x; tileX <= tileMax.x; tileX++){
+                    view->tileBins[tileY*view->numTiles.x + tileX].boxes = true;
+                }
+            }
+        }
+    }
+    for(s32 i = 0; i < s->triangles.count; i++){
+        v3 a, e1, e2;
+        GetTriangle(&s->triangles, i, &a, &e1, &e2);
+        v3 center = a + (e1 + e2)/3;
+        f32 r = SquareRoot(Max(LengthSqr(a - center), Max(LengthSqr(a + e1 - center), LengthSqr(a + e2 - center))));
+        v2s tileMin, tileMax;
+        if (GetSphereTileRect(view, center - view->camPos, r, worldFrameDim, &tileMin, &tileMax)){
+            for(s32 tileY = tileMin.y; tileY <= tileMax.y; tileY++){
+                for(s32 tileX = tileMin.x; tileX <= tileMax.x; tileX++){
+                    view->tileBins[tileY*view->numTiles.x + tileX].triangles = true;
+                }
+            }
+        }
+    }
+    for(s32 i = 0; i < s->numMeshes; i++){
+        if (s->meshes[i].instanced)
+            continue;
+        bvh_node *root = &s->meshes[i].bvh.nodes[0];
+        v2s tileMin, tileMax;
+        if (GetSphereTileRect(view, (root->min + root->max)/2 - view->camPos, Length(root->max - root->min)/2, worldFrameDim, &tileMin, &tileMax)){
+            for(s32 tileY = tileMin.y; tileY <= tileMax.y; tileY++){
+                for(s32 tileX = tileMin.x; tileX <= tileMax.x; tileX++){
+                    view->tileBins[tileY*view->numTiles.x + tileX].meshes = true;
+                }
+            }
+        }
+    }
+    if (s->numInstances){
+        bvh_node *root = &s->instanceBvh.nodes[0];
+        v2s tileMin, tileMax;
+        if (GetSphereTileRect(view, (root->min + root->max)/2 - view->camPos, Length(root->max - root->min)/2, worldFrameDim, &tileMin, &tileMax)){
+            for(s32 tileY = tileMin.y; tileY <= tileMax.y; tileY++){
+                for(s32 tileX = tileMin.x; tileX <= tileMax.x; tileX++){
+                    view->tileBins[tileY*view->numTiles.x + tileX].instances = true;
+                }
+            }
+        }
+    }
+    if (s->particles.count){
+        particle_cloud *c = &s->particles;
+        v2s tileMin, tileMax;
+        if (GetSphereTileRect(view, (c->min + c->max)/2 - view->camPos, Length(c->max - c->min)/2, worldFrameDim, &tileMin, &tileMax)){
+            for(s32 tileY = tileMin.y; tileY <= tileMax.y; tileY++){
+                for(s32 tileX = tileMin.x; tileX <= tileMax.x; tileX++){
+                    view->tileBins[tileY*view->numTiles.x + tileX].particles = true;
+                }
+            }
+        }
+    }
+
+    // Planes: A ray hits a plane if its direction goes towards it. The (unnormalized) ray direction is
+    // linear in the pixel position, so within a tile the extremes of Dot(n, rd) are at the corners.
+    if (s->planes.count){
+        for(s32 tileY = 0; tileY < view->numTiles.y; tileY++){
+            for(s32 tileX = 0; tileX < view->numTiles.x; tileX++){
+                tile_bin *bin = &view->tileBins[tileY*view->numTiles.x + tileX];
+                s32 cornersX[2] = {tileX*TILE_SIZE, MinS32((tileX + 1)*TILE_SIZE, view->frameDim.x) - 1};
+                s32 cornersY[2] = {tileY*TILE_SIZE, MinS32((tileY + 1)*TILE_SIZE, view->frameDim.y) - 1};
+                v3 cornerDirs[4];
+                for(s32 j = 0; j < 2; j++){
+                    for(s32 i = 0; i < 2; i++){
+                        v2 uv = {(f32)cornersX[i]/view->frameDim.x, (f32)cornersY[j]/view->frameDim.y};
+                        cornerDirs[2*j + i] = view->camForward + (-1.f + 2.f*uv.x)*view->camRight*worldFrameDim.x/2 + (-1.f + 2.f*uv.y)*view->camUp*worldFrameDim.y/2;
+                    }
+                }
+                for(s32 planeIndex = 0; planeIndex < s->planes.count && !bin->planes; planeIndex++){
+                    f32 side = -Sign(view->primaryPlaneNumerators[planeIndex]); // Sign of the camera's side of the plane.
+                    if (!side)
+                        continue;
+                    v3 n = GetPlaneNormal(&s->planes, planeIndex);
+                    for(s32 i = 0; i < 4; i++){
+                        if (Dot(n, cornerDirs[i])*side < .001f){ // Some margin for rounding errors.
+                            bin->planes = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+// All the primary rays start at the camera, so the terms of the intersections that don't depend on the
+// ray direction are computed once per frame. The ray directions are kept while the camera doesn't rotate.
+void PrecomputePrimaryRays(frame_view *view){
+    scene *s = &view->scene;
+
+    for(s32 i = 0; i < s->numSpheres; i++){
+        primary_sphere *sphere = &view->primarySpheres[i];
+        sphere->ro = view->camPos - s->spheres[i].c;
+        sphere->c = Dot(sphere->ro, sphere->ro) - SQUARE(s->spheres[i].r);
+    }
+    for(s32 i = 0; i < s->planes.count; i++){
+        view->primaryPlaneNumerators[i] = s->planes.d[i] - Dot(GetPlaneNormal(&s->planes, i), view->camPos);
+    }
+
+    if (view->rayDirsAngleX != view->camAngleX || view->rayDirsAngleY != view->camAngleY || view->rayDirsFovY != view->fovY || view->rayDirsFrameDim != view->frameDim){
+        view->rayDirsAngleX = view->camAngleX;
+        view->rayDirsAngleY = view->camAngleY;
+        view->rayDirsFovY = view->fovY;
+        view->rayDirsFrameDim = view->frameDim;
+        ZeroArray(view->tileRayDirsValid); // Each tile recomputes its own directions.
+    }
+}
+
+inline void AddTileEntry(frame_view *view, s32 tileIndex){
+    s32 x = (tileIndex % view->numTiles.x)*TILE_SIZE;
+    s32 y = (tileIndex / view->numTiles.x)*TILE_SIZE;
+    InterlockedIncrement(&view->tilesLeft);
+    work_entry *entry = AddWorkEntry(WORK_RENDER_TILE);
+    entry->view = view;
+    entry->tileMin = V2S(x, y);
+    entry->tileMax = V2S(MinS32(x + TILE_SIZE, view->frameDim.x), MinS32(y + TILE_SIZE, view->frameDim.y));
+    entry->tileIndex = tileIndex;
+}
+
+// What the frames of a scene time need before they can be rendered, whatever their camera.
+void PrepareScene(f32 sceneTime){
+    auto gs = &globalState;
+    ResetArena(&gs->frameArena); // Nothing of the previous frames is used anymore.
+    gs->sceneTime = sceneTime;
+    AnimateMeshes();
+    UpdateParticles();
+}
+
+// What the tiles of a view need before they can be rendered, after PrepareScene().
+void PrepareView(frame_view *view, v3 camPos, f32 camAngleX, f32 camAngleY, f32 fovY, v2s frameDim){
+    auto gs = &globalState;
+    view->frameDim = frameDim;
+    view->camPos = camPos;
+    view->camAngleX = camAngleX;
+    view->camAngleY = camAngleY;
+    view->fovY = fovY;
+    mat3 rotation = YRotation3(camAngleY)*XRotation3(camAngleX);
+    view->camForward = MatrixMultiply(V3(0, 0, 1.f), rotation);
+    view->camUp      = MatrixMultiply(V3(0, 1.f, 0), rotation);
+    view->camRight   = -Cross(view->camForward, view->camUp);
+    view->heatmap = gs->heatmap;
+    view->useShadowCache = gs->useShadowCache;
+
+    gs->scene.spheres[gs->scene.cameraSphereIndex].c = camPos;
+    view->scene = gs->scene;
+    if (gs->prefetchSphereFile){
+        PrefetchSphereFile(&view->scene.particles, view->camPos); // Does nothing if the particles aren't mapped.
+    }
+
+    PrecomputePrimaryRays(view);
+    BinShapes(view);
+}
+
+// Prepares the first view with the current camera.
+void PrepareFrame(f32 sceneTime){
+    auto gs = &globalState;
+    PrepareScene(sceneTime);
+    PrepareView(gs->views[0], gs->camPos, gs->camAngleX, gs->camAngleY, gs->fovY, gs->frameDim);
+}
+
+//
+// Distributed rendering
+//
+
+// With -coordinator <port>, the program listens for render worker processes (started with -worker <host>
+// <port>, on this machine or others) and splits the tiles of each frame between its own threads and them,
+// weighted by their number of threads. Each frame, a worker gets what it needs to render the same frame as
+// the coordinator (the scene and its time, the camera, and what can be moved from the keyboard) and the list
+// of its tiles, and sends back the pixels of each one. If a worker hasn't sent all its tiles
+// NET_STALL_SECONDS after the frame began, the coordinator renders the rest itself, and doesn't give it
+// more until it catches up.
+#define NET_MAGIC 0x5452544e // "NTRT"
+#define NET_DEFAULT_PORT "27960"
+#define NET_MAX_WORKERS 32
+#define NET_STALL_SECONDS .2f
+
+// Worker to coordinator, once after connecting.
+struct net_hello_message{
+    u32 magic;
+    s32 numThreads;
+};
+
+// Coordinator to worker, followed by 'numTiles' tile indices.
+struct net_frame_message{
+    u32 magic;
+    u32 frameId;
+    s32 sceneIndex;
+    f32 sceneTime;
+    v3 camPos;
+    f32 camAngleX;
+    f32 camAngleY;
+    f32 fovY;
+    v2s frameDim;
+    v3 firstSphereCenter; // Moved with Control + arrows.
+    v3 firstLightCenter; // Moved with the arrows.
+    b32 useShadowCache;
+    b32 heatmap;
+    s32 particleStructure;
+    b32 particlesQuantized;
+    s32 numTiles;
+};
+
+// Worker to coordinator, for each of its tiles.
+struct net_tile_message{
+    u32 frameId;
+    s32 tileIndex;
+    u32 pixels[MAX_TILE_PIXELS]; // Like in view->tiles.
+};
+
+struct net_worker{
+    SOCKET socket; // INVALID_SOCKET if the slot is free.
+    s32 numThreads; // 0 until its hello message arrives.
+    s32 numTiles; // Tiles it was sent in its last frame,
+    s32 numReceived; // and how many of them it sent back (it gets no new ones until it sent them all).
+    u8 buffer[sizeof(net_tile_message)]; // The message being received.
+    s32 bufferSize;
+};
+
+struct net_coordinator{
+    b32 active;
+    SOCKET listener;
+    net_worker workers[NET_MAX_WORKERS];
+    u32 frameId;
+    LARGE_INTEGER frameStartTime;
+    s8 tileOwners[MAX_TILES]; // Index of the worker that renders each tile of the frame, or -1 for this process.
+    s32 numRemoteTiles; // Tiles of the frame that haven't come back from the workers yet.
+};
+static net_coordinator globalCoordinator;
+
+b32 SendAll(SOCKET s, void *data, s32 size){
+    u8 *at = (u8 *)data;
+    while(size > 0){
+        s32 sent = send(s, (char *)at, size, 0);
+        if (sent == SOCKET_ERROR){
+            if (WSAGetLastError() != WSAEWOULDBLOCK){
+                return false;
+            }
+            Sleep(0);
+        }else{
+            at += sent;
+            size -= sent;
+        }
+    }
+    return true;
+}
+
+// Blocking sockets only.
+b32 ReceiveAll(SOCKET s, void *data, s32 size){
+    u8 *at = (u8 *)data;
+    while(size > 0){
+        s32 received = recv(s, (char *)at, size, 0);
+        if (received <= 0){
+            return false;
+        }
+        at += received;
+        size -= received;
+    }
+    return true;
+}
+
+inline void SetSocketNoDelay(SOCKET s){
+    BOOL noDelay = TRUE;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *)&noDelay, sizeof(noDelay));
+}
+
+// Returns a non-blocking socket that accepts connections on the port, or INVALID_SOCKET.
+SOCKET ListenOnPort(char *port){
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0){
+        Printf("Couldn't start Winsock.\n");
+        return INVALID_SOCKET;
+    }
+    SOCKET result = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((u16)strtol(port, 0, 10));
+    u_long nonBlocking = 1;
+    if (result == INVALID_SOCKET || bind(result, (sockaddr *)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(result, SOMAXCONN) == SOCKET_ERROR || ioctlsocket(result, FIONBIO, &nonBlocking) == SOCKET_ERROR){
+        Printf("Couldn't listen on port %s (error %i).\n", port, WSAGetLastError());
+        if (result != INVALID_SOCKET){
+            closesocket(result);
+        }
+        return INVALID_SOCKET;
+    }
+    return result;
+}
+
+b32 StartCoordinator(char *port){
+    auto c = &globalCoordinator;
+    ZeroStruct(c);
+    c->listener = ListenOnPort(port);
+    if (c->listener == INVALID_SOCKET)
+        return false;
+    for(s32 i = 0; i < NET_MAX_WORKERS; i++){
+        c->workers[i].socket = INVALID_SOCKET;
+    }
+    c->active = true;
+    Printf("Waiting for render workers on port %s.\n", port);
+    return true;
+}
+
+// Adds the tiles of the frame that the worker still has to the local work queue. Must be called while
+// the frame is being rendered.
+void ReclaimTiles(s32 workerIndex){
+    auto gs = &globalState;
+    auto c = &globalCoordinator;
+    frame_view *view = gs->views[0];
+    s32 firstEntry = gs->numEntries;
+    for(s32 tileIndex = 0; tileIndex < view->numTiles.x*view->numTiles.y; tileIndex++){
+        if (c->tileOwners[tileIndex] == workerIndex){
+            c->tileOwners[tileIndex] = -1;
+            c->numRemoteTiles--;
+            AddTileEntry(view, tileIndex);
+        }
+    }
+    PostMoreWorkEntries(firstEntry);
+}
+
+void DropWorker(s32 workerIndex){
+    auto c = &globalCoordinator;
+    net_worker *worker = &c->workers[workerIndex];
+    closesocket(worker->socket);
+    worker->socket = INVALID_SOCKET;
+    ReclaimTiles(workerIndex);
+    Printf("Render worker %i disconnected.\n", workerIndex);
+}
+
+// Picks the process that renders each tile, and adds the work entries of the ones of this process. The
+// workers that are done with their previous tiles get tiles in proportion to their threads.
+void DistributeTiles(){
+    auto gs = &globalState;
+    auto c = &globalCoordinator;
+    frame_view *view = gs->views[0];
+    s32 numTiles = view->numTiles.x*view->numTiles.y;
+    s32 weights[NET_MAX_WORKERS + 1]; // The last one is this process.
+    s32 assigned[NET_MAX_WORKERS + 1] = {};
+    for(s32 i = 0; i < NET_MAX_WORKERS; i++){
+        net_worker *worker = &c->workers[i];
+        b32 ready = (worker->socket != INVALID_SOCKET && worker->numThreads && worker->numReceived == worker->numTiles);
+        weights[i] = (ready ? worker->numThreads : 0);
+    }
+    weights[NET_MAX_WORKERS] = NUM_WORKER_THREADS;
+
+    c->frameId++;
+    c->numRemoteTiles = 0;
+    for(s32 tileIndex = 0; tileIndex < numTiles; tileIndex++){
+        // The owner with the fewest tiles per thread if it gets this one.
+        s32 owner = NET_MAX_WORKERS;
+        for(s32 i = 0; i < NET_MAX_WORKERS; i++){
+            if (weights[i] && (s64)(assigned[i] + 1)*weights[owner] < (s64)(assigned[owner] + 1)*weights[i]){
+                owner = i;
+            }
+        }
+        assigned[owner]++;
+        if (owner == NET_MAX_WORKERS){
+            c->tileOwners[tileIndex] = -1;
+            AddTileEntry(view, tileIndex);
+        }else{
+            c->tileOwners[tileIndex] = (s8)owner;
+            c->numRemoteTiles++;
+        }
+    }
+}
+
+// Sends the tiles picked by DistributeTiles() to the workers, after the local ones were posted.
+void SendTilesToWorkers(){
+    auto gs = &globalState;
+    auto c = &globalCoordinator;
+    frame_view *view = gs->views[0];
+    scene *s = &gs->scene;
+    c->frameStartTime = GetCurrentTimeCounter();
+    if (!c->numRemoteTiles)
+        return;
+
+    struct{
+        net_frame_message m;
+        s32 tileIndices[MAX_TILES];
+    } message = {};
+    net_frame_message *m = &message.m;
+    m->magic = NET_MAGIC;
+    m->frameId = c->frameId;
+    m->sceneIndex = gs->sceneIndex;
+    m->sceneTime = gs->sceneTime;
+    m->camPos = view->camPos;
+    m->camAngleX = view->camAngleX;
+    m->camAngleY = view->camAngleY;
+    m->fovY = view->fovY;
+    m->frameDim = view->frameDim;
+    if (s->numSpheres){
+        m->firstSphereCenter = s->spheres[0].c;
+    }
+    if (s->numLights){
+        m->firstLightCenter = s->spheres[s->lights[0].sphereIndex].c;
+    }
+    m->useShadowCache = gs->useShadowCache;
+    m->heatmap = gs->heatmap;
+    m->particleStructure = s->particles.structure;
+    m->particlesQuantized = s->particles.quantized;
+
+    for(s32 i = 0; i < NET_MAX_WORKERS; i++){
+        m->numTiles = 0;
+        for(s32 tileIndex = 0; tileIndex < view->numTiles.x*view->numTiles.y; tileIndex++){
+            if (c->tileOwners[tileIndex] == i){
+                message.tileIndices[m->numTiles++] = tileIndex;
+            }
+        }
+        if (m->numTiles){
+            net_worker *worker = &c->workers[i];
+            worker->numTiles = m->numTiles;
+            worker->numReceived = 0;
+            if (!SendAll(worker->socket, &message, sizeof(net_frame_message) + m->numTiles*sizeof(s32))){
+                DropWorker(i);
+            }
+        }
+    }
+}
+
+// Accepts new workers, copies the tiles that arrived to the first view, and reclaims the tiles of the workers
+// that stalled. Called every iteration of the main loop.
+void PollRenderWorkers(){
+    auto gs = &globalState;
+    auto c = &globalCoordinator;
+    if (!c->active)
+        return;
+
+    while(1){
+        SOCKET s = accept(c->listener, 0, 0);
+        if (s == INVALID_SOCKET)
+            break;
+        s32 workerIndex = 0;
+        while(workerIndex < NET_MAX_WORKERS && c->workers[workerIndex].socket != INVALID_SOCKET){
+            workerIndex++;
+        }
+        u_long nonBlocking = 1;
+        if (workerIndex == NET_MAX_WORKERS || ioctlsocket(s, FIONBIO, &nonBlocking) == SOCKET_ERROR){
+            closesocket(s);
+            continue;
+        }
+        SetSocketNoDelay(s);
+        net_worker *worker = &c->workers[workerIndex];
+        ZeroStruct(worker);
+        worker->socket = s;
+    }
+
+    for(s32 i = 0; i < NET_MAX_WORKERS; i++){
+        net_worker *worker = &c->workers[i];
+        while(worker->socket != INVALID_SOCKET){
+            s32 messageSize = (worker->numThreads ? sizeof(net_tile_message) : sizeof(net_hello_message));
+            s32 received = recv(worker->socket, (char *)worker->buffer + worker->bufferSize, messageSize - worker->bufferSize, 0);
+            if (received == 0 || (received == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)){
+                DropWorker(i);
+                break;
+            }
+            if (received == SOCKET_ERROR)
+                break;
+            worker->bufferSize += received;
+            if (worker->bufferSize < messageSize)
+                continue;
+            worker->bufferSize = 0;
+
+            if (!worker->numThreads){
+                net_hello_message *hello = (net_hello_message *)worker->buffer;
+                if (hello->magic != NET_MAGIC || hello->numThreads <= 0){
+                    DropWorker(i);
+                    break;
+                }
+                worker->numThreads = hello->numThreads;
+                Printf("Render worker %i connected with %i threads.\n", i, worker->numThreads);
+            }else{
+                net_tile_message *tile = (net_tile_message *)worker->buffer;
+                worker->numReceived++;
+                // The tiles of a frame that was already finished without them are ignored.
+                if (tile->frameId == c->frameId && tile->tileIndex >= 0 && tile->tileIndex < MAX_TILES && c->tileOwners[tile->tileIndex] == i){
+                    CopyArray(&gs->views[0]->tiles[tile->tileIndex*MAX_TILE_PIXELS], tile->pixels, MAX_TILE_PIXELS);
+                    c->tileOwners[tile->tileIndex] = -1;
+                    c->numRemoteTiles--;
+                }
+            }
+        }
+    }
+
+    if (c->numRemoteTiles && GetSecondsElapsed(c->frameStartTime, GetCurrentTimeCounter()) > NET_STALL_SECONDS){
+        for(s32 i = 0; i < NET_MAX_WORKERS; i++){
+            s32 numEntries = gs->numEntries;
+            ReclaimTiles(i);
+            if (gs->numEntries > numEntries){
+                Printf("Render worker %i stalled, %i of its tiles are rendered here.\n", i, gs->numEntries - numEntries);
+            }
+        }
+    }
+}
+
+inline b32 IsFinite(f32 value){
+    u32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    b32 result = ((bits & 0x7f800000) != 0x7f800000);
+    return result;
+}
+inline b32 IsFinite(v3 v){
+    b32 result = (IsFinite(v.x) && IsFinite(v.y) && IsFinite(v.z));
+    return result;
+}
+
+// Checks every field of the frame that sizes the view, picks the scene or goes into the camera and the
+// scene, since the asserts that would catch them aren't in release builds.
+b32 IsValidFrameMessage(net_frame_message *m){
+    b32 result = (m->magic == NET_MAGIC && m->numTiles >= 0 && m->numTiles <= MAX_TILES &&
+                  m->frameDim.x > 0 && m->frameDim.x <= FRAME_BUFFER_WIDTH && m->frameDim.y > 0 && m->frameDim.y <= FRAME_BUFFER_HEIGHT &&
+                  m->sceneIndex >= 0 && m->sceneIndex < NUM_SCENES &&
+                  (m->particleStructure == PARTICLES_GRID || m->particleStructure == PARTICLES_BVH) &&
+                  m->fovY > 0 && m->fovY < PI && // False for NaN.
+                  IsFinite(m->sceneTime) && IsFinite(m->camPos) && IsFinite(m->camAngleX) && IsFinite(m->camAngleY) &&
+                  IsFinite(m->firstSphereCenter) && IsFinite(m->firstLightCenter));
+    return result;
+}
+
+// Receives a frame from the coordinator, renders its tiles and sends them back. Returns false when the
+// coordinator disconnects or sends an invalid frame.
+b32 RenderWorkerFrame(SOCKET s){
+    auto gs = &globalState;
+    frame_view *view = gs->views[0];
+    scene *sc = &gs->scene;
+    net_frame_message m;
+    static s32 tileIndices[MAX_TILES];
+    if (!ReceiveAll(s, &m, sizeof(m)))
+        return false;
+    if (!IsValidFrameMessage(&m)){
+        Printf("Invalid frame from the coordinator.\n");
+        return false;
+    }
+    if (!ReceiveAll(s, tileIndices, m.numTiles*sizeof(s32)))
+        return false;
+
+    // Make the scene like the one of the coordinator.
+    if (m.sceneIndex != gs->sceneIndex){
+        ChangeScene(m.sceneIndex);
+    }
+    b32 moved = false;
+    if (sc->numSpheres && sc->spheres[0].c != m.firstSphereCenter){
+        MoveSphere(0, m.firstSphereCenter);
+        moved = true;
+    }
+    if (sc->numLights && sc->spheres[sc->lights[0].sphereIndex].c != m.firstLightCenter){
+        MoveSphere(sc->lights[0].sphereIndex, m.firstLightCenter);
+        moved = true;
+    }
+    if (moved){
+        UpdateShadowCache(&gs->shadowCache);
+    }
+    if (!sc->particles.fileView){ // Mapped clouds always use the quantized BVH of the file.
+        sc->particles.structure = (particle_structure)m.particleStructure;
+        sc->particles.quantized = m.particlesQuantized;
+    }
+    gs->useShadowCache = m.useShadowCache;
+    gs->heatmap = m.heatmap;
+
+    PrepareScene(m.sceneTime);
+    PrepareView(view, m.camPos, m.camAngleX, m.camAngleY, m.fovY, m.frameDim);
+    BeginWorkEntries();
+    for(s32 i = 0; i < m.numTiles; i++){
+        if (tileIndices[i] >= 0 && tileIndices[i] < view->numTiles.x*view->numTiles.y){
+            AddTileEntry(view, tileIndices[i]);
+        }
+    }
+    PostWorkEntries();
+    WaitForWorkEntries();
+
+    static net_tile_message tile;
+    tile.frameId = m.frameId;
+    for(s32 i = 0; i < m.numTiles; i++){
+        tile.tileIndex = tileIndices[i];
+        if (tile.tileIndex >= 0 && tile.tileIndex < view->numTiles.x*view->numTiles.y){
+            CopyArray(tile.pixels, &view->tiles[tile.tileIndex*MAX_TILE_PIXELS], MAX_TILE_PIXELS);
+        }
+        if (!SendAll(s, &tile, sizeof(tile)))
+            return false;
+    }
+    return true;
+}
+
+void BeginFrameAt(f32 sceneTime){
+    auto gs = &globalState;
+    s32 traceFrame = CountTraceFrame();
+    CollectProfile(1);
+    s64 traceStart = GetTraceTime();
+    PrepareFrame(sceneTime);
+
+    // Fill work queue
+    BeginWorkEntries();
+    if (globalCoordinator.active){
+        DistributeTiles();
+    }else{
+        for(s32 tileIndex = 0; tileIndex < gs->views[0]->numTiles.x*gs->views[0]->numTiles.y; tileIndex++){
+            AddTileEntry(gs->views[0], tileIndex);
+        }
+    }
+    PostWorkEntries();
+    if (globalCoordinator.active){
+        SendTilesToWorkers();
+    }
+    TraceEvent(TRACE_MAIN_THREAD, "Begin frame", traceStart, traceFrame);
+}
+
+void BeginFrame(){
+    auto gs = &globalState;
+    BeginFrameAt(GetSecondsElapsed(gs->sceneStartTime, GetCurrentTimeCounter()));
+}
+
+
+struct ray_intersection{
+    f32 t; // distance. 0 for no intersection.
+    s32 material;
+    v3 normal;
+};
+
+f32 IntersectSphere(sphere sphere, v3 ro, v3 rd){
+    f32 t = -1.f;
+    ro -= sphere.c; // Make ro relative to sphere center, so that sphere is centered at 0,0,0.
+
+    // sphere at 0,0,0 equation:   sqrt(dot(p)) = r        (by dot(p) I mean dot(p, p))
+    // ray equation:               p = ro + t*rd
+    // substitution:               sqrt(dot(ro + t*rd)) = r
+    //                             dot(ro + t*rd) = r^2
+    //                             dot(ro + t*rd) - r^2 = 0
+    // (expand binomial squared)   dot(ro) + dot(t*rd) + 2*t*dot(ro, rd) - r^2 = 0
+    // (rd is unitary)             dot(ro) + t*t + 2*dot(ro, rd)*t - r^2 = 0
+    // (reorder)                   t^2  +  2*dot(ro, rd)*t  +  dot(ro) - r^2 = 0
+    // Now we have a quadratic equation on t.
+
+    // a = 1
+    f32 b = 2.f*Dot(ro, rd);
+    f32 c = Dot(ro, ro) - SQUARE(sphere.r);
+    f32 d = b*b - 4.f*c;
+    if (d >= 0){
+        t = (-b - SquareRoot(d))/2.f; // We only care about the lowest solution, i.e. the closest to the camera.
+    }
+    return t;
+}
+inline v3 NormalSphere(sphere sphere, v3 pos){
+    v3 n = (pos - sphere.c)/sphere.r;
+    return n;
+}
+
+inline f32 IntersectPlane(f32 y, v3 ro, v3 rd){
+    f32 t = -1.f;
+    // plane equation: p.y = y
+    // ray equation:   p = ro + t*rd
+    //                 p.y = ro.y + t*rd.y
+    // substitution:   y = ro.y + t*rd.y
+    //                 y - ro.y = t*rd.y
+    //                 (y - ro.y)/rd.y = t
+    if (rd.y){
+        t = (y - ro.y)/rd.y;
+    }
+    return t;
+}
+
+
+//
+// Intersection kernels
+//
+// Each kind of shape has its own kernel, that intersects 4 rays at a time (one per SSE lane) with all the
+// shapes of a bucket. The kernels only replace the hits of the lanes whose new hit is in the range
+// (near, t), so calling them one after another finds the closest hit among all the kinds of shapes. Each
+// lane does the same operations as a scalar loop would, so the results are exactly the same.
+//
+
+struct ray_4{
+    __m128 ox, oy, oz;
+    __m128 dx, dy, dz;
+};
+
+struct hit_4{
+    __m128 t;
+    __m128i type;      // shape_type
+    __m128i index;     // Index of the shape in its bucket.
+    __m128i primitive; // Triangle of a mesh. Only set for meshes.
+};
+
+inline __m128 Select4(__m128 mask, __m128 a, __m128 b){ // mask ? a : b
+    __m128 result = _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+    return result;
+}
+inline __m128i Select4(__m128 mask, __m128i a, __m128i b){
+    __m128i m = _mm_castps_si128(mask);
+    __m128i result = _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+    return result;
+}
+
+inline __m128 Dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz){
+    __m128 result = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+    return result;
+}
+
+inline hit_4 Hit4(f32 far){
+    hit_4 result = {_mm_set1_ps(far), _mm_set1_epi32(SHAPE_NONE), _mm_set1_epi32(-1), _mm_set1_epi32(-1)};
+    return result;
+}
+
+// Sets the lanes of 'mask' that are in the range (near, hit->t).
+inline void UpdateHit4(hit_4 *hit, __m128 t, __m128 mask, __m128 near, shape_type type, s32 index){
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(t, near), _mm_cmplt_ps(t, hit->t)));
+    hit->t = Select4(mask, t, hit->t);
+    hit->type = Select4(mask, _mm_set1_epi32(type), hit->type);
+    hit->index = Select4(mask, _mm_set1_epi32(index), hit->index);
+}
+// Same, for shapes made of primitives.
+inline void UpdateHit4(hit_4 *hit, __m128 t, __m128 mask, __m128 near, shape_type type, s32 index, s32 primitive){
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(t, near), _mm_cmplt_ps(t, hit->t)));
+    hit->t = Select4(mask, t, hit->t);
+    hit->type = Select4(mask, _mm_set1_epi32(type), hit->type);
+    hit->index = Select4(mask, _mm_set1_epi32(index), hit->index);
+    hit->primitive = Select4(mask, _mm_set1_epi32(primitive), hit->primitive);
+}
+
+// Same math as IntersectSphere(): t^2 + b*t + c = 0
+inline __m128 IntersectSphere4(__m128 b, __m128 c, __m128 *mask){
+    __m128 d = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_set1_ps(4.f), c));
+    *mask = _mm_cmpge_ps(d, _mm_setzero_ps());
+    __m128 t = _mm_div_ps(_mm_sub_ps(_mm_xor_ps(b, _mm_set1_ps(-0.f)), _mm_sqrt_ps(d)), _mm_set1_ps(2.f));
+    return t;
+}
+
+// Records the hits as 'type' and 'index', so it's also used for the particles.
+// Distances of the rays to the sphere, with the lanes that hit it in 'mask'.
+inline __m128 IntersectOneSphere4(sphere sp, ray_4 *ray, __m128 *mask){
+    __m128 ox = _mm_sub_ps(ray->ox, _mm_set1_ps(sp.c.x));
+    __m128 oy = _mm_sub_ps(ray->oy, _mm_set1_ps(sp.c.y));
+    __m128 oz = _mm_sub_ps(ray->oz, _mm_set1_ps(sp.c.z));
+    __m128 b = _mm_mul_ps(_mm_set1_ps(2.f), Dot4(ox, oy, oz, ray->dx, ray->dy, ray->dz));
+    __m128 c = _mm_sub_ps(Dot4(ox, oy, oz, ox, oy, oz), _mm_set1_ps(SQUARE(sp.r)));
+    __m128 t = IntersectSphere4(b, c, mask);
+    return t;
+}
+inline void IntersectOneSphere4(sphere sp, ray_4 *ray, __m128 near, hit_4 *hit, shape_type type, s32 index){
+    __m128 mask;
+    __m128 t = IntersectOneSphere4(sp, ray, &mask);
+    UpdateHit4(hit, t, mask, near, type, index);
+}
+// Same, for spheres that are part of something else, like the leaf of the quantized particles.
+inline void IntersectOneSphere4(sphere sp, ray_4 *ray, __m128 near, hit_4 *hit, shape_type type, s32 index, s32 primitive){
+    __m128 mask;
+    __m128 t = IntersectOneSphere4(sp, ray, &mask);
+    UpdateHit4(hit, t, mask, near, type, index, primitive);
+}
+
+void IntersectSpheres4(sphere *spheres, s32 count, ray_4 *ray, f32 near, hit_4 *hit){
+    __m128 nearV = _mm_set1_ps(near);
+    for(s32 i = 0; i < count; i++){
+        IntersectOneSphere4(spheres[i], ray, nearV, hit, SHAPE_SPHERE, i);
+    }
+}
+
+// For primary rays, with the spheres of a tile's bin (see PrecomputePrimaryRays()). Only uses the ray directions.
+void IntersectSpheresPrimary4(primary_sphere *spheres, s32 *indices, s32 count, ray_4 *ray, f32 near, hit_4 *hit){
+    __m128 nearV = _mm_set1_ps(near);
+    for(s32 i = 0; i < count; i++){
+        primary_sphere *sp = &spheres[indices[i]];
+        __m128 b = _mm_mul_ps(_mm_set1_ps(2.f), Dot4(_mm_set1_ps(sp->ro.x), _mm_set1_ps(sp->ro.y), _mm_set1_ps(sp->ro.z), ray->dx, ray->dy, ray->dz));
+        __m128 mask;
+        __m128 t = IntersectSphere4(b, _mm_set1_ps(sp->c), &mask);
+        UpdateHit4(hit, t, mask, nearV, SHAPE_SPHERE, indices[i]);
+    }
+}
+
+// Same math as IntersectPlane(), for any plane: t = (d - Dot(n, ro))/Dot(n, rd)
+void IntersectPlanes4(plane_bucket *planes, ray_4 *ray, f32 near, hit_4 *hit){
+    __m128 nearV = _mm_set1_ps(near);
+    for(s32 i = 0; i < planes->count; i++){
+        __m128 nx = _mm_set1_ps(planes->nx[i]), ny = _mm_set1_ps(planes->ny[i]), nz = _mm_set1_ps(planes->nz[i]);
+        __m128 numerator = _mm_sub_ps(_mm_set1_ps(planes->d[i]), Dot4(nx, ny, nz, ray->ox, ray->oy, ray->oz));
+        __m128 denominator = Dot4(nx, ny, nz, ray->dx, ray->dy, ray->dz);
+        __m128 t = _mm_div_ps(numerator, denominator);
+        UpdateHit4(hit, t, _mm_cmpneq_ps(denominator, _mm_setzero_ps()), nearV, SHAPE_PLANE, i);
+    }
+}
+
+// For primary rays (see PrecomputePrimaryRays()). Only uses the ray directions.
+void IntersectPlanesPrimary4(plane_bucket *planes, f32 *numerators, ray_4 *ray, f32 near, hit_4 *hit){
+    __m128 nearV = _mm_set1_ps(near);
+    for(s32 i = 0; i < planes->count; i++){
+        __m128 denominator = Dot4(_mm_set1_ps(planes->nx[i]), _mm_set1_ps(planes->ny[i]), _mm_set1_ps(planes->nz[i]), ray->dx, ray->dy, ray->dz);
+        __m128 t = _mm_div_ps(_mm_set1_ps(numerators[i]), denominator);
+        UpdateHit4(hit, t, _mm_cmpneq_ps(denominator, _mm_setzero_ps()), nearV, SHAPE_PLANE, i);
+    }
+}
+
+// Slab test. Like with spheres, only the entry point counts, so a box isn't hit from the inside.
+void IntersectBoxes4(box_bucket *boxes, ray_4 *ray, f32 near, hit_4 *hit){
+    __m128 nearV = _mm_set1_ps(near);
+    __m128 one = _mm_set1_ps(1.f);
+    __m128 invx = _mm_div_ps(one, ray->dx), invy = _mm_div_ps(one, ray->dy), invz = _mm_div_ps(one, ray->dz);
+    for(s32 i = 0; i < boxes->count; i++){
+        __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxes->minX[i]), ray->ox), invx);
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxes->maxX[i]), ray->ox), invx);
+        __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxes->minY[i]), ray->oy), invy);
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxes->maxY[i]), ray->oy), invy);
+        __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxes->minZ[i]), ray->oz), invz);
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxes->maxZ[i]), ray->oz), invz);
+        __m128 tEnter = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_min_ps(tz0, tz1));
+        __m128 tExit  = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1));
+        UpdateHit4(hit, tEnter, _mm_cmple_ps(tEnter, tExit), nearV, SHAPE_BOX, i);
+    }
+}
+
+// Möller–Trumbore, with the triangle (a, a + e1, a + e2) in every lane. Returns t, and the lanes that hit in 'mask'.
+inline __m128 IntersectTriangle4(ray_4 *ray, __m128 ax, __m128 ay, __m128 az, __m128 e1x, __m128 e1y, __m128 e1z, __m128 e2x, __m128 e2y, __m128 e2z, __m128 *mask){
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.f);
+
+    // p = Cross(rd, e2)
+    __m128 px = _mm_sub_ps(_mm_mul_ps(ray->dy, e2z), _mm_mul_ps(ray->dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(ray->dz, e2x), _mm_mul_ps(ray->dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(ray->dx, e2y), _mm_mul_ps(ray->dy, e2x));
+    __m128 det = Dot4(e1x, e1y, e1z, px, py, pz);
+    __m128 invDet = _mm_div_ps(one, det);
+
+    // s = ro - a
+    __m128 sx = _mm_sub_ps(ray->ox, ax);
+    __m128 sy = _mm_sub_ps(ray->oy, ay);
+    __m128 sz = _mm_sub_ps(ray->oz, az);
+    __m128 u = _mm_mul_ps(Dot4(sx, sy, sz, px, py, pz), invDet);
+
+    // q = Cross(s, e1)
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(Dot4(ray->dx, ray->dy, ray->dz, qx, qy, qz), invDet);
+    __m128 t = _mm_mul_ps(Dot4(e2x, e2y, e2z, qx, qy, qz), invDet);
+
+    *mask = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+    *mask = _mm_and_ps(*mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    return t;
+}
+
+void IntersectTriangles4(triangle_bucket *triangles, ray_4 *ray, f32 near, hit_4 *hit){
+    __m128 nearV = _mm_set1_ps(near);
+    for(s32 i = 0; i < triangles->count; i++){
+        __m128 mask;
+        __m128 t = IntersectTriangle4(ray, _mm_set1_ps(triangles->ax[i]), _mm_set1_ps(triangles->ay[i]), _mm_set1_ps(triangles->az[i]),
+                                      _mm_set1_ps(triangles->e1x[i]), _mm_set1_ps(triangles->e1y[i]), _mm_set1_ps(triangles->e1z[i]),
+                                      _mm_set1_ps(triangles->e2x[i]), _mm_set1_ps(triangles->e2y[i]), _mm_set1_ps(triangles->e2z[i]), &mask);
+        UpdateHit4(hit, t, mask, nearV, SHAPE_TRIANGLE, i);
+    }
+}
+
+// Returns whether any of the lanes enters the node's box in the range (near, far).
+inline b32 IntersectBvhNode4(bvh_node *node, ray_4 *ray, __m128 invx, __m128 invy, __m128 invz, __m128 near, __m128 far){
+    __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min.x), ray->ox), invx);
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max.x), ray->ox), invx);
+    __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min.y), ray->oy), invy);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max.y), ray->oy), invy);
+    __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min.z), ray->oz), invz);
+    __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max.z), ray->oz), invz);
+    __m128 tEnter = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), near));
+    __m128 tExit  = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), far));
+    b32 result = _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit));
+    return result;
+}
+
+// Whether every lane has hit something or has an empty range.
+inline b32 AllLanesDone4(hit_4 *hit, __m128 near){
+    __m128 done = _mm_or_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(hit->type, _mm_set1_epi32(SHAPE_NONE))), _mm_cmple_ps(hit->t, near));
+    b32 result = (_mm_movemask_ps(done) == 0xf);
+    return result;
+}
+
+// Pushes the children of the node so that the one that's closer along 'dir' is popped first.
+inline void PushBvhChildren(bvh_node *nodes, bvh_node *node, v3 dir, u32 *stack, s32 *stackSize){
+    bvh_node *children = &nodes[node->first];
+    v3 leftToRight = (children[1].min + children[1].max) - (children[0].min + children[0].max);
+    if (Dot(leftToRight, dir) > 0){ // Pushed last to be visited first.
+        stack[(*stackSize)++] = node->first + 1;
+        stack[(*stackSize)++] = node->first;
+    }else{
+        stack[(*stackSize)++] = node->first;
+        stack[(*stackSize)++] = node->first + 1;
+    }
+}
+
+// Traverses the BVH with the 4 rays together: a node is visited if any of them hits its box before its
+// current hit, and the child that's closer along the first ray is visited first. With 'anyHit' it stops
+// as soon as every lane has hit something (or has an empty range), which is enough for shadows.
+// The hits are recorded as 'type' and 'index', which is the mesh itself or an instance of it.
+void IntersectMesh4(mesh *m, shape_type type, s32 index, ray_4 *ray, f32 near, hit_4 *hit, b32 anyHit){
+    __m128 nearV = _mm_set1_ps(near);
+    __m128 one = _mm_set1_ps(1.f);
+    __m128 invx = _mm_div_ps(one, ray->dx), invy = _mm_div_ps(one, ray->dy), invz = _mm_div_ps(one, ray->dz);
+    v3 firstDir = {_mm_cvtss_f32(ray->dx), _mm_cvtss_f32(ray->dy), _mm_cvtss_f32(ray->dz)};
+
+    u32 stack[BVH_MAX_DEPTH + 1];
+    s32 stackSize = 0;
+    stack[stackSize++] = 0;
+    while(stackSize){
+        bvh_node *node = &m->bvh.nodes[stack[--stackSize]];
+        if (!IntersectBvhNode4(node, ray, invx, invy, invz, nearV, hit->t))
+            continue;
+        if (node->count){
+            for(u32 i = node->first; i < node->first + node->count; i++){
+                v3 a = m->vertices[m->indices[3*i]];
+                v3 e1 = m->vertices[m->indices[3*i + 1]] - a;
+                v3 e2 = m->vertices[m->indices[3*i + 2]] - a;
+                __m128 mask;
+                __m128 t = IntersectTriangle4(ray, _mm_set1_ps(a.x), _mm_set1_ps(a.y), _mm_set1_ps(a.z),
+                                              _mm_set1_ps(e1.x), _mm_set1_ps(e1.y), _mm_set1_ps(e1.z),
+                                              _mm_set1_ps(e2.x), _mm_set1_ps(e2.y), _mm_set1_ps(e2.z), &mask);
+                UpdateHit4(hit, t, mask, nearV, type, index, (s32)i);
+            }
+            if (anyHit && AllLanesDone4(hit, nearV))
+                return;
+        }else{
+            Assert(stackSize + 2 <= ArrayCount(stack));
+            PushBvhChildren(m->bvh.nodes, node, firstDir, stack, &stackSize);
+        }
+    }
+}
+
+void IntersectMeshes4(mesh *meshes, s32 count, ray_4 *ray, f32 near, hit_4 *hit, b32 anyHit){
+    for(s32 i = 0; i < count; i++){
+        if (!meshes[i].instanced){
+            IntersectMesh4(&meshes[i], SHAPE_MESH, i, ray, near, hit, anyHit);
+        }
+    }
+}
+
+// v*m for each lane (see MatrixMultiply()).
+inline void MatrixMultiply4(__m128 *x, __m128 *y, __m128 *z, mat3 *m){
+    __m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(*x, _mm_set1_ps(m->p00)), _mm_mul_ps(*y, _mm_set1_ps(m->p10))), _mm_mul_ps(*z, _mm_set1_ps(m->p20)));
+    __m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(*x, _mm_set1_ps(m->p01)), _mm_mul_ps(*y, _mm_set1_ps(m->p11))), _mm_mul_ps(*z, _mm_set1_ps(m->p21)));
+    __m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(*x, _mm_set1_ps(m->p02)), _mm_mul_ps(*y, _mm_set1_ps(m->p12))), _mm_mul_ps(*z, _mm_set1_ps(m->p22)));
+    *x = rx;
+    *y = ry;
+    *z = rz;
+}
+
+// Traverses the BVH of the instances, and the BVH of the mesh of each instance that's reached, with the
+// rays moved to the mesh's space. The directions aren't normalized after the transform, so the
+// distances along the rays are the same in both spaces.
+void IntersectInstances4(scene *s, ray_4 *ray, f32 near, hit_4 *hit, b32 anyHit){
+    if (!s->numInstances)
+        return;
+    __m128 nearV = _mm_set1_ps(near);
+    __m128 one = _mm_set1_ps(1.f);
+    __m128 invx = _mm_div_ps(one, ray->dx), invy = _mm_div_ps(one, ray->dy), invz = _mm_div_ps(one, ray->dz);
+    v3 firstDir = {_mm_cvtss_f32(ray->dx), _mm_cvtss_f32(ray->dy), _mm_cvtss_f32(ray->dz)};
+    bvh_node *nodes = s->instanceBvh.nodes;
+
+    u32 stack[BVH_MAX_DEPTH + 1];
+    s32 stackSize = 0;
+    stack[stackSize++] = 0;
+    while(stackSize){
+        bvh_node *node = &nodes[stack[--stackSize]];
+        if (!IntersectBvhNode4(node, ray, invx, invy, invz, nearV, hit->t))
+            continue;
+        if (node->count){
+            for(u32 i = node->first; i < node->first + node->count; i++){
+                s32 instanceIndex = (s32)s->sortedInstances[i];
+                instance *inst = &s->instances[instanceIndex];
+                ray_4 local;
+                local.ox = _mm_sub_ps(ray->ox, _mm_set1_ps(inst->position.x));
+                local.oy = _mm_sub_ps(ray->oy, _mm_set1_ps(inst->position.y));
+                local.oz = _mm_sub_ps(ray->oz, _mm_set1_ps(inst->position.z));
+                local.dx = ray->dx;
+                local.dy = ray->dy;
+                local.dz = ray->dz;
+                MatrixMultiply4(&local.ox, &local.oy, &local.oz, &inst->toObject);
+                MatrixMultiply4(&local.dx, &local.dy, &local.dz, &inst->toObject);
+                IntersectMesh4(&s->meshes[inst->meshIndex], SHAPE_INSTANCE, instanceIndex, &local, near, hit, anyHit);
+            }
+            if (anyHit && AllLanesDone4(hit, nearV))
+                return;
+        }else{
+            Assert(stackSize + 2 <= ArrayCount(stack));
+            PushBvhChildren(nodes, node, firstDir, stack, &stackSize);
+        }
+    }
+}
+
+// Traverses the particles of a grid with a 3D-DDA, one ray at a time: the cells are visited in the order
+// the ray goes through them, and it stops at the first cell that has a hit inside it. A particle can be in
+// more than one cell, so a hit only counts in the cell where it is, or a closer one in the next cell could
+// be missed. Returns the particle hit in the range (near, *t), or -1.
+s32 IntersectParticleGrid(particle_cloud *c, v3 ro, v3 rd, f32 near, f32 *t, b32 anyHit){
+    s32 result = -1;
+    v3 gridMax = c->gridMin + c->cellSize*V3((f32)c->gridDim[0], (f32)c->gridDim[1], (f32)c->gridDim[2]);
+    f32 tEnter = near;
+    f32 tExit = *t;
+    for(s32 axis = 0; axis < 3; axis++){
+        if (rd.asArray[axis] == 0){
+            if (ro.asArray[axis] < c->gridMin.asArray[axis] || ro.asArray[axis] > gridMax.asArray[axis])
+                return result;
+            continue;
+        }
+        f32 invD = 1.f/rd.asArray[axis];
+        f32 t0 = (c->gridMin.asArray[axis] - ro.asArray[axis])*invD;
+        f32 t1 = (gridMax.asArray[axis] - ro.asArray[axis])*invD;
+        tEnter = Max(tEnter, Min(t0, t1));
+        tExit = Min(tExit, Max(t0, t1));
+    }
+    if (tEnter > tExit)
+        return result;
+
+    v3 entry = ro + tEnter*rd;
+    s32 cell[3], step[3];
+    f32 tNext[3], tDelta[3];
+    for(s32 axis = 0; axis < 3; axis++){
+        cell[axis] = ClampS32((s32)((entry.asArray[axis] - c->gridMin.asArray[axis])/c->cellSize), 0, c->gridDim[axis] - 1);
+        if (rd.asArray[axis] == 0){
+            step[axis] = 0;
+            tNext[axis] = MAX_F32;
+            tDelta[axis] = MAX_F32;
+        }else{
+            step[axis] = (rd.asArray[axis] > 0 ? 1 : -1);
+            f32 boundary = c->gridMin.asArray[axis] + (cell[axis] + (step[axis] > 0 ? 1 : 0))*c->cellSize;
+            tNext[axis] = (boundary - ro.asArray[axis])/rd.asArray[axis];
+            tDelta[axis] = c->cellSize/Abs(rd.asArray[axis]);
+        }
+    }
+
+    v3 quantizationStep = V3(ParticleCellQuantizationSize(c)/QUANTIZED_SPHERE_MAX);
+    f32 radiusStep = c->maxRadius/QUANTIZED_SPHERE_MAX;
+    while(1){
+        s32 nextAxis = (tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2));
+        f32 cellExit = tNext[nextAxis];
+        s32 cellIndex = (cell[2]*c->gridDim[1] + cell[1])*c->gridDim[0] + cell[0];
+        u32 cellEnd = c->cellStarts[cellIndex + 1];
+        if (c->quantized){
+            v3 quantizationMin = ParticleCellQuantizationMin(c, cell[0], cell[1], cell[2]);
+            for(u32 i = c->cellStarts[cellIndex]; i < cellEnd; i++){
+                f32 hitT = IntersectSphere(DequantizeSphere(c->quantizedSpheres[i], quantizationMin, quantizationStep, radiusStep), ro, rd);
+                if (hitT > near && hitT < *t && (hitT <= cellExit || anyHit)){
+                    *t = hitT;
+                    result = (s32)c->cellParticles[i];
+                }
+            }
+        }else{
+            for(u32 i = c->cellStarts[cellIndex]; i < cellEnd; i++){
+                u32 particleIndex = c->cellParticles[i];
+                f32 hitT = IntersectSphere(c->spheres[particleIndex], ro, rd);
+                if (hitT > near && hitT < *t && (hitT <= cellExit || anyHit)){
+                    *t = hitT;
+                    result = (s32)particleIndex;
+                }
+            }
+        }
+        if (result >= 0 || cellExit > tExit)
+            break;
+        cell[nextAxis] += step[nextAxis];
+        if (cell[nextAxis] < 0 || cell[nextAxis] >= c->gridDim[nextAxis])
+            break;
+        tNext[nextAxis] += tDelta[nextAxis];
+    }
+    return result;
+}
+
+// The grid is traversed by each lane on its own, and the BVH with the 4 rays together like the others.
+void IntersectParticles4(particle_cloud *c, ray_4 *ray, f32 near, hit_4 *hit, b32 anyHit){
+    if (!c->count)
+        return;
+    __m128 nearV = _mm_set1_ps(near);
+    if (c->structure == PARTICLES_GRID){
+        f32 o[3][4], d[3][4];
+        _mm_storeu_ps(o[0], ray->ox); _mm_storeu_ps(o[1], ray->oy); _mm_storeu_ps(o[2], ray->oz);
+        _mm_storeu_ps(d[0], ray->dx); _mm_storeu_ps(d[1], ray->dy); _mm_storeu_ps(d[2], ray->dz);
+        f32 laneT[4];
+        s32 laneIndex[4];
+        _mm_storeu_ps(laneT, hit->t);
+        b32 anyLaneHit = false;
+        for(s32 lane = 0; lane < 4; lane++){
+            laneIndex[lane] = IntersectParticleGrid(c, V3(o[0][lane], o[1][lane], o[2][lane]), V3(d[0][lane], d[1][lane], d[2][lane]), near, &laneT[lane], anyHit);
+            anyLaneHit |= (laneIndex[lane] >= 0);
+        }
+        if (anyLaneHit){
+            __m128 mask = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((__m128i *)laneIndex), _mm_set1_epi32(-1)));
+            hit->t = Select4(mask, _mm_loadu_ps(laneT), hit->t);
+            hit->type = Select4(mask, _mm_set1_epi32(SHAPE_PARTICLE), hit->type);
+            hit->index = Select4(mask, _mm_loadu_si128((__m128i *)laneIndex), hit->index);
+        }
+        return;
+    }
+
+    __m128 one = _mm_set1_ps(1.f);
+    __m128 invx = _mm_div_ps(one, ray->dx), invy = _mm_div_ps(one, ray->dy), invz = _mm_div_ps(one, ray->dz);
+    v3 firstDir = {_mm_cvtss_f32(ray->dx), _mm_cvtss_f32(ray->dy), _mm_cvtss_f32(ray->dz)};
+    bvh_node *nodes = c->bvh.nodes;
+    f32 radiusStep = c->maxRadius/QUANTIZED_SPHERE_MAX;
+
+    u32 stack[BVH_MAX_DEPTH + 1];
+    s32 stackSize = 0;
+    stack[stackSize++] = 0;
+    while(stackSize){
+        u32 nodeIndex = stack[--stackSize];
+        bvh_node *node = &nodes[nodeIndex];
+        if (!IntersectBvhNode4(node, ray, invx, invy, invz, nearV, hit->t))
+            continue;
+        if (node->count){
+            if (c->quantized){
+                // The leaf goes with the hit, so that GetParticleSphere() finds the sphere of a mapped cloud.
+                v3 quantizationStep = (node->max - node->min)/QUANTIZED_SPHERE_MAX;
+                for(u32 i = node->first; i < node->first + node->count; i++){
+                    sphere sp = DequantizeSphere(c->quantizedSpheres[i], node->min, quantizationStep, radiusStep);
+                    s32 particleIndex = (c->sortedParticles ? (s32)c->sortedParticles[i] : (s32)i);
+                    IntersectOneSphere4(sp, ray, nearV, hit, SHAPE_PARTICLE, particleIndex, (s32)nodeIndex);
+                }
+            }else{
+                for(u32 i = node->first; i < node->first + node->count; i++){
+                    s32 particleIndex = (s32)c->sortedParticles[i];
+                    IntersectOneSphere4(c->spheres[particleIndex], ray, nearV, hit, SHAPE_PARTICLE, particleIndex);
+                }
+            }
+            if (anyHit && AllLanesDone4(hit, nearV))
+                return;
+        }else{
+            Assert(stackSize + 2 <= ArrayCount(stack));
+            PushBvhChildren(nodes, node, firstDir, stack, &stackSize);
+        }
+    }
+}
+
+// Closest hit of all the shapes of the scene.
+inline void IntersectScene4(scene *s, ray_4 *ray, f32 near, hit_4 *hit){
+    IntersectSpheres4(s->spheres, s->numSpheres, ray, near, hit);
+    IntersectPlanes4(&s->planes, ray, near, hit);
+    IntersectBoxes4(&s->boxes, ray, near, hit);
+    IntersectTriangles4(&s->triangles, ray, near, hit);
+    IntersectMeshes4(s->meshes, s->numMeshes, ray, near, hit, false);
+    IntersectInstances4(s, ray, near, hit, false);
+    IntersectParticles4(&s->particles, ray, near, hit, false);
+}
+
+// Puts the rays in the lanes. 'count' can be less than 4, then the last ray is repeated.
+inline ray_4 Ray4(v3 *origins, v3 *directions, s32 count){
+    f32 o[3][4], d[3][4];
+    for(s32 lane = 0; lane < 4; lane++){
+        s32 i = MinS32(lane, count - 1);
+        for(s32 axis = 0; axis < 3; axis++){
+            o[axis][lane] = origins[i].asArray[axis];
+            d[axis][lane] = directions[i].asArray[axis];
+        }
+    }
+    ray_4 result = {_mm_loadu_ps(o[0]), _mm_loadu_ps(o[1]), _mm_loadu_ps(o[2]), _mm_loadu_ps(d[0]), _mm_loadu_ps(d[1]), _mm_loadu_ps(d[2])};
+    return result;
+}
+
+inline void StoreHit4(hit_4 *hit, f32 *t, s32 *type, s32 *index, s32 *primitive){
+    _mm_storeu_ps(t, hit->t);
+    _mm_storeu_si128((__m128i *)type, hit->type);
+    _mm_storeu_si128((__m128i *)index, hit->index);
+    _mm_storeu_si128((__m128i *)primitive, hit->primitive);
+}
+
+inline v3 NormalBox(box_bucket *boxes, s32 index, v3 p){
+    v3 min = GetBoxMin(boxes, index);
+    v3 max = GetBoxMax(boxes, index);
+    v3 rel = Hadamard(p - (min + max)/2, V3(2.f/(max.x - min.x), 2.f/(max.y - min.y), 2.f/(max.z - min.z))); // [-1, 1] inside the box
+    s32 axis = 0;
+    for(s32 i = 1; i < 3; i++){
+        if (Abs(rel.asArray[i]) > Abs(rel.asArray[axis]))
+            axis = i;
+    }
+    v3 n = {};
+    n.asArray[axis] = SignNonZero(rel.asArray[axis]);
+    return n;
+}
+
+// Normal of any kind of shape at the hit position 'p' of a ray with direction 'rd'. 'primitive' is the
+// triangle of a mesh, or the BVH leaf of a quantized particle.
+v3 ShapeNormal(scene *s, shape_type type, s32 index, s32 primitive, v3 p, v3 rd){
+    v3 n = {};
+    switch(type){
+        case SHAPE_SPHERE: n = NormalSphere(s->spheres[index], p); break;
+        case SHAPE_PARTICLE: n = NormalSphere(GetParticleSphere(&s->particles, index, primitive), p); break;
+        case SHAPE_PLANE:  n = GetPlaneNormal(&s->planes, index); break;
+        case SHAPE_BOX:    n = NormalBox(&s->boxes, index, p); break;
+        case SHAPE_TRIANGLE:{
+            v3 a, e1, e2;
+            GetTriangle(&s->triangles, index, &a, &e1, &e2);
+            n = Normalize(Cross(e1, e2));
+            if (Dot(n, rd) > 0){ // Double-sided
+                n = -n;
+            }
+        } break;
+        case SHAPE_MESH:
+        case SHAPE_INSTANCE:{
+            instance *inst = (type == SHAPE_INSTANCE ? &s->instances[index] : 0);
+            mesh *m = &s->meshes[inst ? inst->meshIndex : index];
+            v3 a = m->vertices[m->indices[3*primitive]];
+            v3 b = m->vertices[m->indices[3*primitive + 1]];
+            v3 c = m->vertices[m->indices[3*primitive + 2]];
+            n = Cross(b - a, c - a);
+            if (inst){ // The scale is uniform, so the normal can be transformed like the positions.
+                n = MatrixMultiply(n, inst->toWorld);
+            }
+            n = Normalize(n);
+            if (Dot(n, rd) > 0){ // Double-sided
+                n = -n;
+            }
+        } break;
+        default: Assert(false);
+    }
+    return n;
+}
+
+// Primary ray hit of a pixel of the tile being rendered.
+struct pixel_hit{
+    v3 rd;
+    v3 p;
+    v3 n;
+    f32 t;
+    shape_type shapeType; // SHAPE_NONE if the ray didn't hit anything.
+    s32 shapeIndex;
+    s32 primitiveIndex; // Triangle of a mesh.
+};
+
+// With H in the window, or -heatmap before the other arguments, each pixel shows how many cycles it took
+// instead of its color: the rdtsc cycles of the primary rays, hard shadows, shading and reflections of
+// each one. The rays go 4 at a time, so each of those takes a quarter of the cycles of its group.
+#define HEATMAP_MIN_CYCLES 64.f // Black at this or less,
+#define HEATMAP_MAX_CYCLES 16384.f // white at this or more, on a log scale (each doubling is the same step).
+
+inline u64 StartHeatmapClock(u32 *pixelCycles){
+    u64 result = (pixelCycles ? __rdtsc() : 0);
+    return result;
+}
+
+// Cycles since 'start' for each of 'numPixels' pixels.
+inline u32 StopHeatmapClock(u32 *pixelCycles, u64 start, s32 numPixels){
+    u32 result = (pixelCycles ? (u32)((__rdtsc() - start)/numPixels) : 0);
+    return result;
+}
+
+// Black, blue, red, yellow, white.
+u32 HeatmapPixel(u32 cycles){
+    static v3 colors[] = {{0, 0, 0}, {0, 0, 1.f}, {1.f, 0, 0}, {1.f, 1.f, 0}, {1.f, 1.f, 1.f}};
+    f32 t = Clamp01((log2f((f32)cycles + 1.f) - log2f(HEATMAP_MIN_CYCLES))/(log2f(HEATMAP_MAX_CYCLES) - log2f(HEATMAP_MIN_CYCLES)));
+    f32 segment = t*(ArrayCount(colors) - 1);
+    s32 i = MinS32((s32)segment, ArrayCount(colors) - 2);
+    v3 col = colors[i] + (segment - i)*(colors[i + 1] - colors[i]);
+    u32 r = (u32)(col.r*255);
+    u32 g = (u32)(col.g*255);
+    u32 b = (u32)(col.b*255);
+    u32 result = BACKGROUND_PIXEL | (b << 16) | (g << 8) | r;
+    return result;
+}
+
+// 'scratch' is the arena of the worker thread.
+void RenderTile(work_entry *entry, memory_arena *scratch){
+    auto gs = &globalState;
+    frame_view *view = entry->view;
+    scene *s = &view->scene;
+
+    v2 worldFrameDim;
+    worldFrameDim.y = Tan(view->fovY/2);
+    worldFrameDim.x = worldFrameDim.y*(view->frameDim.x/(f32)view->frameDim.y);
+
+    v2s tileDim = entry->tileMax - entry->tileMin;
+    s32 numPixels = tileDim.x*tileDim.y;
+    Assert(numPixels <= MAX_TILE_PIXELS);
+
+    u32 *tilePixels = &view->tiles[entry->tileIndex*MAX_TILE_PIXELS];
+    tile_bin *bin = &view->tileBins[entry->tileIndex];
+    s32 *binSpheres = &view->binnedSpheres[bin->firstSphere];
+    if (!bin->numSpheres && !bin->planes && !bin->boxes && !bin->triangles && !bin->meshes && !bin->instances && !bin->particles){
+        // Nothing to hit, so the whole tile is background. The pixels past the edge of the frame are
+        // never read, so the whole tile can be filled with aligned stores.
+        __m128i background = _mm_set1_epi32((s32)(view->heatmap ? HeatmapPixel(0) : BACKGROUND_PIXEL));
+        for(s32 i = 0; i < MAX_TILE_PIXELS; i += 4){
+            _mm_store_si128((__m128i *)&tilePixels[i], background);
+        }
+        return;
+    }
+
+    pixel_hit *hits = PushArray(scratch, pixel_hit, numPixels);
+    v3 *lightDiffuse = PushArray(scratch, v3, numPixels); // Sum of the diffuse light of all lights.
+    v3 *lightSpecular = PushArray(scratch, v3, numPixels); // Sum of the specular light of all lights.
+    u32 *pixelCycles = 0; // For the heatmap.
+    if (view->heatmap){
+        pixelCycles = PushArray(scratch, u32, numPixels);
+        for(s32 i = 0; i < numPixels; i++){
+            pixelCycles[i] = 0;
+        }
+    }
+
+    //
+    // Primary rays
+    //
+    BEGIN_TIMED_BLOCK(ZONE_PRIMARY_RAYS);
+    v3 hitsMin = V3(MAX_F32); // Bounding box of the tile's hit positions.
+    v3 hitsMax = V3(-MAX_F32);
+    f32 hitsMinT = MAX_F32;
+    s32 numHits = 0;
+    b32 rayDirsValid = view->tileRayDirsValid[entry->tileIndex];
+    v3 cameraPositions[4] = {view->camPos, view->camPos, view->camPos, view->camPos};
+    for(s32 y = entry->tileMin.y; y < entry->tileMax.y; y++){
+        for(s32 x0 = entry->tileMin.x; x0 < entry->tileMax.x; x0 += 4){ // 4 pixels at a time
+            s32 numLanes = MinS32(4, entry->tileMax.x - x0);
+
+            // Rays
+            u64 heatmapStart = StartHeatmapClock(pixelCycles);
+            v3 ro = view->camPos;//V3(0, 2, -15.f);
+            v3 *rayDirs = &view->cameraRayDirs[y*view->frameDim.x + x0];
+            if (!rayDirsValid){
+                for(s32 lane = 0; lane < numLanes; lane++){
+                    v2 uv = {(f32)(x0 + lane)/view->frameDim.x, (f32)y/view->frameDim.y}; // [0, 1]
+                    //rayDirs[lane] = NormalizeNonZero(V3((-1.f + 2.f*uv.x)*worldFrameDim.x, (-1.f + 2.f*uv.y)*worldFrameDim.y, 1.f));
+                    rayDirs[lane] = NormalizeNonZero(view->camForward + (-1.f + 2.f*uv.x)*view->camRight*worldFrameDim.x/2 + (-1.f + 2.f*uv.y)*view->camUp*worldFrameDim.y/2);
+                }
+            }
+            ray_4 ray = Ray4(cameraPositions, rayDirs, numLanes);
+
+            // Intersection with the objects that can cover the tile
+            hit_4 hit4 = Hit4(gs->camFar);
+            IntersectSpheresPrimary4(view->primarySpheres, binSpheres, bin->numSpheres, &ray, gs->camNear, &hit4);
+            if (bin->planes){
+                IntersectPlanesPrimary4(&s->planes, view->primaryPlaneNumerators, &ray, gs->camNear, &hit4);
+            }
+            if (bin->boxes){
+                IntersectBoxes4(&s->boxes, &ray, gs->camNear, &hit4);
+            }
+            if (bin->triangles){
+                IntersectTriangles4(&s->triangles, &ray, gs->camNear, &hit4);
+            }
+            if (bin->meshes){
+                IntersectMeshes4(s->meshes, s->numMeshes, &ray, gs->camNear, &hit4, false);
+            }
+            if (bin->instances){
+                IntersectInstances4(s, &ray, gs->camNear, &hit4, false);
+            }
+            if (bin->particles){
+                IntersectParticles4(&s->particles, &ray, gs->camNear, &hit4, false);
+            }
+            f32 laneT[4];
+            s32 laneType[4];
+            s32 laneIndex[4];
+            s32 lanePrimitive[4];
+            StoreHit4(&hit4, laneT, laneType, laneIndex, lanePrimitive);
+            u32 heatmapCycles = StopHeatmapClock(pixelCycles, heatmapStart, numLanes);
+
+            for(s32 lane = 0; lane < numLanes; lane++){
+                s32 pixelIndex = (y - entry->tileMin.y)*tileDim.x + (x0 + lane - entry->tileMin.x);
+                pixel_hit *hit = &hits[pixelIndex];
+                if (pixelCycles){
+                    pixelCycles[pixelIndex] += heatmapCycles;
+                }
+                v3 rd = rayDirs[lane];
+                f32 t = laneT[lane];
+                hit->rd = rd;
+                hit->t = t;
+                hit->shapeType = (shape_type)laneType[lane];
+                hit->shapeIndex = laneIndex[lane];
+                hit->primitiveIndex = lanePrimitive[lane];
+                if (hit->shapeType){
+                    hit->p = ro + t*rd;
+                    hit->n = ShapeNormal(s, hit->shapeType, hit->shapeIndex, hit->primitiveIndex, hit->p, rd);
+                    for(s32 i = 0; i < 3; i++){
+                        hitsMin.asArray[i] = Min(hitsMin.asArray[i], hit->p.asArray[i]);
+                        hitsMax.asArray[i] = Max(hitsMax.asArray[i], hit->p.asArray[i]);
+                    }
+                    hitsMinT = Min(hitsMinT, t);
+                    numHits++;
+                }
+            }
+        }
+    }
+    view->tileRayDirsValid[entry->tileIndex] = true;
+    END_TIMED_BLOCK(ZONE_PRIMARY_RAYS);
+
+    //
+    // Light culling: only keep the lights that reach the tile's bounding box.
+    //
+    s32 tileLights[MAX_LIGHTS];
+    s32 numTileLights = 0;
+    if (numHits){
+        for(s32 lightIndex = 0; lightIndex < s->numLights; lightIndex++){
+            sphere_light *light = &s->lights[lightIndex];
+            v3 lightPos = s->spheres[light->sphereIndex].c;
+            if (DistanceSqrToBox(lightPos, hitsMin, hitsMax) < SQUARE(light->reach)){
+                tileLights[numTileLights++] = lightIndex;
+            }
+        }
+    }
+
+    //
+    // Lights
+    //
+    for(s32 i = 0; i < numPixels; i++){
+        lightDiffuse[i] = V3(0);
+        lightSpecular[i] = V3(0);
+    }
+    f32 pixelArea = (worldFrameDim.x/view->frameDim.x)*(worldFrameDim.y/view->frameDim.y);
+    v3 hitsCenter = (hitsMin + hitsMax)/2;
+    f32 hitsRadius = Length(hitsMax - hitsMin)/2;
+    for(s32 tileLightIndex = 0; tileLightIndex < numTileLights; tileLightIndex++){
+        s32 lightIndex = tileLights[tileLightIndex];
+        sphere_light *light = &s->lights[lightIndex];
+        sphere lightSphere = s->spheres[light->sphereIndex];
+        v3 pointLightPos = lightSphere.c;
+
+        // Occluder culling: only keep the spheres that can block the light to some hit position of the tile.
+        // The dynamic ones are also kept in a separate list, because they aren't included in the shadow cache.
+        s32 occluders[MAX_SPHERES];
+        s32 numOccluders = 0;
+        s32 dynamicOccluders[MAX_SPHERES];
+        s32 numDynamicOccluders = 0;
+        BEGIN_TIMED_BLOCK(ZONE_SHADOW_CULLING);
+        f32 maxConeRadius = Max(SquareRoot(pixelArea/(PI*hitsMinT)), lightSphere.r); // Max of r0 and r1 (see below).
+        for(s32 i = 0; i < s->numSpheres; i++){
+            if (s->sphereMaterials[i].emit) continue; // Lights don't cast shadows.
+            if (SphereCanBlockLightToBall(s->spheres[i].c, s->spheres[i].r, hitsCenter, hitsRadius, pointLightPos, maxConeRadius)){
+                occluders[numOccluders++] = i;
+                if (s->dynamicSpheres[i]){
+                    dynamicOccluders[numDynamicOccluders++] = i;
+                }
+            }
+        }
+
+        // The light without shadows at each pixel. The tile can be in its range while some of its pixels
+        // aren't, or face away from it, and those don't need shadows.
+        f32 pointLights[MAX_TILE_PIXELS];
+        s32 litPixels[MAX_TILE_PIXELS];
+        s32 numLitPixels = 0;
+        for(s32 pixelIndex = 0; pixelIndex < numPixels; pixelIndex++){
+            pixel_hit *hit = &hits[pixelIndex];
+            if (!hit->shapeType)
+                continue;
+            u64 heatmapStart = StartHeatmapClock(pixelCycles);
+            // NOTE: The "pointLight" is actually spherical now. I just didn't bother to change the variable names hehe.
+            f32 pointLightLength = Length(pointLightPos - hit->p);
+            f32 pointLight = LightAttenuation(light->intensity, pointLightLength);
+            v3 pointLightDir = Normalize(pointLightPos - hit->p);
+            pointLight *= Max(0, Dot(hit->n, pointLightDir)); // Reduce strength based on angle.
+            pointLight *= Clamp01(MapRangeTo01(pointLight, LIGHT_CUTOFF_MIN, LIGHT_CUTOFF_MAX)); // Unnoticeable falloff for performance.
+            pointLights[pixelIndex] = pointLight;
+            if (pointLight){
+                litPixels[numLitPixels++] = pixelIndex;
+            }
+            if (pixelCycles){
+                pixelCycles[pixelIndex] += StopHeatmapClock(pixelCycles, heatmapStart, 1);
+            }
+        }
+        END_TIMED_BLOCK(ZONE_SHADOW_CULLING);
+
+        // The other kinds of shapes just cast hard shadows. Their shadow rays are traced 4 at a time, only for the
+        // lit pixels.
+        b32 hardShadows = (s->boxes.count || s->triangles.count || s->numMeshes || s->numInstances || s->particles.count);
+        f32 hardShadowLight[MAX_TILE_PIXELS]; // 0 if the light is blocked.
+        if (hardShadows){
+            BEGIN_TIMED_BLOCK(ZONE_HARD_SHADOWS);
+            for(s32 i = 0; i < numLitPixels; i += 4){
+                s32 numLanes = MinS32(4, numLitPixels - i);
+                u64 heatmapStart = StartHeatmapClock(pixelCycles);
+                v3 origins[4];
+                v3 dirs[4];
+                f32 far[4];
+                for(s32 lane = 0; lane < 4; lane++){
+                    pixel_hit *hit = &hits[litPixels[i + MinS32(lane, numLanes - 1)]];
+                    origins[lane] = hit->p;
+                    dirs[lane] = Normalize(pointLightPos - origins[lane]);
+                    far[lane] = Length(pointLightPos - origins[lane]) - lightSphere.r;
+                }
+                ray_4 ray = Ray4(origins, dirs, numLanes);
+                hit_4 blocker = Hit4(0);
+                blocker.t = _mm_loadu_ps(far);
+                IntersectBoxes4(&s->boxes, &ray, .001f, &blocker);
+                IntersectTriangles4(&s->triangles, &ray, .001f, &blocker);
+                IntersectMeshes4(s->meshes, s->numMeshes, &ray, .001f, &blocker, true);
+                IntersectInstances4(s, &ray, .001f, &blocker, true);
+                IntersectParticles4(&s->particles, &ray, .001f, &blocker, true);
+                s32 blockerType[4];
+                _mm_storeu_si128((__m128i *)blockerType, blocker.type);
+                u32 heatmapCycles = StopHeatmapClock(pixelCycles, heatmapStart, numLanes);
+                for(s32 lane = 0; lane < numLanes; lane++){
+                    hardShadowLight[litPixels[i + lane]] = (blockerType[lane] ? 0 : 1.f);
+                    if (pixelCycles){
+                        pixelCycles[litPixels[i + lane]] += heatmapCycles;
+                    }
+                }
+            }
+            END_TIMED_BLOCK(ZONE_HARD_SHADOWS);
+        }
+
+        BEGIN_TIMED_BLOCK(ZONE_SHADING);
+        for(s32 litIndex = 0; litIndex < numLitPixels; litIndex++){
+            s32 pixelIndex = litPixels[litIndex];
+            pixel_hit *hit = &hits[pixelIndex];
+            u64 heatmapStart = StartHeatmapClock(pixelCycles);
+            v3 p = hit->p;
+            v3 n = hit->n;
+            f32 t = hit->t;
+
+            f32 pointLightLength = Length(pointLightPos - p);
+            f32 pointLight = pointLights[pixelIndex];
+            v3 pointLightDir = Normalize(pointLightPos - p);
+            if (pointLight){ // Always, the shadows can only make it 0.
+                f32 pointLightRadius = lightSphere.r;
+
+                // Hard shadows: just one ray.
+#if 0
+                f32 shadowT = pointLightLength;
+                for(s32 i = 0; i < numOccluders; i++){
+                    f32 t = IntersectSphere(s->spheres[occluders[i]], p, pointLightDir);
+                    if (t > .001f && t < shadowT){
+                        shadowT = t;
+                    }
+                }
+                f32 l = (shadowT < pointLightLength ? 0 : 1.f);
+#endif
+
+                // Old way: Average of multiple rays.
+#if 0
+                s32 numRays = 25;
+                s32 occludedRaysCount = 0;
+                for(s32 rayIndex = 0; rayIndex < numRays; rayIndex++){
+                    v3 rayDir = pointLightDir;
+                    if (rayIndex){
+                        // Shoot rays in different directions
+                        v3 px = Perpendicular(pointLightDir);
+                        v3 py = Cross(px, pointLightDir);
+                        u32 hash = SimpleHash((u32)rayIndex);
+                        f32 pr = SafeDivide0(pointLightRadius, pointLightLength)*((f32)(hash & 0xffff)/65535.f);
+                        f32 angle = ((f32)((hash >> 16) & 0xffff)/65535.f)*2*PI;
+                        rayDir = Normalize(pointLightDir + pr*(px*Cos(angle) + py*Sin(angle)));
+                    }
+                    f32 shadowT = pointLightLength;
+                    for(s32 i = 0; i < numOccluders; i++){
+                        f32 t = IntersectSphere(s->spheres[occluders[i]], p, rayDir);
+                        if (t > .001f && t < shadowT){
+                            shadowT = t;
+                        }
+                    }
+                    if (shadowT < pointLightLength){
+                        occludedRaysCount++;
+                    }
+                }
+                f32 l = (f32)(numRays - occludedRaysCount)/(f32)numRays;
+#endif
+
+                // New method: Project each sphere to 2d, circle intersection is the blocked area (see AccumulateShadow()).
+                // Static surfaces get the shadows of the static spheres from the cache, so we only add the dynamic ones.
+#if 1
+                f32 r0 = SquareRoot(pixelArea/(PI*t));
+                f32 r1 = pointLightRadius;
+                v3 perpX = Perpendicular(pointLightDir);
+                v3 perpY = Cross(perpX, pointLightDir);
+
+                shadow_accumulator shadow;
+                if (view->useShadowCache && SampleShadowCache(&gs->shadowCache, s, hit->shapeType, hit->shapeIndex, lightIndex, p, &shadow)){
+                    for(s32 i = 0; i < numDynamicOccluders; i++){
+                        AccumulateShadow(&shadow, s->spheres[dynamicOccluders[i]], p, pointLightDir, pointLightLength, perpX, perpY, r0, r1);
+                    }
+                }else{
+                    shadow = ShadowAccumulator();
+                    for(s32 i = 0; i < numOccluders; i++){
+                        AccumulateShadow(&shadow, s->spheres[occluders[i]], p, pointLightDir, pointLightLength, perpX, perpY, r0, r1);
+                    }
+                }
+                f32 l = ShadowLightAmount(&shadow);
+#endif
+
+                if (hardShadows){
+                    l *= hardShadowLight[pixelIndex];
+                }
+
+                pointLight *= l;
+            }
+
+            if (pointLight){
+                lightDiffuse[pixelIndex] += pointLight*light->color;
+
+                // Blinn-Phong
+                v3 l = pointLightDir;
+                v3 v = -hit->rd;
+                v3 h = Normalize(l + v);
+                f32 intensity = 3.f*Pow(Dot(n, h), 50.f);
+                lightSpecular[pixelIndex] += pointLight*intensity*light->color/pointLightLength;
+            }
+            if (pixelCycles){
+                pixelCycles[pixelIndex] += StopHeatmapClock(pixelCycles, heatmapStart, 1);
+            }
+        }
+        END_TIMED_BLOCK(ZONE_SHADING);
+    }
+
+    //
+    // Reflection rays, 4 at a time
+    //
+    BEGIN_TIMED_BLOCK(ZONE_REFLECTIONS);
+    s32 reflecting[MAX_TILE_PIXELS]; // Pixels that have reflections.
+    s32 numReflecting = 0;
+    for(s32 i = 0; i < numPixels; i++){
+        if (hits[i].shapeType && GetShapeMaterial(s, hits[i].shapeType, hits[i].shapeIndex)->reflectivity){
+            reflecting[numReflecting++] = i;
+        }
+    }
+    v3 reflectedCol[MAX_TILE_PIXELS]; // Color of the shape seen in the reflection.
+    for(s32 i = 0; i < numReflecting; i += 4){
+        s32 numLanes = MinS32(4, numReflecting - i);
+        u64 heatmapStart = StartHeatmapClock(pixelCycles);
+        v3 origins[4];
+        v3 dirs[4];
+        for(s32 lane = 0; lane < numLanes; lane++){
+            pixel_hit *hit = &hits[reflecting[i + lane]];
+            origins[lane] = hit->p;
+            dirs[lane] = hit->rd -2.f*Dot(hit->rd, hit->n)*hit->n; // Reflect ray by the normal
+        }
+        ray_4 ray = Ray4(origins, dirs, numLanes);
+        hit_4 hit4 = Hit4(gs->camFar);
+        IntersectScene4(s, &ray, gs->camNear, &hit4);
+        f32 laneT[4];
+        s32 laneType[4];
+        s32 laneIndex[4];
+        s32 lanePrimitive[4];
+        StoreHit4(&hit4, laneT, laneType, laneIndex, lanePrimitive);
+        u32 heatmapCycles = StopHeatmapClock(pixelCycles, heatmapStart, numLanes);
+
+        //
+        // Color
+        //
+        for(s32 lane = 0; lane < numLanes; lane++){
+            v3 col2 = {0};
+            if (laneType[lane]){
+                //v3 p2 = origins[lane] + dirs[lane]*laneT[lane];
+                //v3 n2 = ShapeNormal(s, (shape_type)laneType[lane], laneIndex[lane], lanePrimitive[lane], p2, dirs[lane]); // BUG: Why does this mess up the plane's shading?
+                col2 = GetShapeMaterial(s, (shape_type)laneType[lane], laneIndex[lane])->color;
+            }
+            reflectedCol[reflecting[i + lane]] = col2;
+            if (pixelCycles){
+                pixelCycles[reflecting[i + lane]] += heatmapCycles;
+            }
+        }
+    }
+    END_TIMED_BLOCK(ZONE_REFLECTIONS);
+
+    //
+    // Final color
+    //
+    BEGIN_TIMED_BLOCK(ZONE_FINAL_COLOR);
+    if (pixelCycles){
+        for(s32 y = entry->tileMin.y; y < entry->tileMax.y; y++){
+            for(s32 x = entry->tileMin.x; x < entry->tileMax.x; x++){
+                s32 pixelIndex = (y - entry->tileMin.y)*tileDim.x + (x - entry->tileMin.x);
+                tilePixels[(y - entry->tileMin.y)*TILE_SIZE + (x - entry->tileMin.x)] = HeatmapPixel(pixelCycles[pixelIndex]);
+            }
+        }
+        END_TIMED_BLOCK(ZONE_FINAL_COLOR);
+        return;
+    }
+    for(s32 y = entry->tileMin.y; y < entry->tileMax.y; y++){
+        for(s32 x = entry->tileMin.x; x < entry->tileMax.x; x++){
+            s32 pixelIndex = (y - entry->tileMin.y)*tileDim.x + (x - entry->tileMin.x);
+            pixel_hit *hit = &hits[pixelIndex];
+
+            v3 col = {0};
+            if (hit->shapeType){
+                v3 rd = hit->rd;
+                v3 p = hit->p;
+                v3 n = hit->n;
+                shape_material *material = GetShapeMaterial(s, hit->shapeType, hit->shapeIndex);
+                v3 shapeCol = material->color;
+                f32 reflectivity = material->reflectivity;
+
+                v3 reflectionCol = {};
+                if (reflectivity){
+                    reflectionCol = reflectedCol[pixelIndex]*(.06f*Square(Clamp01(1.f - Dot(n, -rd))) + .01f); // Fresnel kinda thing
+                }
+
+                //                         emited light  | ambient |  directional                           |  spherical lights      | specular                    |  reflection
+                col = Hadamard(shapeCol, V3(material->emit + .03f + .12f*Max(0, n.y)/*(.5f + .5f*n.y)*/) + lightDiffuse[pixelIndex]) + lightSpecular[pixelIndex] + reflectionCol*reflectivity;
+            }
+
+            u32 r = (u32)(Clamp01(LinearToSrgb(col.r))*255);
+            u32 g = (u32)(Clamp01(LinearToSrgb(col.g))*255);
+            u32 b = (u32)(Clamp01(LinearToSrgb(col.b))*255);
+            tilePixels[(y - entry->tileMin.y)*TILE_SIZE + (x - entry->tileMin.x)] = BACKGROUND_PIXEL | (b << 16) | (g << 8) | r;
+        }
+    }
+    END_TIMED_BLOCK(ZONE_FINAL_COLOR);
+}
+
+// Copies the tiles of the view to a row-major frame, one row of a tile at a time (a cache line when the
+// tile is whole).
+void DetileFrame(frame_view *view, u32 *frame){
+    for(s32 tileY = 0; tileY < view->numTiles.y; tileY++){
+        s32 height = MinS32(TILE_SIZE, view->frameDim.y - tileY*TILE_SIZE);
+        for(s32 tileX = 0; tileX < view->numTiles.x; tileX++){
+            s32 width = MinS32(TILE_SIZE, view->frameDim.x - tileX*TILE_SIZE);
+            u32 *tilePixels = &view->tiles[(tileY*view->numTiles.x + tileX)*MAX_TILE_PIXELS];
+            for(s32 y = 0; y < height; y++){
+                u32 *src = &tilePixels[y*TILE_SIZE];
+                u32 *dest = &frame[(tileY*TILE_SIZE + y)*view->frameDim.x + tileX*TILE_SIZE];
+                s32 x = 0;
+                for(; x + 4 <= width; x += 4){
+                    _mm_storeu_si128((__m128i *)&dest[x], _mm_load_si128((__m128i *)&src[x]));
+                }
+                for(; x < width; x++){
+                    dest[x] = src[x];
+                }
+            }
+        }
+    }
+}
+
+// Video frames are row-major from the top row, as encoders expect. The YUV coefficients are BT.601 full
+// range (JFIF), which is what C420jpeg means in Y4M.
+#define YUV_Y_COEFFS .299f, .587f, .114f
+#define YUV_U_COEFFS -.168736f, -.331264f, .5f
+#define YUV_V_COEFFS .5f, -.418688f, -.081312f
+
+inline umm GetVideoFrameSize(video_format format, v2s frameDim){
+    umm numPixels = (umm)frameDim.x*frameDim.y;
+    umm result = (format == VIDEO_YUV420 ? numPixels + numPixels/2 : format == VIDEO_RGB ? numPixels*3 : 0);
+    return result;
+}
+
+inline f32 GetYuvComponent(f32 r, f32 g, f32 b, f32 cr, f32 cg, f32 cb, f32 offset){
+    f32 result = Clamp(r*cr + g*cg + b*cb + offset, 0, 255.f);
+    return result;
+}
+
+// Components 0, 8 and 16 of 4 RGBX pixels, as floats.
+inline void UnpackPixels4(__m128i pixels, __m128 *r, __m128 *g, __m128 *b){
+    __m128i mask = _mm_set1_epi32(0xff);
+    *r = _mm_cvtepi32_ps(_mm_and_si128(pixels, mask));
+    *g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 8), mask));
+    *b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 16), mask));
+}
+
+// The frame has even dimensions, and the tiles start at even pixels, so each tile covers whole 2x2 blocks
+// of the chroma planes.
+void ConvertTileToYuv420(frame_view *view, u32 *tilePixels, v2s tileMin, v2s tileMax){
+    s32 frameWidth = view->frameDim.x;
+    s32 frameHeight = view->frameDim.y;
+    s32 chromaWidth = frameWidth/2;
+    u8 *planeY = view->video;
+    u8 *planeU = planeY + frameWidth*frameHeight;
+    u8 *planeV = planeU + chromaWidth*(frameHeight/2);
+    s32 width = tileMax.x - tileMin.x;
+
+    __m128 yR = _mm_set1_ps(.299f), yG = _mm_set1_ps(.587f), yB = _mm_set1_ps(.114f);
+    __m128 uR = _mm_set1_ps(-.168736f*.25f), uG = _mm_set1_ps(-.331264f*.25f), uB = _mm_set1_ps(.5f*.25f); // .25 averages the block.
+    __m128 vR = _mm_set1_ps(.5f*.25f), vG = _mm_set1_ps(-.418688f*.25f), vB = _mm_set1_ps(-.081312f*.25f);
+    __m128 chromaOffset = _mm_set1_ps(128.f);
+    for(s32 y = tileMin.y; y < tileMax.y; y += 2){
+        // Frame rows go up, so the row 'y' is the lower one of the pair in the video frame.
+        u32 *src0 = &tilePixels[(y - tileMin.y)*TILE_SIZE];
+        u32 *src1 = src0 + TILE_SIZE;
+        u8 *destY0 = &planeY[(frameHeight - 1 - y)*frameWidth + tileMin.x];
+        u8 *destY1 = destY0 - frameWidth;
+        s32 chromaRow = (frameHeight - 2 - y)/2;
+        u8 *destU = &planeU[chromaRow*chromaWidth + tileMin.x/2];
+        u8 *destV = &planeV[chromaRow*chromaWidth + tileMin.x/2];
+
+        s32 x = 0;
+        for(; x + 8 <= width; x += 8){ // 2 rows of 8 pixels, 4 chroma samples.
+            __m128 r[4], g[4], b[4];
+            UnpackPixels4(_mm_load_si128((__m128i *)&src0[x]), &r[0], &g[0], &b[0]);
+            UnpackPixels4(_mm_load_si128((__m128i *)&src0[x + 4]), &r[1], &g[1], &b[1]);
+            UnpackPixels4(_mm_load_si128((__m128i *)&src1[x]), &r[2], &g[2], &b[2]);
+            UnpackPixels4(_mm_load_si128((__m128i *)&src1[x + 4]), &r[3], &g[3], &b[3]);
+            __m128i lumas[4];
+            for(s32 i = 0; i < 4; i++){
+                __m128 luma = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r[i], yR), _mm_mul_ps(g[i], yG)), _mm_mul_ps(b[i], yB));
+                lumas[i] = _mm_cvtps_epi32(luma);
+            }
+            __m128i packedY = _mm_packus_epi16(_mm_packs_epi32(lumas[0], lumas[1]), _mm_packs_epi32(lumas[2], lumas[3]));
+            _mm_storel_epi64((__m128i *)destY0, packedY);
+            _mm_storel_epi64((__m128i *)destY1, _mm_srli_si128(packedY, 8));
+
+            // Sums of the 2x2 blocks: the two rows, then the even and odd columns.
+            __m128 sums[3];
+            __m128 *channels[3] = {r, g, b};
+            for(s32 c = 0; c < 3; c++){
+                __m128 *ch = channels[c];
+                __m128 left = _mm_add_ps(ch[0], ch[2]);
+                __m128 right = _mm_add_ps(ch[1], ch[3]);
+                sums[c] = _mm_add_ps(_mm_shuffle_ps(left, right, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(left, right, _MM_SHUFFLE(3,1,3,1)));
+            }
+            __m128 u = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sums[0], uR), _mm_mul_ps(sums[1], uG)), _mm_mul_ps(sums[2], uB)), chromaOffset);
+            __m128 v = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sums[0], vR), _mm_mul_ps(sums[1], vG)), _mm_mul_ps(sums[2], vB)), chromaOffset);
+            __m128i packedUV = _mm_packus_epi16(_mm_packs_epi32(_mm_cvtps_epi32(u), _mm_cvtps_epi32(v)), _mm_setzero_si128());
+            *(u32 *)&destU[x/2] = (u32)_mm_cvtsi128_si32(packedUV);
+            *(u32 *)&destV[x/2] = (u32)_mm_cvtsi128_si32(_mm_srli_si128(packedUV, 4));
+            destY0 += 8;
+            destY1 += 8;
+        }
+        for(; x < width; x += 2){ // The rest of a tile that's cut by the edge of the frame.
+            f32 sumR = 0, sumG = 0, sumB = 0;
+            for(s32 i = 0; i < 4; i++){
+                u32 pixel = (i < 2 ? src0 : src1)[x + (i & 1)];
+                f32 pr = (f32)(pixel & 0xff), pg = (f32)((pixel >> 8) & 0xff), pb = (f32)((pixel >> 16) & 0xff);
+                (i < 2 ? destY0 : destY1)[i & 1] = (u8)(GetYuvComponent(pr, pg, pb, YUV_Y_COEFFS, 0) + .5f);
+                sumR += pr;
+                sumG += pg;
+                sumB += pb;
+            }
+            destU[x/2] = (u8)(GetYuvComponent(.25f*sumR, .25f*sumG, .25f*sumB, YUV_U_COEFFS, 128.f) + .5f);
+            destV[x/2] = (u8)(GetYuvComponent(.25f*sumR, .25f*sumG, .25f*sumB, YUV_V_COEFFS, 128.f) + .5f);
+            destY0 += 2;
+            destY1 += 2;
+        }
+    }
+}
+
+void ConvertTileToRgb(frame_view *view, u32 *tilePixels, v2s tileMin, v2s tileMax){
+    for(s32 y = tileMin.y; y < tileMax.y; y++){
+        u32 *src = &tilePixels[(y - tileMin.y)*TILE_SIZE];
+        u8 *dest = &view->video[((view->frameDim.y - 1 - y)*view->frameDim.x + tileMin.x)*3];
+        for(s32 x = 0; x < tileMax.x - tileMin.x; x++){
+            u32 pixel = src[x];
+            *dest++ = (u8)pixel;
+            *dest++ = (u8)(pixel >> 8);
+            *dest++ = (u8)(pixel >> 16);
+        }
+    }
+}
+
+// Called by the worker that rendered the tile, so the conversion is spread over the threads like the
+// rendering, and the frame is ready to be written as soon as its last tile is done.
+void ConvertTileToVideo(frame_view *view, work_entry *entry){
+    u32 *tilePixels = &view->tiles[entry->tileIndex*MAX_TILE_PIXELS];
+    if (view->videoFormat == VIDEO_YUV420){
+        ConvertTileToYuv420(view, tilePixels, entry->tileMin, entry->tileMax);
+    }else if (view->videoFormat == VIDEO_RGB){
+        ConvertTileToRgb(view, tilePixels, entry->tileMin, entry->tileMax);
+    }
+}
+
+// Worker thread entry point
+// 'param' is the index of the thread.
+DWORD WINAPI ThreadProc(void *param){
+    auto gs = &globalState;
+    s32 threadIndex = (s32)(umm)param;
+    memory_arena *scratch = &gs->scratchArenas[threadIndex];
+    globalThreadIndex = threadIndex;
+    while(1){
+        s64 waitStart = GetTraceTime();
+        WaitForSingleObject(gs->semaphoreEntriesToDo, INFINITE);
+        TraceEvent(threadIndex, "Wait", waitStart, -1);
+
+        while(1){
+            b32 urgent = false;
+            s32 entryIndex = gs->nextUrgentEntry;
+            if (entryIndex < gs->numUrgentEntries){
+                urgent = true;
+            }else{
+                entryIndex = gs->nextEntry;
+            }
+            volatile LONG *next = (volatile LONG *)(urgent ? &gs->nextUrgentEntry : &gs->nextEntry);
+            if (InterlockedCompareExchange(next, (LONG)entryIndex + 1, (LONG)entryIndex) == entryIndex){
+                work_entry *entry = (urgent ? &gs->urgentEntries[entryIndex % ArrayCount(gs->urgentEntries)] : &gs->entries[entryIndex % ArrayCount(gs->entries)]);
+                ResetArena(scratch);
+                s64 traceStart = GetTraceTime();
+                work_type type = entry->type; // The entry can be reused when it's done.
+                s32 traceIndex = (type == WORK_RENDER_TILE ? entry->tileIndex : entryIndex);
+
+                switch(entry->type){
+                case WORK_RENDER_TILE:{
+                    frame_view *view = entry->view;
+                    COUNT_TIMED_PIXELS((entry->tileMax.x - entry->tileMin.x)*(entry->tileMax.y - entry->tileMin.y));
+                    BEGIN_TIMED_BLOCK(ZONE_RENDER_TILE);
+                    RenderTile(entry, scratch);
+                    END_TIMED_BLOCK(ZONE_RENDER_TILE);
+                    if (view->videoFormat != VIDEO_NONE){
+                        BEGIN_TIMED_BLOCK(ZONE_CONVERT_VIDEO);
+                        ConvertTileToVideo(view, entry);
+                        END_TIMED_BLOCK(ZONE_CONVERT_VIDEO);
+                    }
+                    InterlockedDecrement(&view->tilesLeft); // The last use of the entry, which can be reused after this.
+                } break;
+                case WORK_BAKE_SHADOW_CHUNK:{
+                    BEGIN_TIMED_BLOCK(ZONE_BAKE_SHADOWS);
+                    BakeShadowChunk(&gs->shadowCache, entry->shadowMapIndex, entry->shadowChunkIndex);
+                    END_TIMED_BLOCK(ZONE_BAKE_SHADOWS);
+                } break;
+                case WORK_PREPARE_BVH_CHUNK:{
+                    PrepareBvhChunk(entry->bvhBuilder, entry->bvhTaskIndex);
+                } break;
+                case WORK_BIN_BVH_CHUNK:{
+                    BinBvhChunk(entry->bvhBuilder, entry->bvhTaskIndex);
+                } break;
+                case WORK_BUILD_BVH_SUBTREE:{
+                    BuildBvhSubtree(entry->bvhBuilder, entry->bvhTaskIndex);
+                } break;
+                case WORK_ANIMATE_MESH_CHUNK:{
+                    AnimateMeshChunk(entry->animatedMesh, entry->meshChunkIndex, gs->sceneTime);
+                } break;
+                case WORK_REFIT_BVH_SUBTREE:{
+                    RefitBvhSubtree(entry->bvhRefit, entry->refitTaskIndex);
+                } break;
+                case WORK_MOVE_PARTICLES:{
+                    MoveParticleChunk(entry->particleCloud, entry->particleChunkIndex, gs->sceneTime);
+                } break;
+                case WORK_COUNT_PARTICLE_CELLS:{
+                    GridParticleChunk(entry->particleCloud, entry->particleChunkIndex, false);
+                } break;
+                case WORK_FILL_PARTICLE_CELLS:{
+                    GridParticleChunk(entry->particleCloud, entry->particleChunkIndex, true);
+                } break;
+                case WORK_ENCODE_IMAGE_STRIP:{
+                    EncodeImageStrip(entry->imageEncoder, entry->imageStripIndex, scratch);
+                } break;
+                }
+                TraceEvent(threadIndex, globalWorkEntryNames[type], traceStart, traceIndex);
+
+                InterlockedIncrement((volatile LONG *)(urgent ? &gs->completedUrgentEntries : &gs->completedEntriesCount));
+                break;
+            }// Else another thread changed incremented entryIndex. We'll need to try again.
+        }
+    }
+}
+
+// Sets up everything the frames need, and starts the worker threads with the first scene.
+void InitRenderer(){
+    auto gs = &globalState;
+
+    gs->camPos = INITIAL_CAM_POS;
+    gs->camAngleY = INITIAL_CAM_ANGLE_Y; // Rotation around Y axis (hand rule).
+    gs->camAngleX = INITIAL_CAM_ANGLE_X; // Rotation around X axis (hand rule).
+    gs->camNear = .001f;
+    gs->camFar = MAX_F32;
+    gs->fovY = DegreesToRadians(95.f);
+    
+    // Make test image
+    gs->frameDim = V2S(FRAME_BUFFER_WIDTH, FRAME_BUFFER_HEIGHT);
+    for(s32 i = 0; i < MAX_FRAMES_IN_FLIGHT; i++){
+        gs->views[i] = (frame_view *)VirtualAlloc(0, sizeof(frame_view), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        gs->views[i]->tiles = (u32 *)VirtualAlloc(0, MAX_TILES*MAX_TILE_PIXELS*sizeof(u32), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        gs->views[i]->video = (u8 *)VirtualAlloc(0, GetVideoFrameSize(VIDEO_RGB, V2S(FRAME_BUFFER_WIDTH, FRAME_BUFFER_HEIGHT)), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+    gs->frameBuffer = (u32 *)VirtualAlloc(0, gs->frameDim.x*gs->frameDim.y*sizeof(u32), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    // Init image memory
+    //for(s32 y = 0; y < gs->frameDim.y; y++){
+    //	for(s32 x = 0; x < gs->frameDim.x; x++){
+    //		v4 color = ColorFromHSV(((x + 200) % gs->frameDim.x)/(f32)(gs->frameDim.x - 1), y/(f32)(gs->frameDim.y - 1), y/(f32)(gs->frameDim.y - 1));
+    //		u8 *dest = &gs->imageData[(y*gs->frameDim.x + x)*3];
+    //		dest[0] = (u8)(color.r*255);
+    //		dest[1] = (u8)(color.g*255);
+    //		dest[2] = (u8)(color.b*255);
+    //	}
+    //}
+
+    gs->semaphoreEntriesToDo = CreateSemaphore(NULL, 0, ArrayCount(gs->entries) + ArrayCount(gs->urgentEntries), NULL);
+    InitArena(&gs->frameArena, FRAME_ARENA_SIZE);
+    for(s32 i = 0; i < NUM_WORKER_THREADS; i++){
+        InitArena(&gs->scratchArenas[i], SCRATCH_ARENA_SIZE);
+    }
+
+    _mm_sfence();
+
+    // Create worker threads
+    for(s32 i = 0; i < NUM_WORKER_THREADS; i++){
+        DWORD threadId = 0;
+        HANDLE thread = CreateThread(NULL, 0, ThreadProc, (void *)(umm)i, 0, &threadId);
+        if (!thread){
+            Printf("Error creating thread %i.\n", i);
+        }
+    }
+
+    gs->useShadowCache = true;
+    ChangeScene(gs->sceneIndex);
+}
+
+// Renders the tiles that the coordinator sends until it disconnects.
+int RunRenderWorker(char *host, char *port){
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0){
+        Printf("Couldn't start Winsock.\n");
+        return 1;
+    }
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    addrinfo *addresses = 0;
+    if (getaddrinfo(host, port, &hints, &addresses) != 0){
+        Printf("Couldn't resolve %s.\n", host);
+        return 1;
+    }
+    // Keep trying for a while, so the workers can be started before the coordinator.
+    SOCKET s = INVALID_SOCKET;
+    for(s32 attempt = 0; attempt < 20 && s == INVALID_SOCKET; attempt++){
+        if (attempt){
+            Sleep(500);
+        }
+        for(addrinfo *a = addresses; a && s == INVALID_SOCKET; a = a->ai_next){
+            s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (s != INVALID_SOCKET && connect(s, a->ai_addr, (int)a->ai_addrlen) == SOCKET_ERROR){
+                closesocket(s);
+                s = INVALID_SOCKET;
+            }
+        }
+    }
+    freeaddrinfo(addresses);
+    if (s == INVALID_SOCKET){
+        Printf("Couldn't connect to the coordinator at %s:%s.\n", host, port);
+        return 1;
+    }
+    SetSocketNoDelay(s);
+    Printf("Connected to the coordinator at %s:%s.\n", host, port);
+
+    InitRenderer();
+    net_hello_message hello = {NET_MAGIC, NUM_WORKER_THREADS};
+    if (SendAll(s, &hello, sizeof(hello))){
+        while(RenderWorkerFrame(s));
+    }
+    Printf("Disconnected from the coordinator.\n");
+    closesocket(s);
+    return 0;
+}
+
+//
+// Render server
+//
+
+// With -server [port], the program renders frames for other programs instead of showing a window: it keeps
+// the scene loaded and the threads waiting, and clients connected over TCP send it server_request messages
+// whenever they want a frame. The requests of all the clients wait in one queue, and the one with the highest
+// priority is rendered first (with ties going to the ones that don't need to change the scene, and then to
+// the oldest). Requests for the same view are batched: it's rendered once and sent to all of them. Each frame
+// is sent back as a server_response followed by the frame as a PNG or QOI file, encoded by the worker threads
+// once per format, or as the RGBX pixels row by row from the bottom one if the request asks for them.
+// The responses are queued in a buffer per client that's sent as the client reads it, so a slow client
+// doesn't stall the others. A client whose buffer would grow past SERVER_MAX_OUTGOING_SIZE, or that hasn't
+// read anything for SERVER_STALL_SECONDS, is dropped.
+#define SERVER_MAGIC 0x56535452 // "RTSV"
+#define SERVER_DEFAULT_PORT "27961"
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_MAX_REQUESTS 256
+#define SERVER_MAX_OUTGOING_SIZE Megabytes(16)
+#define SERVER_STALL_SECONDS 5.f
+
+enum server_format{
+    SERVER_PNG,
+    SERVER_QOI,
+    SERVER_RAW, // RGBX, 4 bytes per pixel, from the bottom row.
+    SERVER_NUM_FORMATS,
+};
+
+struct server_request{
+    u32 magic;
+    u32 requestId; // Chosen by the client, it comes back in the response.
+    s32 priority; // Higher first.
+    s32 sceneIndex;
+    f32 sceneTime;
+    v3 camPos;
+    f32 camAngleX;
+    f32 camAngleY;
+    f32 fovY; // Between 0 and PI.
+    v2s frameDim; // Up to FRAME_BUFFER_WIDTH x FRAME_BUFFER_HEIGHT.
+    u32 format; // server_format
+};
+
+// Followed by dataSize bytes of the frame in the format of the request. A frameDim of 0 (and no data)
+// means that the request was invalid.
+struct server_response{
+    u32 magic;
+    u32 requestId;
+    v2s frameDim;
+    u32 format;
+    u32 dataSize;
+    f32 waitSeconds; // From the arrival of the request to the start of its frame.
+    f32 renderSeconds;
+};
+
+struct server_client{
+    SOCKET socket; // INVALID_SOCKET if the slot is free.
+    u8 buffer[sizeof(server_request)]; // The request being received.
+    s32 bufferSize;
+
+    // The responses that haven't been sent yet, from outgoing + outgoingSent to outgoing + outgoingSize.
+    u8 *outgoing;
+    umm outgoingSize;
+    umm outgoingSent;
+    umm outgoingCapacity;
+    LARGE_INTEGER lastSendTime; // When the client last read something, or its first response was queued.
+};
+
+struct server_pending_request{
+    server_request request;
+    s32 clientIndex;
+    LARGE_INTEGER arrivalTime;
+};
+
+struct render_server{
+    SOCKET listener;
+    server_client clients[SERVER_MAX_CLIENTS];
+    server_pending_request pending[SERVER_MAX_REQUESTS];
+    s32 numPending;
+    image_encoder encoders[SERVER_RAW]; // PNG and QOI.
+
+    // Stats since the last report.
+    LARGE_INTEGER reportTime;
+    s32 numServed;
+    s32 numFrames;
+    f32 sumLatency;
+    f32 maxLatency;
+};
+
+inline b32 SameView(server_request *a, server_request *b){
+    b32 result = (a->sceneIndex == b->sceneIndex && a->sceneTime == b->sceneTime && a->camPos == b->camPos &&
+                  a->camAngleX == b->camAngleX && a->camAngleY == b->camAngleY && a->fovY == b->fovY && a->frameDim == b->frameDim);
+    return result;
+}
+
+b32 IsValidRequest(server_request *request){
+    b32 result = (request->frameDim.x > 0 && request->frameDim.x <= FRAME_BUFFER_WIDTH && request->frameDim.y > 0 && request->frameDim.y <= FRAME_BUFFER_HEIGHT &&
+                  request->sceneIndex >= 0 && request->sceneIndex < NUM_SCENES &&
+                  request->format < SERVER_NUM_FORMATS &&
+                  request->fovY > 0 && request->fovY < PI && // False for NaN.
+                  IsFinite(request->sceneTime) && IsFinite(request->camPos) && IsFinite(request->camAngleX) && IsFinite(request->camAngleY));
+    return result;
+}
+
+void DropClient(render_server *server, s32 clientIndex){
+    server_client *client = &server->clients[clientIndex];
+    closesocket(client->socket);
+    client->socket = INVALID_SOCKET;
+    if (client->outgoing){
+        DeallocateMemory(client->outgoing);
+        client->outgoing = 0;
+    }
+    for(s32 i = 0; i < server->numPending; i++){
+        if (server->pending[i].clientIndex == clientIndex){
+            server->pending[i--] = server->pending[--server->numPending];
+        }
+    }
+}
+
+// Queues the response for SendServerResponses(), and returns where its response->dataSize bytes of data go.
+// Drops the client and returns 0 if it has too much unsent.
+u8 *SendResponse(render_server *server, server_pending_request *p, server_response *response){
+    s32 clientIndex = p->clientIndex;
+    server_client *client = &server->clients[clientIndex];
+    response->requestId = p->request.requestId;
+    umm size = sizeof(*response) + response->dataSize;
+    umm unsent = client->outgoingSize - client->outgoingSent;
+    if (unsent + size > SERVER_MAX_OUTGOING_SIZE){
+        Printf("Dropping a client that isn't reading its frames.\n");
+        DropClient(server, clientIndex);
+        return 0;
+    }
+    if (client->outgoingSent){ // Moving the unsent bytes to the start.
+        memmove(client->outgoing, client->outgoing + client->outgoingSent, unsent);
+        client->outgoingSize = unsent;
+        client->outgoingSent = 0;
+    }
+    if (client->outgoingSize + size > client->outgoingCapacity){
+        umm capacity = 2*client->outgoingCapacity;
+        if (capacity < client->outgoingSize + size){
+            capacity = client->outgoingSize + size;
+        }
+        u8 *outgoing = AllocateMemory(capacity);
+        if (client->outgoing){
+            memcpy(outgoing, client->outgoing, client->outgoingSize);
+            DeallocateMemory(client->outgoing);
+        }
+        client->outgoing = outgoing;
+        client->outgoingCapacity = capacity;
+    }
+    if (!unsent){
+        client->lastSendTime = GetCurrentTimeCounter();
+    }
+    u8 *result = client->outgoing + client->outgoingSize;
+    memcpy(result, response, sizeof(*response));
+    client->outgoingSize += size;
+    return result + sizeof(*response);
+}
+
+// Sends what each client can take without blocking, and drops the ones that have stopped reading.
+void SendServerResponses(render_server *server){
+    LARGE_INTEGER now = GetCurrentTimeCounter();
+    for(s32 i = 0; i < SERVER_MAX_CLIENTS; i++){
+        server_client *client = &server->clients[i];
+        while(client->socket != INVALID_SOCKET && client->outgoingSent < client->outgoingSize){
+            s32 size = (s32)(client->outgoingSize - client->outgoingSent); // Less than SERVER_MAX_OUTGOING_SIZE.
+            s32 sent = send(client->socket, (char *)client->outgoing + client->outgoingSent, size, 0);
+            if (sent == SOCKET_ERROR){
+                if (WSAGetLastError() != WSAEWOULDBLOCK){
+                    DropClient(server, i);
+                }else if (GetSecondsElapsed(client->lastSendTime, now) > SERVER_STALL_SECONDS){
+                    Printf("Dropping a client that isn't reading its frames.\n");
+                    DropClient(server, i);
+                }
+                break;
+            }
+            client->outgoingSent += sent;
+            client->lastSendTime = now;
+        }
+    }
+}
+
+// Accepts new clients and queues the requests that arrived, while there's space for them.
+void ReceiveServerRequests(render_server *server){
+    while(1){
+        SOCKET s = accept(server->listener, 0, 0);
+        if (s == INVALID_SOCKET)
+            break;
+        s32 clientIndex = 0;
+        while(clientIndex < SERVER_MAX_CLIENTS && server->clients[clientIndex].socket != INVALID_SOCKET){
+            clientIndex++;
+        }
+        u_long nonBlocking = 1;
+        if (clientIndex == SERVER_MAX_CLIENTS || ioctlsocket(s, FIONBIO, &nonBlocking) == SOCKET_ERROR){
+            closesocket(s);
+            continue;
+        }
+        SetSocketNoDelay(s);
+        server_client *client = &server->clients[clientIndex];
+        ZeroStruct(client); // Its outgoing buffer was freed when the previous client was dropped.
+        client->socket = s;
+    }
+
+    for(s32 i = 0; i < SERVER_MAX_CLIENTS; i++){
+        server_client *client = &server->clients[i];
+        while(client->socket != INVALID_SOCKET && server->numPending < SERVER_MAX_REQUESTS){
+            s32 received = recv(client->socket, (char *)client->buffer + client->bufferSize, sizeof(server_request) - client->bufferSize, 0);
+            if (received == 0 || (received == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)){
+                DropClient(server, i);
+                break;
+            }
+            if (received == SOCKET_ERROR)
+                break;
+            client->bufferSize += received;
+            if (client->bufferSize < sizeof(server_request))
+                continue;
+            client->bufferSize = 0;
+
+            server_request *request = (server_request *)client->buffer;
+            if (request->magic != SERVER_MAGIC){
+                DropClient(server, i);
+                break;
+            }
+            server_pending_request *p = &server->pending[server->numPending++];
+            p->request = *request;
+            p->clientIndex = i;
+            p->arrivalTime = GetCurrentTimeCounter();
+        }
+    }
+}
+
+// Renders the most urgent request, and answers all the ones with the same view.
+void ServeNextRequest(render_server *server){
+    auto gs = &globalState;
+    s32 best = 0;
+    for(s32 i = 1; i < server->numPending; i++){
+        server_request *a = &server->pending[i].request;
+        server_request *b = &server->pending[best].request;
+        if (a->priority != b->priority){
+            if (a->priority > b->priority){
+                best = i;
+            }
+        }else if ((a->sceneIndex == gs->sceneIndex) != (b->sceneIndex == gs->sceneIndex)){
+            if (a->sceneIndex == gs->sceneIndex){
+                best = i;
+            }
+        }else if (server->pending[i].arrivalTime.QuadPart < server->pending[best].arrivalTime.QuadPart){
+            best = i;
+        }
+    }
+    server_request request = server->pending[best].request;
+    server_response response = {SERVER_MAGIC};
+
+    if (!IsValidRequest(&request)){
+        server_pending_request p = server->pending[best];
+        server->pending[best] = server->pending[--server->numPending];
+        SendResponse(server, &p, &response);
+        return;
+    }
+
+    LARGE_INTEGER startTime = GetCurrentTimeCounter();
+    if (request.sceneIndex != gs->sceneIndex){
+        ChangeScene(request.sceneIndex);
+    }
+    frame_view *view = gs->views[0];
+    PrepareScene(request.sceneTime);
+    PrepareView(view, request.camPos, request.camAngleX, request.camAngleY, request.fovY, request.frameDim);
+    BeginWorkEntries();
+    for(s32 tileIndex = 0; tileIndex < view->numTiles.x*view->numTiles.y; tileIndex++){
+        AddTileEntry(view, tileIndex);
+    }
+    PostWorkEntries();
+    WaitForWorkEntries();
+    DetileFrame(view, gs->frameBuffer);
+    LARGE_INTEGER endTime = GetCurrentTimeCounter();
+
+    response.frameDim = request.frameDim;
+    response.renderSeconds = GetSecondsElapsed(startTime, endTime);
+    server->numFrames++;
+
+    // Each format is encoded the first time a request asks for it.
+    b32 encoded[SERVER_NUM_FORMATS] = {};
+    u32 dataSizes[SERVER_NUM_FORMATS] = {};
+    encoded[SERVER_RAW] = true;
+    dataSizes[SERVER_RAW] = request.frameDim.x*request.frameDim.y*sizeof(u32);
+    for(s32 i = 0; i < server->numPending;){
+        if (!SameView(&server->pending[i].request, &request)){
+            i++;
+            continue;
+        }
+        server_pending_request p = server->pending[i];
+        server->pending[i] = server->pending[--server->numPending];
+        server_format format = (server_format)p.request.format;
+        if (!encoded[format]){
+            image_encoder *encoder = &server->encoders[format];
+            u8 *topRow = (u8 *)&gs->frameBuffer[(request.frameDim.y - 1)*request.frameDim.x];
+            BeginImage(encoder, topRow, request.frameDim, -request.frameDim.x*(s32)sizeof(u32), sizeof(u32)); // Always fits.
+            FinishImage(encoder);
+            dataSizes[format] = (u32)GetEncodedImageSize(encoder);
+            encoded[format] = true;
+        }
+        response.format = format;
+        response.dataSize = dataSizes[format];
+        response.waitSeconds = GetSecondsElapsed(p.arrivalTime, startTime);
+        f32 latency = GetSecondsElapsed(p.arrivalTime, endTime);
+        server->numServed++;
+        server->sumLatency += latency;
+        server->maxLatency = Max(server->maxLatency, latency);
+        u8 *data = SendResponse(server, &p, &response);
+        if (data && format == SERVER_RAW){
+            memcpy(data, gs->frameBuffer, response.dataSize);
+        }else if (data){
+            CopyEncodedImage(&server->encoders[format], data);
+        }
+        i = 0; // Dropping a client reorders the queue.
+    }
+}
+
+int RunRenderServer(char *port){
+    render_server *server = (render_server *)AllocateMemory(sizeof(render_server));
+    ZeroStruct(server);
+    server->listener = ListenOnPort(port);
+    if (server->listener == INVALID_SOCKET)
+        return 1;
+    for(s32 i = 0; i < SERVER_MAX_CLIENTS; i++){
+        server->clients[i].socket = INVALID_SOCKET;
+    }
+    InitImageEncoder(&server->encoders[SERVER_PNG], IMAGE_PNG);
+    InitImageEncoder(&server->encoders[SERVER_QOI], IMAGE_QOI);
+    InitRenderer();
+    Printf("Render server listening on port %s.\n", port);
+
+    server->reportTime = GetCurrentTimeCounter();
+    while(1){
+        ReceiveServerRequests(server);
+        SendServerResponses(server);
+        if (server->numPending){
+            ServeNextRequest(server);
+        }else{
+            Sleep(1);
+        }
+
+        f32 sinceReport = GetSecondsElapsed(server->reportTime, GetCurrentTimeCounter());
+        if (sinceReport > 1.f && server->numServed){
+            Printf("Served %i requests with %i frames in %.2fs, latency %.2fms on average, %.2fms at most, %i queued.\n",
+                   server->numServed, server->numFrames, sinceReport, 1000.f*server->sumLatency/server->numServed, 1000.f*server->maxLatency, server->numPending);
+            server->reportTime = GetCurrentTimeCounter();
+            server->numServed = 0;
+            server->numFrames = 0;
+            server->sumLatency = 0;
+            server->maxLatency = 0;
+        }
+    }
+}
+
+//
+// Batches
+//
+
+// For offline jobs with many views of the same scene at the same time. Instead of waiting for each frame to
+// finish before preparing the next one, which leaves threads idle while the last tiles of a frame are
+// rendered, RenderBatch() keeps MAX_FRAMES_IN_FLIGHT views with their tiles in the work queue: when the
+// oldest one is done, its frame goes to the output and the next view takes its place at the end of the queue.
+#define VIDEO_FRAME_RATE 30 // Of the Y4M streams, the views are taken as consecutive frames.
+#define VIDEO_PIPE_BUFFER_SIZE (4 << 20)
+
+struct batch_view{
+    v3 camPos;
+    f32 camAngleX;
+    f32 camAngleY;
+};
+
+// Gets the frames in the order of the views, in 'view->video' (see ConvertTileToVideo()), which is only
+// valid during the call. Returns false to stop the batch.
+typedef b32 batch_output(s32 viewIndex, frame_view *view, void *outputData);
+
+// Returns false if the output failed, then the views after that one aren't rendered.
+b32 RenderBatch(batch_view *views, s32 numViews, f32 sceneTime, f32 fovY, v2s frameDim, video_format videoFormat, batch_output *output, void *outputData){
+    auto gs = &globalState;
+    s32 tilesPerView = ((frameDim.x + TILE_SIZE - 1)/TILE_SIZE)*((frameDim.y + TILE_SIZE - 1)/TILE_SIZE);
+    Assert(MAX_FRAMES_IN_FLIGHT*tilesPerView <= MAX_WORK_ENTRIES);
+    LARGE_INTEGER startTime = GetCurrentTimeCounter();
+
+    PrepareScene(sceneTime);
+    BeginWorkEntries();
+    s32 numQueued = 0;
+    s32 numDone = 0;
+    b32 stopped = false;
+    while(numDone < numQueued || (numQueued < numViews && !stopped)){
+        while(numQueued < numViews && numQueued - numDone < MAX_FRAMES_IN_FLIGHT && !stopped){
+            // The view of this slot finished, so its entries in the queue can be reused too.
+            frame_view *view = gs->views[numQueued % MAX_FRAMES_IN_FLIGHT];
+            batch_view *v = &views[numQueued];
+            PrepareView(view, v->camPos, v->camAngleX, v->camAngleY, fovY, frameDim);
+            view->videoFormat = videoFormat;
+            s32 firstEntry = gs->numEntries;
+            for(s32 tileIndex = 0; tileIndex < tilesPerView; tileIndex++){
+                AddTileEntry(view, tileIndex);
+            }
+            PostMoreWorkEntries(firstEntry);
+            numQueued++;
+        }
+
+        // The output is written while the workers render the other views in flight.
+        frame_view *oldest = gs->views[numDone % MAX_FRAMES_IN_FLIGHT];
+        while(oldest->tilesLeft){
+            Sleep(0);
+        }
+        _mm_lfence();
+        if (!stopped && !output(numDone, oldest, outputData)){
+            stopped = true; // Let the views in flight finish, but don't queue any more.
+            Printf("Batch: stopped at view %i, its output can't be written.\n", numDone);
+        }
+        numDone++;
+    }
+    for(s32 i = 0; i < MAX_FRAMES_IN_FLIGHT; i++){
+        gs->views[i]->videoFormat = VIDEO_NONE;
+    }
+
+    f32 seconds = GetSecondsElapsed(startTime, GetCurrentTimeCounter());
+    Printf("Batch: %i views in %.2fs, %.2fms per view.\n", numDone, seconds, 1000.f*seconds/MaxS32(numDone, 1));
+    return !stopped;
+}
+
+// Reads the views of a batch from a text file with a line per view: the camera position and its angles
+// around X and Y. Returns 0 if it can't be read. It must be freed with DeallocateMemory().
+batch_view *LoadBatchViews(char *path, s32 *numViews){
+    umm size;
+    char *text = ReadEntireFile(path, &size);
+    if (!text){
+        Printf("Batch: can't read %s\n", path);
+        return 0;
+    }
+    s32 maxViews = 1;
+    for(char *at = text; *at; at++){
+        maxViews += (*at == '\n');
+    }
+    batch_view *views = (batch_view *)AllocateMemory(maxViews*sizeof(batch_view));
+    *numViews = 0;
+    for(char *line = text; *line; line = NextLine(line)){
+        f32 values[5];
+        s32 numValues = 0;
+        char *at = line;
+        for(; numValues < 5; numValues++){
+            while(IsObjSpace(*at))
+                at++;
+            char *start = at;
+            if (*start == '\r' || *start == '\n') // strtof() would skip to the next line.
+                break;
+            values[numValues] = strtof(start, &at);
+            if (at == start)
+                break;
+        }
+        if (numValues == 5){ // Other lines (empty ones, comments) are skipped.
+            batch_view *view = &views[(*numViews)++];
+            view->camPos = V3(values[0], values[1], values[2]);
+            view->camAngleX = values[3];
+            view->camAngleY = values[4];
+        }
+    }
+    DeallocateMemory(text);
+    return views;
+}
+
+struct batch_images{
+    char *directory;
+    image_encoder encoder;
+};
+
+// Writes each frame of a batch as an image file in a directory. The frames are in VIDEO_RGB.
+b32 WriteBatchFrame(s32 viewIndex, frame_view *view, void *outputData){
+    batch_images *images = (batch_images *)outputData;
+    char *extensions[] = {"ppm", "png", "qoi"};
+    char path[512];
+    sprintf_s(path, "%s/%05i.%s", images->directory, viewIndex, extensions[images->encoder.format]);
+    b32 result = WriteImage(&images->encoder, view->video, view->frameDim, view->frameDim.x*3, 3, path);
+    return result;
+}
+
+// A Y4M or raw RGB stream of the frames of a batch, for encoders like "ffmpeg -i -". Raw RGB has no
+// header, so the reader has to be told the format (-f rawvideo -pix_fmt rgb24 -s 640x480).
+struct video_stream{
+    HANDLE file;
+    video_format format;
+};
+
+b32 WriteVideoFrame(s32 viewIndex, frame_view *view, void *outputData){
+    video_stream *stream = (video_stream *)outputData;
+    b32 written = true;
+    DWORD bytesWritten;
+    if (stream->format == VIDEO_YUV420){
+        written = WriteFile(stream->file, "FRAME\n", 6, &bytesWritten, 0);
+    }
+    u8 *at = view->video;
+    umm size = GetVideoFrameSize(stream->format, view->frameDim);
+    while(written && size){ // Pipes can take less than what's written.
+        written = (WriteFile(stream->file, at, (DWORD)size, &bytesWritten, 0) && bytesWritten);
+        at += bytesWritten;
+        size -= bytesWritten;
+    }
+    if (!written){
+        Printf("Stream: can't write frame %i, the reader may have closed the stream.\n", viewIndex);
+    }
+    return written;
+}
+
+// 'output' is a directory for image files, a file, a named pipe (\\.\pipe\name, which is created and waits for
+// a reader), or "-" for the standard output.
+int RunBatch(char *viewsPath, s32 sceneIndex, f32 sceneTime, image_format imageFormat, video_format videoFormat, char *output, HANDLE standardOutput){
+    auto gs = &globalState;
+    s32 numViews = 0;
+    batch_view *views = LoadBatchViews(viewsPath, &numViews);
+    if (!views)
+        return 1;
+    gs->sceneIndex = (sceneIndex >= 0 && sceneIndex < NUM_SCENES ? sceneIndex : 0);
+    InitRenderer();
+    v2s frameDim = gs->frameDim;
+    if (videoFormat == VIDEO_YUV420 && (frameDim.x % 2 || frameDim.y % 2)){
+        Printf("Stream: Y4M needs even frame dimensions, not %ix%i.\n", frameDim.x, frameDim.y);
+        return 1;
+    }
+
+    b32 written = true;
+    if (videoFormat == VIDEO_NONE){
+        batch_images images = {};
+        images.directory = output;
+        InitImageEncoder(&images.encoder, imageFormat);
+        CreateDirectoryA(output, 0);
+        written = RenderBatch(views, numViews, sceneTime, gs->fovY, frameDim, VIDEO_RGB, WriteBatchFrame, &images);
+        FreeImageEncoder(&images.encoder);
+    }else{
+        video_stream stream = {};
+        stream.format = videoFormat;
+        if (!strcmp(output, "-")){
+            stream.file = standardOutput;
+        }else if (!strncmp(output, "\\\\.\\pipe\\", 9)){
+            stream.file = CreateNamedPipeA(output, PIPE_ACCESS_OUTBOUND, PIPE_TYPE_BYTE | PIPE_WAIT, 1, VIDEO_PIPE_BUFFER_SIZE, 0, 0, 0);
+            if (stream.file != INVALID_HANDLE_VALUE){
+                Printf("Stream: waiting for a reader on %s\n", output);
+                if (!ConnectNamedPipe(stream.file, 0) && GetLastError() != ERROR_PIPE_CONNECTED){
+                    CloseHandle(stream.file);
+                    stream.file = INVALID_HANDLE_VALUE;
+                }
+            }
+        }else{
+            stream.file = CreateFileA(output, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 0, 0);
+        }
+        if (!stream.file || stream.file == INVALID_HANDLE_VALUE){
+            Printf("Stream: can't open %s\n", output);
+            return 1;
+        }
+
+        if (videoFormat == VIDEO_YUV420){
+            char header[128];
+            s32 headerSize = sprintf_s(header, "YUV4MPEG2 W%i H%i F%i:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n", frameDim.x, frameDim.y, VIDEO_FRAME_RATE);
+            DWORD bytesWritten;
+            written = WriteFile(stream.file, header, headerSize, &bytesWritten, 0);
+        }
+        if (written){
+            written = RenderBatch(views, numViews, sceneTime, gs->fovY, frameDim, videoFormat, WriteVideoFrame, &stream);
+        }else{
+            Printf("Stream: can't write the header to %s\n", output);
+        }
+        if (stream.file != standardOutput){
+            FlushFileBuffers(stream.file);
+            CloseHandle(stream.file);
+        }
+    }
+    DeallocateMemory(views);
+    CollectProfile(numViews);
+    PrintProfile();
+    FinishTrace();
+    return (written ? 0 : 1);
+}
+
+//
+// Shared frame ring
+//
+
+// With -present shm, there's no window: the frames are published in a ring of slots in shared
+// memory (a named file mapping), for viewers, encoders or tests in other processes that map it too. The
+// frames are detiled straight into their slot, and readers can use them in place: the last published frame
+// is in the slot (sequence - 1) % numSlots, and it's still valid while the sequence of its slot doesn't change
+// (the writer clears it before writing to the slot again, which happens numSlots - 1 frames later).
+// There's one writer per ring: a mapping that already exists is refused instead of reset, since another
+// program is publishing in it, or readers still have the old one.
+#define FRAME_RING_MAGIC 0x474e5246 // "FRNG"
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_SLOTS 3
+#define FRAME_RING_DEFAULT_NAME "Local\\RayTracerFrames"
+
+// At the start of the mapping.
+struct frame_ring_header{
+    u32 magic;
+    u32 version;
+    u32 numSlots;
+    u32 firstSlotOffset; // From the start of the mapping.
+    u32 slotSize; // Bytes from a slot to the next.
+    v2s maxFrameDim;
+    volatile LONG64 sequence; // Of the last published frame, starting at 1. 0 if there isn't one yet.
+};
+
+// At the start of each slot, followed by the pixels: frameDim.x*frameDim.y RGBX pixels, row-major from the
+// bottom row.
+struct frame_ring_slot{
+    volatile LONG64 sequence; // Of the frame in the slot, 0 while it's being written.
+    v2s frameDim;
+    f32 sceneTime;
+    s32 sceneIndex;
+    u8 padding[40]; // The pixels start at a cache line.
+};
+
+struct frame_ring{
+    HANDLE mapping;
+    frame_ring_header *header;
+    s64 numPublished;
+};
+
+b32 OpenFrameRing(frame_ring *ring, char *name, v2s maxFrameDim){
+    u32 slotSize = ((u32)(sizeof(frame_ring_slot) + maxFrameDim.x*maxFrameDim.y*sizeof(u32)) + 4095) & ~4095u; // Whole pages.
+    u32 firstSlotOffset = 4096;
+    u64 size = firstSlotOffset + (u64)FRAME_RING_SLOTS*slotSize;
+    ring->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, name);
+    if (!ring->mapping){
+        Printf("Frame ring: can't create the mapping %s.\n", name);
+        return false;
     }
-    return t;
+    if (GetLastError() == ERROR_ALREADY_EXISTS){
+        Printf("Frame ring: %s already exists, close the programs that use it or pick another name.\n", name);
+        CloseHandle(ring->mapping);
+        ring->mapping = 0;
+        return false;
+    }
+    ring->header = (frame_ring_header *)MapViewOfFile(ring->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!ring->header){
+        Printf("Frame ring: can't map %s.\n", name);
+        CloseHandle(ring->mapping);
+        ring->mapping = 0;
+        return false;
+    }
+    frame_ring_header *header = ring->header;
+    header->magic = 0; // Not valid until it's all set.
+    header->sequence = 0;
+    for(u32 i = 0; i < FRAME_RING_SLOTS; i++){
+        frame_ring_slot *slot = (frame_ring_slot *)((u8 *)header + firstSlotOffset + i*slotSize);
+        slot->sequence = 0;
+    }
+    header->version = FRAME_RING_VERSION;
+    header->numSlots = FRAME_RING_SLOTS;
+    header->firstSlotOffset = firstSlotOffset;
+    header->slotSize = slotSize;
+    header->maxFrameDim = maxFrameDim;
+    CompletePreviousWritesBeforeFutureWrites;
+    header->magic = FRAME_RING_MAGIC;
+    ring->numPublished = 0;
+    return true;
 }
-inline v3 NormalPlane(){
-    v3 n = {0, 1.f, 0};
-    return n;
+
+// Returns where the pixels of the next frame go, in a slot that readers can't use until it's published.
+u32 *BeginFrameRingSlot(frame_ring *ring, v2s frameDim, f32 sceneTime, s32 sceneIndex){
+    frame_ring_header *header = ring->header;
+    Assert(frameDim.x <= header->maxFrameDim.x && frameDim.y <= header->maxFrameDim.y);
+    frame_ring_slot *slot = (frame_ring_slot *)((u8 *)header + header->firstSlotOffset + (ring->numPublished % header->numSlots)*header->slotSize);
+    slot->sequence = 0;
+    CompletePreviousWritesBeforeFutureWrites;
+    slot->frameDim = frameDim;
+    slot->sceneTime = sceneTime;
+    slot->sceneIndex = sceneIndex;
+    return (u32 *)(slot + 1);
 }
 
-struct shape_material{
-    v3 color;
-    f32 reflectivity;
-};
-inline shape_material ShapeMaterial(v3 color, f32 reflectivity){
-    shape_material result = {color, reflectivity};
-    return result;
+void PublishFrameRingSlot(frame_ring *ring){
+    frame_ring_header *header = ring->header;
+    frame_ring_slot *slot = (frame_ring_slot *)((u8 *)header + header->firstSlotOffset + (ring->numPublished % header->numSlots)*header->slotSize);
+    ring->numPublished++;
+    CompletePreviousWritesBeforeFutureWrites; // The pixels before the sequence (x86 doesn't reorder stores).
+    slot->sequence = ring->numPublished;
+    header->sequence = ring->numPublished;
 }
 
-// Worker thread entry point
-DWORD WINAPI ThreadProc(void *param){
-    auto gs = &globalState;
-    while(1){
-        WaitForSingleObject(gs->semaphoreEntriesToDo, INFINITE);
 
-        while(1){
-            s32 entryIndex = gs->nextEntry;
-            if (InterlockedCompareExchange((volatile LONG *)&gs->nextEntry, (LONG)entryIndex + 1, (LONG)entryIndex) == entryIndex){
-                work_entry *entry = &gs->entries[entryIndex];
+//
+// Presentation
+//
 
-                //
-                // Render our xframe rows
-                //
-                v2 worldFrameDim;
-                worldFrameDim.y = Tan(gs->fovY/2);
-                worldFrameDim.x = worldFrameDim.y*(gs->frameDim.x/(f32)gs->frameDim.y);
-
-                for(s32 y = entry->firstRowY; y < entry->firstRowY + entry->numRows; y++){
-                    for(s32 x = 0; x < gs->frameDim.x; x++){
-                        v2 uv = {(f32)x/gs->frameDim.x, (f32)y/gs->frameDim.y}; // [0, 1]
-                        u8 *pixel = &gs->frameBuffer[3*(y*gs->frameDim.x + x)];
-
-                        // Ray
-                        v3 ro = gs->frameCamPos;//V3(0, 2, -15.f);
-                        //v3 rd = NormalizeNonZero(V3((-1.f + 2.f*uv.x)*worldFrameDim.x, (-1.f + 2.f*uv.y)*worldFrameDim.y, 1.f));
-                        v3 rd = NormalizeNonZero(gs->frameCamForward + (-1.f + 2.f*uv.x)*gs->frameCamRight*worldFrameDim.x/2 + (-1.f + 2.f*uv.y)*gs->frameCamUp*worldFrameDim.y/2);
-
-                        // Intersection with all objects
-                        sphere spheres[6] = { { V3(0), 5.f },
-                                              { V3(0, 6.f, 0), 3.f },
-                                              { V3(8.f, 0, 0), 2.f },
-                                              { V3(9.2f, 4.f, 1.f), 1.8f },
-                                              { V3(0, 15.f, 0), 2.5f }, // light source
-                                              { gs->frameCamPos, 1.5f }}; // Camera
-                                              
-                        v3 pointLightPos = spheres[4].c;
-
-                        shape_material materials[12]; // Subscript is the shape index
-                        materials[1] = ShapeMaterial(V3(.5f), 1.f); // Sphere 1
-                        materials[2] = ShapeMaterial(V3(1.f, .3f, .3f), 1.f); // Sphere 2
-                        materials[3] = ShapeMaterial(V3(.3f, 1.f, .5f), 1.f); // Sphere 3
-                        materials[4] = ShapeMaterial(V3(.3f, .3f, .9f), .5f); // Sphere 4
-                        materials[5] = ShapeMaterial(V3(1.f, 1.f, 1.f), 0); // Sphere 5
-                        materials[6] = ShapeMaterial(V3(.3f, .3f, .3f), 0); // Sphere 6 (Camera)
-                        materials[10] = ShapeMaterial(V3(.5f, .8f, .4f), 0); // Plane
-
-                        f32 tSphere[ArrayCount(spheres)];
-                        for(s32 i = 0; i < ArrayCount(spheres); i++){
-                            tSphere[i] = IntersectSphere(spheres[i], ro, rd);
-                        }
+// Where the finished frames go. The window shows them with OpenGL, and its input moves the camera. The others
+// don't make a window or a GL context, and render the frames one after another as fast as they can: files
+// writes each one to a directory, shm publishes them in the frame ring, and null throws them away, to measure
+// how fast the frames are rendered without anything else.
+enum presenter_type{
+    PRESENTER_WINDOW,
+    PRESENTER_FILES,
+    PRESENTER_SHARED_MEMORY,
+    PRESENTER_NULL,
+};
 
-                        f32 tPlane   = IntersectPlane(0, ro, rd);
-                        s32 shapeIndex = 0;
+struct presenter;
+// Called with each frame when it's done, before the next one begins. Returns false if it can't be presented.
+typedef b32 present_frame(presenter *p, frame_view *view);
 
-                        f32 t = gs->camFar;
-                        for(s32 i = 0; i < ArrayCount(spheres); i++){
-                            if (tSphere[i] > gs->camNear && tSphere[i] < t){
-                                t = tSphere[i];
-                                shapeIndex = 1 + i;
-                            }
-                        }
-                        if (tPlane > gs->camNear && tPlane < t){
-                            t = tPlane;
-                            shapeIndex = 10;
-                        }
+struct vertex_data{
+    v2 pos;
+    v2 texPos;
+};
 
-                        //
-                        // Color
-                        //
-                        v3 col = {0};
-                        if (shapeIndex){
-                            v3 n = {};
-                            v3 p = ro + t*rd;
-                            f32 emit = 0;
-                            v3 shapeCol = materials[shapeIndex].color;
-                            f32 reflectivity = materials[shapeIndex].reflectivity;
-                            if (shapeIndex >= 1 && shapeIndex <= ArrayCount(spheres)){ // Spheres
-                                n = NormalSphere(spheres[shapeIndex - 1], p);
-                                emit = (shapeIndex == 5);
-                            }else if (shapeIndex == 10){ // Plane
-                                n = NormalPlane();
-                            }
-                            
-                            // NOTE: The "pointLight" is actually spherical now. I just didn't bother to change the variable names hehe.
-                            f32 pointLightLength = Length(pointLightPos - p);
-                            f32 pointLight = 10.f/SQUARE(pointLightLength) + 5.f/pointLightLength; // Light strength based on distance
-                            v3 pointLightDir = Normalize(pointLightPos - p);
-                            pointLight *= Max(0, Dot(n, pointLightDir)); // Reduce strength based on angle.
-                            pointLight *= Clamp01(MapRangeTo01(pointLight, .002f, .01f)); // Unnoticeable falloff for performance.
-                            if (pointLight){
-                                f32 pointLightRadius = spheres[4].r;
-
-                                // Hard shadows: just one ray.
-#if 0
-                                f32 shadowT = pointLightLength;
-                                for(s32 i = 0; i < ArrayCount(spheres); i++){
-                                    if (i == 4) continue;
-                                    f32 t = IntersectSphere(spheres[i], p, pointLightDir);
-                                    if (t > .001f && t < shadowT){
-                                        shadowT = t;
-                                    }
-                                }
-                                f32 l = (shadowT < pointLightLength ? 0 : 1.f);
-#endif
+struct presenter{
+    presenter_type type;
+    present_frame *present;
 
-                                // Old way: Average of multiple rays.
-#if 0
-                                s32 numRays = 25;
-                                s32 occludedRaysCount = 0;
-                                for(s32 rayIndex = 0; rayIndex < numRays; rayIndex++){
-                                    v3 rayDir = pointLightDir;
-                                    if (rayIndex){
-                                        // Shoot rays in different directions
-                                        v3 px = Perpendicular(pointLightDir);
-                                        v3 py = Cross(px, pointLightDir);
-                                        u32 hash = SimpleHash((u32)rayIndex);
-                                        f32 pr = SafeDivide0(pointLightRadius, pointLightLength)*((f32)(hash & 0xffff)/65535.f);
-                                        f32 angle = ((f32)((hash >> 16) & 0xffff)/65535.f)*2*PI;
-                                        rayDir = Normalize(pointLightDir + pr*(px*Cos(angle) + py*Sin(angle)));
-                                    }
-                                    f32 shadowT = pointLightLength;
-                                    for(s32 i = 0; i < ArrayCount(spheres); i++){
-                                        if (i == 4) continue;
-                                        f32 t = IntersectSphere(spheres[i], p, rayDir);
-                                        if (t > .001f && t < shadowT){
-                                            shadowT = t;
-                                        }
-                                    }
-                                    if (shadowT < pointLightLength){
-                                        occludedRaysCount++;
-                                    }
-                                }
-                                f32 l = (f32)(numRays - occludedRaysCount)/(f32)numRays;
-#endif
-                                
-                                // New method: Project each sphere to 2d, circle intersection is the blocked area...
-                                // r0 and r1 are the radius of light that will affect the pixel. r0 is the radius at 'p' and r1 is the radius at the light source.
-#if 1
-                                f32 pixelArea = (worldFrameDim.x/gs->frameDim.x)*(worldFrameDim.y/gs->frameDim.y);
-                                f32 r0 = SquareRoot(pixelArea/(PI*t));
-                                f32 r1 = spheres[4].r;
-                                v3 perpX = Perpendicular(pointLightDir);
-                                v3 perpY = Cross(perpX, pointLightDir);
-
-                                v3 test1 = Cross(perpX, perpY);
-                                v3 test2 = Cross(perpX, pointLightDir);
-                                v3 test3 = Cross(perpY, pointLightDir);
-
-                                f32 test1Length = Length(test1);
-                                f32 test2Length = Length(test2);
-                                f32 test3Length = Length(test3);
-                                f32 pointLightDirLength = Length(pointLightDir);
-                                f32 perpXLength = Length(perpX);
-                                f32 perpYLength = Length(perpY);
-
-                                f32 l = 1.f;
-                                f32 lMin = 1.f;
-                                f32 lSum = 1.f;
-                                f32 blockCount = 0;
-                                f32 blockedSum = 0;
-                                for(s32 i = 0; i < ArrayCount(spheres); i++){
-                                    if (i == 4) continue;
-
-                                    // 'd' is the distance from 'p' to the point in the ray closest to the sphere. Maybe we could use distance to sphere as approximation.
-                                    f32 d = Dot(spheres[i].c - p, pointLightDir);
-                                    if (d < 0 || d > pointLightLength) // Outside blocking range.
-                                        continue;
-
-                                    v2 sphereProj = {Dot(spheres[i].c - p, perpX), Dot(spheres[i].c - p, perpY)};
-
-                                    // 'r' is the radius of vision at the projected slice (where the sphere covers more area).
-                                    f32 r = LerpClamp(r0, r1, d/pointLightLength);
-                                    //f32 blockedArea = IntersectionAreaOfTwoCircles(V2(0), r, sphereProj, spheres[i].r);
-                                    //f32 blockedAmount = blockedArea/(PI*r*r);
-
-                                    f32 dis = Length(sphereProj);
-                                    f32 len = Min(r, dis + spheres[i].r) - Max(-r, dis - spheres[i].r);
-                                    f32 blockedAmount = Map01ToReverseSquare(Clamp01(len/r));
-                                    if (blockedAmount){
-                                        blockCount++;
-                                        blockedSum += blockedAmount;
-                                        lMin = Min(lMin, 1.f - blockedAmount);
-                                        lSum = Max(0, lSum - blockedAmount);
-                                    }
-                                }
-                                if (blockCount){
-                                    l = Min(lMin, Lerp(lMin, Lerp(lSum, 1.f - blockedSum/blockCount, .5f), .5f));
-                                }
-#endif
+    // PRESENTER_WINDOW
+    HWND window;
+    HDC dc;
+    HGLRC rc;
+    u32 vao;
+    u32 vbo;
+    u32 texture;
+    u32 shaderProgram;
 
-                                pointLight *= l;
-                            }
-                            
-                            //
-                            // Secondary rays
-                            //
-                            v3 reflectionCol = {};
-                            if (reflectivity && shapeIndex <= ArrayCount(spheres)){
-                                v3 ro2 = p;
-                                v3 rd2 = rd -2.f*Dot(rd, n)*n; // Reflect ray by the normal
-                                f32 tSphere2[ArrayCount(spheres)];
-                                for(s32 i = 0; i < ArrayCount(spheres); i++){
-                                    tSphere2[i] = IntersectSphere(spheres[i], ro2, rd2);
-                                }
-                                f32 tPlane2 = IntersectPlane(0, ro2, rd2);
-                                s32 shapeIndex2 = 0;
-
-                                f32 t2 = gs->camFar;
-                                for(s32 i = 0; i < ArrayCount(spheres); i++){
-                                    if (tSphere2[i] > gs->camNear && tSphere2[i] < t2){
-                                        t2 = tSphere2[i];
-                                        shapeIndex2 = 1 + i;
-                                    }
-                                }
-                                if (tPlane2 > gs->camNear && tPlane2 < t2){
-                                    t2 = tPlane2;
-                                    shapeIndex2 = 10;
-                                }
-
-                                //
-                                // Color
-                                //
-                                v3 col2 = {0};
-                                if (shapeIndex2){
-                                    v3 p2 = ro2 + rd2*t2;
-                                    v3 shapeCol2 = materials[shapeIndex2].color;
-                                    //v3 n2;
-                                    //if (shapeIndex2 >= 1 && shapeIndex2 <= ArrayCount(spheres)){ // Spheres
-                                        //n2 = NormalSphere(spheres[shapeIndex2 - 1], p2); // BUG: Why does this mess up the plane's shading?
-                                    //}else
-                                    //if (shapeIndex2 == 10){ // Plane
-                                    //	n2 = NormalPlane();
-                                    //}
-                                    col2 = shapeCol2;
-                                }
-                                reflectionCol = col2*(.06f*Square(Clamp01(1.f - Dot(n, -rd))) + .01f); // Fresnel kinda thing
-                            }
-
-                            
-                            v3 specular = {};
-                            if (pointLight){
-                                // Blinn-Phong
-                                v3 l = pointLightDir;
-                                v3 v = -rd;
-                                v3 h = Normalize(l + v);
-                                f32 intensity = 3.f*Pow(Dot(n, h), 50.f);
-                                specular = pointLight*intensity*V3(1.f, 1.f, 1.f)/pointLightLength;
-                            }
-
-                            //      emited light | ambient |  directional         |        spherical light  | specular  |  reflection
-                            col = shapeCol*(emit + .03f + .12f*Max(0, n.y)/*(.5f + .5f*n.y)*/ + pointLight) + specular + reflectionCol*reflectivity;
-                        }
+    // PRESENTER_FILES, in VIDEO_RGB from the workers.
+    char *directory;
+    image_encoder encoder;
+    s32 numFiles;
 
-                        pixel[0] = (u8)(Clamp01(LinearToSrgb(col.r))*255);
-                        pixel[1] = (u8)(Clamp01(LinearToSrgb(col.g))*255);
-                        pixel[2] = (u8)(Clamp01(LinearToSrgb(col.b))*255);
-                    }
-                }
+    // PRESENTER_SHARED_MEMORY
+    frame_ring ring;
+};
 
-                InterlockedIncrement((volatile LONG *)&gs->completedEntriesCount);
-                break;
-            }// Else another thread changed incremented entryIndex. We'll need to try again.
-        }
-    }
+b32 PresentToWindow(presenter *p, frame_view *view){
+    auto gs = &globalState;
+    DetileFrame(view, gs->frameBuffer);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, view->frameDim.x, view->frameDim.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, gs->frameBuffer);
+    return true;
 }
 
-extern int CALLBACK 
-WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR commandLine, int showCode){
-    auto gi = &globalInput;
+b32 PresentToFiles(presenter *p, frame_view *view){
+    char *extensions[] = {"ppm", "png", "qoi"};
+    char path[512];
+    sprintf_s(path, "%s/%05i.%s", p->directory, p->numFiles++, extensions[p->encoder.format]);
+    b32 result = WriteImage(&p->encoder, view->video, view->frameDim, view->frameDim.x*3, 3, path);
+    return result;
+}
+
+b32 PresentToSharedMemory(presenter *p, frame_view *view){
     auto gs = &globalState;
+    u32 *pixels = BeginFrameRingSlot(&p->ring, view->frameDim, gs->sceneTime, gs->sceneIndex);
+    DetileFrame(view, pixels);
+    PublishFrameRingSlot(&p->ring);
+    return true;
+}
 
-    //
-    // Initialization
-    //
-    QueryPerformanceFrequency(&globalPerformanceFrequency);
-    
-    // Set the Windows scheduler granularity to 1ms so that our Sleep() can be more granular.
-    UINT desiredSchedulerMS = 1;
-    b32 sleepIsGranular = (timeBeginPeriod(desiredSchedulerMS) == TIMERR_NOERROR);
-    
-    // Create Console
-    if (CREATE_CONSOLE){
-        if(AttachConsole((DWORD)-1) == 0){ // wasn't launched from console
-            AllocConsole(); // alloc your own instead
-        }
-    }
-    globalStdHandle = GetStdHandle(STD_OUTPUT_HANDLE);
+b32 PresentToNothing(presenter *p, frame_view *view){
+    return true;
+}
 
+b32 PresentFrame(presenter *p, frame_view *view){
+    s64 traceStart = GetTraceTime();
+    b32 result = p->present(p, view);
+    TraceEvent(TRACE_MAIN_THREAD, "Present", traceStart, -1);
+    return result;
+}
 
-    
-    //
-    //
-    //
-    
+// Makes the window and the OpenGL context, program and texture to draw the frames.
+b32 OpenWindowPresenter(presenter *p, HINSTANCE instance){
     WNDCLASSA windowClass = {};
     
     // NOTE: CS_OWNDC would allow to ask for the DeviceContext only once and pass it everywhere
@@ -809,7 +6966,7 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR commandLine, int showC
                                 0, 0, instance, 0);
         if (!window){
             OutputDebugStringA("window error :)\n");
-            return 1;
+            return false;
         }
     }else{
         OutputDebugStringA("ERROR CREATING WINDOW!\n");
@@ -829,10 +6986,10 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR commandLine, int showC
     int pf = ChoosePixelFormat(dc, &pfd);
 
     if (!pf)
-        return 0;
+        return false;
     
     if (!SetPixelFormat(dc, pf, &pfd))
-        return 0;
+        return false;
 
     DescribePixelFormat(dc, pf, sizeof(pfd), &pfd);
 
@@ -840,8 +6997,6 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR commandLine, int showC
     HGLRC rc = wglCreateContext(dc);
     wglMakeCurrent(dc, rc);
 
-    s32 timeInFrames = 0;
-    
     //
     // GL Get Procedures...
     //
@@ -896,48 +7051,6 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR commandLine, int showC
     glGenerateMipmap          = (gl_generate_mipmap            *)wglGetProcAddress("glGenerateMipmap");
     glActiveTexture           = (gl_active_texture             *)wglGetProcAddress("glActiveTexture");
 
-
-    //
-    // Init game state
-    //
-    gs->camPos = INITIAL_CAM_POS;
-    gs->camAngleY = INITIAL_CAM_ANGLE_Y; // Rotation around Y axis (hand rule).
-    gs->camAngleX = INITIAL_CAM_ANGLE_X; // Rotation around X axis (hand rule).
-    gs->camNear = .001f;
-    gs->camFar = MAX_F32;
-    gs->fovY = DegreesToRadians(95.f);
-    
-    // Make test image
-    gs->frameDim = V2S(FRAME_BUFFER_WIDTH, FRAME_BUFFER_HEIGHT);
-    gs->frameBuffer = (u8 *)malloc(gs->frameDim.x*gs->frameDim.y*3); // 3 bytes per pixel
-
-    // Init image memory
-    //for(s32 y = 0; y < gs->frameDim.y; y++){
-    //	for(s32 x = 0; x < gs->frameDim.x; x++){
-    //		v4 color = ColorFromHSV(((x + 200) % gs->frameDim.x)/(f32)(gs->frameDim.x - 1), y/(f32)(gs->frameDim.y - 1), y/(f32)(gs->frameDim.y - 1));
-    //		u8 *dest = &gs->imageData[(y*gs->frameDim.x + x)*3];
-    //		dest[0] = (u8)(color.r*255);
-    //		dest[1] = (u8)(color.g*255);
-    //		dest[2] = (u8)(color.b*255);
-    //	}
-    //}
-
-    gs->semaphoreEntriesToDo = CreateSemaphore(NULL, 0, gs->frameDim.y, NULL);
-
-    _mm_sfence();
-
-    // Create worker threads
-    for(s32 i = 0; i < NUM_WORKER_THREADS; i++){
-        DWORD threadId = 0;
-        HANDLE thread = CreateThread(NULL, 0, ThreadProc, NULL, 0, &threadId);
-        if (!thread){
-            Printf("Error creating thread %i.\n", i);
-        }
-    }
-    
-
-    BeginFrame();
-
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
     
@@ -962,18 +7075,12 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR commandLine, int showC
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    //glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, gs->frameDim.x, gs->frameDim.y, 0, GL_RGB, GL_UNSIGNED_BYTE, gs->frameBuffer);
+    //glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, gs->frameDim.x, gs->frameDim.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, gs->frameBuffer);
 
     //
     // Shaders
     //
 
-    
-    struct vertex_data{
-        v2 pos;
-        v2 texPos;
-    };
-    
     char *vertexShaderStr = R"END(
 #version 330 core
 layout (location = 0) in vec2 aPos;
@@ -1062,7 +7169,352 @@ void main(){
     glUseProgram(shaderProgram);
     glUniform1i(vertexUniformLocationTexture, 0); // Set the texture sampler uniform. This won't change.
 
+    p->type = PRESENTER_WINDOW;
+    p->present = PresentToWindow;
+    p->window = window;
+    p->dc = dc;
+    p->rc = rc;
+    p->vao = vao;
+    p->vbo = vbo;
+    p->texture = sceneTextureHandler;
+    p->shaderProgram = shaderProgram;
+    return true;
+}
+
+// Draws the last frame presented, scaled to the window.
+void DrawWindowPresenter(presenter *p){
+    auto gs = &globalState;
+    v2 winDim = globalInput.windowDim;
+    glViewport(0,0, (GLsizei)winDim.x, (GLsizei)winDim.y); // change draw viewport size.
+
+    glClearColor(0.12f, .06f, .2f, 1.f);
+
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glUseProgram(p->shaderProgram);
 
+    glBindTexture(GL_TEXTURE_2D, p->texture);
+    
+// Converts from range [0, winDim] to [-1, 1]
+#define WINDOW_COORD_TO_GL_X(x_) (((x_)/winDim.x)*2.f - 1.f)
+#define WINDOW_COORD_TO_GL_Y(y_) (((y_)/winDim.y)*2.f - 1.f)
+#define WINDOW_COORD_TO_GL(vec) V2(WINDOW_COORD_TO_GL_X((vec).x), WINDOW_COORD_TO_GL_Y((vec).y))
+
+    f32 imageScale = Min(winDim.x/gs->frameDim.x, winDim.y/gs->frameDim.y);
+    v2 p0 = WINDOW_COORD_TO_GL(winDim/2 - V2(gs->frameDim)*imageScale/2);
+    v2 p1 = WINDOW_COORD_TO_GL(winDim/2 + V2(gs->frameDim)*imageScale/2);
+    v2 t0 = V2(0);
+    v2 t1 = V2(1);
+    vertex_data vertices[6] = {{{p0.x, p1.y},  {t0.x, t1.y}},  // Bottom-Left
+                               {{p1.x, p0.y},  {t1.x, t0.y}},  // Top-Right
+                               {{p0.x, p0.y},  {t0.x, t0.y}},  // Top-Left
+
+                               {{p0.x, p1.y},  {t0.x, t1.y}},  // Bottom-Left
+                               {{p1.x, p1.y},  {t1.x, t1.y}},  // Bottom-Right
+                               {{p1.x, p0.y},  {t1.x, t0.y}}}; // Top-Right
+    glBindBuffer(GL_ARRAY_BUFFER, p->vbo); // Bind the buffer so the next calls apply to it.
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STREAM_DRAW);
+    glBindVertexArray(p->vao);
+
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+
+    glBindVertexArray(0);
+    
+
+    glFlush();
+    SwapBuffers(p->dc);
+}
+
+void CloseWindowPresenter(presenter *p){
+    wglMakeCurrent(NULL, NULL);
+    ReleaseDC(p->window, p->dc);
+    wglDeleteContext(p->rc);
+    DestroyWindow(p->window);
+}
+
+// For the presenters without a window, after InitRenderer(). 'target' is the directory of the files or the
+// name of the mapping.
+b32 OpenHeadlessPresenter(presenter *p, presenter_type type, image_format imageFormat, char *target){
+    auto gs = &globalState;
+    *p = {};
+    p->type = type;
+    if (type == PRESENTER_FILES){
+        p->present = PresentToFiles;
+        p->directory = (target ? target : "frames");
+        InitImageEncoder(&p->encoder, imageFormat);
+        CreateDirectoryA(p->directory, 0);
+        gs->views[0]->videoFormat = VIDEO_RGB; // The workers convert the tiles for the encoder.
+    }else if (type == PRESENTER_SHARED_MEMORY){
+        p->present = PresentToSharedMemory;
+        char *name = (target ? target : FRAME_RING_DEFAULT_NAME);
+        if (!OpenFrameRing(&p->ring, name, V2S(FRAME_BUFFER_WIDTH, FRAME_BUFFER_HEIGHT)))
+            return false;
+        Printf("Frame ring: publishing frames in %s.\n", name);
+    }else{
+        p->present = PresentToNothing;
+    }
+    return true;
+}
+
+// Renders 'numFrames' frames (or until it's closed if 0), each one at the scene time it begins, or a
+// VIDEO_FRAME_RATE step after the previous one for files, so that they make an animation. Stops and
+// returns 1 if a frame can't be presented.
+int RunHeadless(presenter *p, s32 numFrames){
+    auto gs = &globalState;
+    LARGE_INTEGER startTime = GetCurrentTimeCounter();
+    LARGE_INTEGER reportTime = startTime;
+    s32 numReported = 0;
+    int result = 0;
+    s32 frameIndex = 0;
+    for(; !numFrames || frameIndex < numFrames; frameIndex++){
+        if (p->type == PRESENTER_FILES){
+            BeginFrameAt((f32)frameIndex/VIDEO_FRAME_RATE);
+        }else{
+            BeginFrame();
+        }
+        s64 traceStart = GetTraceTime();
+        WaitForWorkEntries();
+        TraceEvent(TRACE_MAIN_THREAD, "Wait for frame", traceStart, -1);
+        if (!PresentFrame(p, gs->views[0])){
+            Printf("Present: stopped at frame %i, it can't be presented.\n", frameIndex);
+            result = 1;
+            break;
+        }
+        numReported++;
+
+        f32 sinceReport = GetSecondsElapsed(reportTime, GetCurrentTimeCounter());
+        if (sinceReport > 1.f){
+            Printf("%.1f frames per second.\n", numReported/sinceReport);
+            PrintProfile();
+            reportTime = GetCurrentTimeCounter();
+            numReported = 0;
+        }
+    }
+    f32 seconds = GetSecondsElapsed(startTime, GetCurrentTimeCounter());
+    Printf("%i frames in %.2fs, %.2fms per frame.\n", frameIndex, seconds, 1000.f*seconds/MaxS32(frameIndex, 1));
+    CollectProfile(1);
+    PrintProfile();
+    FinishTrace();
+    return result;
+}
+
+void PrintUsage(){
+    Printf("Usage: program [-trace <file>] [-heatmap] [-noprefetch] [mode]\n"
+           "  -coordinator [port]\n"
+           "  -worker <host> [port]\n"
+           "  -server [port]\n"
+           "  -batch <views file> [scene] [time] [ppm|png|qoi]\n"
+           "  -stream <y4m|rgb> <file|pipe|-> <views file> [scene] [time]\n"
+           "  -present <window|null|shm|ppm|png|qoi> [scene] [frames] [target]\n"
+           "  -shm [name] [scene]\n");
+}
+
+// Splits the next argument off the command line (they're separated by spaces). Returns 0 if there are no more.
+char *NextArgument(char **at){
+    while(**at == ' '){
+        (*at)++;
+    }
+    if (!**at)
+        return 0;
+    char *result = *at;
+    while(**at && **at != ' '){
+        (*at)++;
+    }
+    if (**at){
+        **at = 0;
+        (*at)++;
+    }
+    return result;
+}
+
+extern int CALLBACK 
+WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR commandLine, int showCode){
+    auto gi = &globalInput;
+    auto gs = &globalState;
+
+    //
+    // Initialization
+    //
+    QueryPerformanceFrequency(&globalPerformanceFrequency);
+    
+    // Set the Windows scheduler granularity to 1ms so that our Sleep() can be more granular.
+    UINT desiredSchedulerMS = 1;
+    b32 sleepIsGranular = (timeBeginPeriod(desiredSchedulerMS) == TIMERR_NOERROR);
+    
+    // Command line: -coordinator [port] to split the frames with worker processes, -worker <host> [port] to be one,
+    // -server [port] to render frames for other programs, -batch <views file> [scene] [time] [ppm|png|qoi] to render
+    // many views of a scene to the frames directory, -stream <y4m|rgb> <file|pipe|-> <views file> [scene] [time] to send them
+    // to a video encoder, -present <window|null|shm|ppm|png|qoi> [scene] [frames] [target] to choose where the frames go.
+    // Any of them but -worker and -server can go after -trace <file>, to record the first frames, and -heatmap, to
+    // show the cycles of each pixel instead of its color. Any of them can go after -noprefetch, to let the pages
+    // of a sphere file be read only when the rays touch them.
+    char *arguments = commandLine;
+    char *mode = NextArgument(&arguments);
+    char *tracePath = 0;
+    b32 heatmap = false;
+    b32 prefetch = true;
+    while(mode && (!strcmp(mode, "-trace") || !strcmp(mode, "-heatmap") || !strcmp(mode, "-noprefetch"))){
+        if (!strcmp(mode, "-trace")){
+            tracePath = NextArgument(&arguments);
+        }else if (!strcmp(mode, "-heatmap")){
+            heatmap = true;
+        }else{
+            prefetch = false;
+        }
+        mode = NextArgument(&arguments);
+    }
+    char *coordinatorPort = 0;
+    char *workerHost = 0;
+    char *workerPort = 0;
+    char *serverPort = 0;
+    presenter_type presenterType = PRESENTER_WINDOW;
+    image_format presentImageFormat = IMAGE_PPM;
+    s32 presentScene = 0;
+    s32 presentFrames = 0;
+    char *presentTarget = 0;
+    char *batchPath = 0;
+    s32 batchScene = 0;
+    f32 batchTime = 0;
+    video_format batchFormat = VIDEO_NONE;
+    image_format batchImageFormat = IMAGE_PPM;
+    char *batchOutput = "frames";
+    char *badArgument = 0; // Printed with the usage once there's a console. The mode if its arguments are missing.
+    b32 streaming = (mode && !strcmp(mode, "-stream"));
+    if (streaming){
+        char *format = NextArgument(&arguments);
+        if (format && !strcmp(format, "rgb")){
+            batchFormat = VIDEO_RGB;
+        }else if (format && !strcmp(format, "y4m")){
+            batchFormat = VIDEO_YUV420;
+        }else{
+            badArgument = (format ? format : mode);
+        }
+        batchOutput = NextArgument(&arguments);
+        if (!batchOutput && !badArgument){
+            badArgument = mode;
+        }
+    }
+    if (mode && (!strcmp(mode, "-batch") || (streaming && batchOutput && !badArgument))){
+        batchPath = NextArgument(&arguments);
+        if (!batchPath){
+            badArgument = mode;
+        }
+        char *scene = NextArgument(&arguments);
+        char *time = (scene ? NextArgument(&arguments) : 0);
+        batchScene = (scene ? (s32)strtol(scene, 0, 10) - 1 : 0); // Numbered like the keys.
+        batchTime = (time ? strtof(time, 0) : 0);
+        char *imageFormat = (time ? NextArgument(&arguments) : 0);
+        if (imageFormat && !strcmp(imageFormat, "png")){
+            batchImageFormat = IMAGE_PNG;
+        }else if (imageFormat && !strcmp(imageFormat, "qoi")){
+            batchImageFormat = IMAGE_QOI;
+        }else if (imageFormat && (streaming || strcmp(imageFormat, "ppm"))){
+            badArgument = imageFormat;
+        }
+    }else if (mode && !strcmp(mode, "-present")){
+        char *backend = NextArgument(&arguments);
+        char *scene = (backend ? NextArgument(&arguments) : 0);
+        char *frames = (scene ? NextArgument(&arguments) : 0);
+        presentTarget = (frames ? NextArgument(&arguments) : 0);
+        if (!backend || !strcmp(backend, "window")){
+            presenterType = PRESENTER_WINDOW;
+        }else if (!strcmp(backend, "shm")){
+            presenterType = PRESENTER_SHARED_MEMORY;
+        }else if (!strcmp(backend, "ppm") || !strcmp(backend, "png") || !strcmp(backend, "qoi")){
+            presenterType = PRESENTER_FILES;
+            presentImageFormat = (!strcmp(backend, "png") ? IMAGE_PNG : !strcmp(backend, "qoi") ? IMAGE_QOI : IMAGE_PPM);
+        }else if (!strcmp(backend, "null")){
+            presenterType = PRESENTER_NULL;
+        }else{
+            badArgument = backend;
+        }
+        presentScene = (scene ? (s32)strtol(scene, 0, 10) - 1 : 0);
+        presentFrames = (frames ? (s32)strtol(frames, 0, 10) : 0);
+    }else if (mode && !strcmp(mode, "-shm")){ // Same as -present shm, with the name first.
+        presentTarget = NextArgument(&arguments);
+        char *scene = (presentTarget ? NextArgument(&arguments) : 0);
+        presenterType = PRESENTER_SHARED_MEMORY;
+        presentScene = (scene ? (s32)strtol(scene, 0, 10) - 1 : 0);
+    }else if (mode && !strcmp(mode, "-server")){
+        serverPort = NextArgument(&arguments);
+        if (!serverPort){
+            serverPort = SERVER_DEFAULT_PORT;
+        }
+    }else if (mode && !strcmp(mode, "-coordinator")){
+        coordinatorPort = NextArgument(&arguments);
+        if (!coordinatorPort){
+            coordinatorPort = NET_DEFAULT_PORT;
+        }
+    }else if (mode && !strcmp(mode, "-worker")){
+        workerHost = NextArgument(&arguments);
+        workerPort = NextArgument(&arguments);
+        if (!workerHost){
+            workerHost = "localhost";
+        }
+        if (!workerPort){
+            workerPort = NET_DEFAULT_PORT;
+        }
+    }
+
+    // Create Console
+    HANDLE standardOutput = GetStdHandle(STD_OUTPUT_HANDLE); // Before the console, in case it's a pipe.
+    if (CREATE_CONSOLE || workerHost || coordinatorPort || serverPort || batchPath || presenterType != PRESENTER_WINDOW || tracePath || badArgument){
+        if(AttachConsole((DWORD)-1) == 0){ // wasn't launched from console
+            AllocConsole(); // alloc your own instead
+        }
+    }
+    globalStdHandle = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (batchPath && !strcmp(batchOutput, "-")){
+        globalStdHandle = GetStdHandle(STD_ERROR_HANDLE); // The frames go to the standard output.
+    }
+    if (badArgument){
+        Printf("Bad argument: %s\n", badArgument);
+        PrintUsage();
+        return 1;
+    }
+
+    gs->prefetchSphereFile = prefetch;
+    if (workerHost){ // No window.
+        return RunRenderWorker(workerHost, workerPort);
+    }
+    if (serverPort){
+        return RunRenderServer(serverPort);
+    }
+    if (tracePath){
+        StartTrace(tracePath, TRACE_FRAMES); // Loading the scene is recorded too.
+    }
+    gs->heatmap = heatmap;
+    gs->sceneIndex = (presentScene >= 0 && presentScene < NUM_SCENES ? presentScene : 0);
+    gs->requestedSceneIndex = gs->sceneIndex;
+    if (presenterType != PRESENTER_WINDOW){
+        InitRenderer();
+        presenter p = {};
+        if (!OpenHeadlessPresenter(&p, presenterType, presentImageFormat, presentTarget))
+            return 1;
+        return RunHeadless(&p, presentFrames);
+    }
+    if (batchPath){
+        return RunBatch(batchPath, batchScene, batchTime, batchImageFormat, batchFormat, batchOutput, standardOutput);
+    }
+
+
+    
+    //
+    //
+    //
+    
+    presenter p = {};
+    if (!OpenWindowPresenter(&p, instance))
+        return 1;
+
+    InitRenderer();
+    if (coordinatorPort){
+        StartCoordinator(coordinatorPort);
+    }
+    BeginFrame();
+
+
+    s32 timeInFrames = 0;
     LARGE_INTEGER lastFrameTime = GetCurrentTimeCounter();
     LARGE_INTEGER lastFpsUpdateTime = GetCurrentTimeCounter();
     globalRunning = true;
@@ -1083,7 +7535,8 @@ void main(){
             
             char title[256];
             sprintf_s(title, "FPS: %.0f   StepsPS: %.0f", fps, steps);
-            SetWindowTextA(window, title);
+            SetWindowTextA(p.window, title);
+            PrintProfile();
         }
 
 
@@ -1148,13 +7601,13 @@ void main(){
         //
         // Mouse Input
         //
-        globalInput.windowDim = GetWindowDimension(window);
+        globalInput.windowDim = GetWindowDimension(p.window);
 
         v2 prevMousePos = gi->mousePos;
 
         POINT mousePoint;
         GetCursorPos(&mousePoint);
-        ScreenToClient(window, &mousePoint);
+        ScreenToClient(p.window, &mousePoint);
         gi->mousePos.x = (f32)(s32)mousePoint.x;
         gi->mousePos.y = (f32)(s32)(globalInput.windowDim.y - mousePoint.y);
         
@@ -1174,8 +7627,6 @@ void main(){
         // Program Code
         //
 
-        
-        v2 winDim = gi->windowDim;
 
 
         //
@@ -1219,64 +7670,106 @@ void main(){
             gs->camAngleX = INITIAL_CAM_ANGLE_X;
         }
 
+        // Change scene (applied when the current frame is finished)
+        if (ButtonWentDown(&gi->keyboard.numbers[1])){
+            gs->requestedSceneIndex = 0;
+        }else if (ButtonWentDown(&gi->keyboard.numbers[2])){
+            gs->requestedSceneIndex = 1;
+        }else if (ButtonWentDown(&gi->keyboard.numbers[3])){
+            gs->requestedSceneIndex = 2;
+        }else if (ButtonWentDown(&gi->keyboard.numbers[4])){
+            gs->requestedSceneIndex = 3;
+        }else if (ButtonWentDown(&gi->keyboard.numbers[5])){
+            gs->requestedSceneIndex = 4;
+        }else if (ButtonWentDown(&gi->keyboard.numbers[6])){
+            gs->requestedSceneIndex = 5;
+        }else if (ButtonWentDown(&gi->keyboard.numbers[7])){
+            gs->requestedSceneIndex = 6;
+        }else if (ButtonWentDown(&gi->keyboard.numbers[8])){
+            gs->requestedSceneIndex = 7;
+        }
+
+        // Move the first light, or the first sphere while Control is down (applied when the current frame is finished)
+        v3 objectMove = { camSpeed*((gi->keyboard.arrowRight.isDown ? 1.f : 0) + (gi->keyboard.arrowLeft.isDown ? -1.f : 0)),
+                          0,
+                          camSpeed*((gi->keyboard.arrowUp.isDown ? 1.f : 0) + (gi->keyboard.arrowDown.isDown ? -1.f : 0)) };
+        if (gi->keyboard.control.isDown){
+            gs->requestedSphereMove += objectMove;
+        }else{
+            gs->requestedLightMove += objectMove;
+        }
+
+        if (ButtonWentDown(&gi->keyboard.letters['C' - 'A'])){
+            gs->useShadowCache = !gs->useShadowCache;
+        }
+        if (ButtonWentDown(&gi->keyboard.letters['G' - 'A'])){
+            gs->requestedParticleToggle = true;
+        }
+        if (ButtonWentDown(&gi->keyboard.letters['Q' - 'A'])){
+            gs->requestedQuantizeToggle = true;
+        }
+        if (ButtonWentDown(&gi->keyboard.letters['T' - 'A'])){
+            StartTrace("trace.json", TRACE_FRAMES);
+        }
+        if (ButtonWentDown(&gi->keyboard.letters['H' - 'A'])){
+            gs->heatmap = !gs->heatmap;
+        }
+        if (ButtonWentDown(&gi->keyboard.letters['P' - 'A'])){
+            particle_cloud *particles = &gs->scene.particles;
+            gs->prefetchSphereFile = !gs->prefetchSphereFile;
+            if (particles->fileView){ // So they're prefetched again when it's turned back on.
+                ZeroArrayPtr(particles->regionsPrefetched, particles->numRegions);
+            }
+            Printf("Sphere file prefetch: %s\n", (gs->prefetchSphereFile ? "on" : "off"));
+        }
+
         //if (V2(gs->camAngleX, gs->camAngleY) != prevAngles){
         //	Printf("Camera angle Y=%.3f, X=%.3f\n", gs->camAngleY, gs->camAngleX);
         //}
 
 
+        PollRenderWorkers();
         _mm_lfence();
-        if (gs->completedEntriesCount == gs->numEntries){
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, gs->frameDim.x, gs->frameDim.y, 0, GL_RGB, GL_UNSIGNED_BYTE, gs->frameBuffer);
+        if (gs->completedEntriesCount == gs->numEntries && !globalCoordinator.numRemoteTiles){
+            PresentFrame(&p, gs->views[0]);
             renderedFrameCountSinceFpsUpdate++;
 
             _ReadWriteBarrier(); // (maybe I overdo these but just in case...)
             _mm_sfence();
             _mm_lfence();
 
+            if (gs->requestedSceneIndex != gs->sceneIndex){
+                ChangeScene(gs->requestedSceneIndex);
+            }
+            if (gs->requestedLightMove != V3(0) || gs->requestedSphereMove != V3(0)){
+                scene *s = &gs->scene;
+                if (gs->requestedLightMove != V3(0) && s->numLights){
+                    s32 sphereIndex = s->lights[0].sphereIndex;
+                    MoveSphere(sphereIndex, s->spheres[sphereIndex].c + gs->requestedLightMove);
+                }
+                if (gs->requestedSphereMove != V3(0)){
+                    MoveSphere(0, s->spheres[0].c + gs->requestedSphereMove);
+                }
+                gs->requestedLightMove = V3(0);
+                gs->requestedSphereMove = V3(0);
+                UpdateShadowCache(&gs->shadowCache);
+            }
+            particle_cloud *particles = &gs->scene.particles;
+            if (gs->requestedParticleToggle && !particles->fileView){
+                particles->structure = (particles->structure == PARTICLES_GRID ? PARTICLES_BVH : PARTICLES_GRID);
+                Printf("Particles: %s\n", (particles->structure == PARTICLES_GRID ? "grid" : "BVH"));
+            }
+            if (gs->requestedQuantizeToggle && !particles->fileView){ // The file only has quantized spheres.
+                particles->quantized = !particles->quantized;
+                Printf("Particles: %s spheres\n", (particles->quantized ? "quantized" : "full"));
+            }
+            gs->requestedParticleToggle = false;
+            gs->requestedQuantizeToggle = false;
+
             BeginFrame();
         }
 
-        //
-        // Render
-        //
-        glViewport(0,0, (GLsizei)gi->windowDim.x, (GLsizei)gi->windowDim.y); // change draw viewport size.
-    
-        glClearColor(0.12f, .06f, .2f, 1.f);
-
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        glUseProgram(shaderProgram);
-
-        glBindTexture(GL_TEXTURE_2D, sceneTextureHandler);
-        
-// Converts from range [0, winDim] to [-1, 1]
-#define WINDOW_COORD_TO_GL_X(x_) (((x_)/winDim.x)*2.f - 1.f)
-#define WINDOW_COORD_TO_GL_Y(y_) (((y_)/winDim.y)*2.f - 1.f)
-#define WINDOW_COORD_TO_GL(vec) V2(WINDOW_COORD_TO_GL_X((vec).x), WINDOW_COORD_TO_GL_Y((vec).y))
-
-        f32 imageScale = Min(winDim.x/gs->frameDim.x, winDim.y/gs->frameDim.y);
-        v2 p0 = WINDOW_COORD_TO_GL(winDim/2 - V2(gs->frameDim)*imageScale/2);
-        v2 p1 = WINDOW_COORD_TO_GL(winDim/2 + V2(gs->frameDim)*imageScale/2);
-        v2 t0 = V2(0);
-        v2 t1 = V2(1);
-        vertex_data vertices[6] = {{{p0.x, p1.y},  {t0.x, t1.y}},  // Bottom-Left
-                                   {{p1.x, p0.y},  {t1.x, t0.y}},  // Top-Right
-                                   {{p0.x, p0.y},  {t0.x, t0.y}},  // Top-Left
-
-                                   {{p0.x, p1.y},  {t0.x, t1.y}},  // Bottom-Left
-                                   {{p1.x, p1.y},  {t1.x, t1.y}},  // Bottom-Right
-                                   {{p1.x, p0.y},  {t1.x, t0.y}}}; // Top-Right
-        glBindBuffer(GL_ARRAY_BUFFER, vbo); // Bind the buffer so the next calls apply to it.
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STREAM_DRAW);
-        glBindVertexArray(vao);
-
-        glDrawArrays(GL_TRIANGLES, 0, 6);
-
-        glBindVertexArray(0);
-        
-
-        glFlush();
-        SwapBuffers(dc);
+        DrawWindowPresenter(&p);
 
 
         //
@@ -1307,12 +7800,9 @@ void main(){
         firstFrame = false;
     }
 
+    FinishTrace();
     FreeConsole();
-
-    wglMakeCurrent(NULL, NULL);
-    ReleaseDC(window, dc);
-    wglDeleteContext(rc);
-    DestroyWindow(window);
+    CloseWindowPresenter(&p);
 
     return 0;
 }
@@ -741,6 +741,18 @@ inline v3 Cross(v3 a, v3 b){
     v3 result = {a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x};
     return result;
 }
+inline v3 Hadamard(v3 a, v3 b){
+    v3 result = {a.x*b.x, a.y*b.y, a.z*b.z};
+    return result;
+}
+inline v3 Min(v3 a, v3 b){
+    v3 result = {Min(a.x, b.x), Min(a.y, b.y), Min(a.z, b.z)};
+    return result;
+}
+inline v3 Max(v3 a, v3 b){
+    v3 result = {Max(a.x, b.x), Max(a.y, b.y), Max(a.z, b.z)};
+    return result;
+}
 
 // - Returns a unit vector perpendicular to 'a'.
 inline v3 Perpendicular(v3 a){